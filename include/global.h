@@ -13,12 +13,81 @@
  */
 #define USAGE(program_name, retcode) do { \
 fprintf(stderr, "USAGE: %s %s\n", program_name, \
-"[-h] [-m|-n] [-o <name>]\n" \
+"[-h] [-m|-n] [-o <name>] [-E <file>] [-N <file>] [-M <file>] [-z <level>]\n" \
+"       [-t] [-r <names>] [-c <names>] [-s <cutoff>] [-e <engine>] [-j <threads>] [-R <seed>]\n" \
+"       [-b <refinement>] [-k <clusters>|-l <distance>] [-L <KiB>] [-w <ms>]\n" \
+"       [-i <format>] [-d <model>] [-K <k>] [-S <size>] [-C <dir>] [-F <rows>] [-q <file>] [-p]\n" \
+"       [-u] [-D] [-V]\n" \
 "   -h         Help: displays this help menu.\n" \
 "   -m         Output matrix of estimated distances, instead of edge data.\n" \
 "   -n         Output tree in Newick format, instead of edge data.\n" \
 "   -o <name>  Use <name> as the name of the outlier node to use for Newick output\n" \
-"              (only permitted if -n has already appeared).\n" \
+"              (only permitted if -n or -N has already appeared).\n" \
+"   -E <file>  Also write the edge data to <file>.\n" \
+"   -N <file>  Also write the tree in Newick format to <file>.\n" \
+"   -M <file>  Also write the matrix of estimated distances to <file>.\n" \
+"   -z <level> Compress the matrix output in gzip format at <level> (1-9)\n" \
+"              (only permitted if -m, -M or -p also appears).\n" \
+"   -t         Output only the upper triangle of the matrix.\n" \
+"   -r <names> Output only the matrix rows for the comma-separated node names.\n" \
+"   -c <names> Output only the matrix columns for the comma-separated node names.\n" \
+"              In a list of names, @leaves and @internal stand for all leaf and\n" \
+"              all internal nodes.\n" \
+"   -s <cutoff> Output the matrix as sparse 'i,j,d' lines, for distances d <= <cutoff>.\n" \
+"              The options -t, -r, -c and -s are only permitted if -m or -M also appears.\n" \
+"   -e <engine> Use <engine> to build the tree: nj (the default), nj-mt, nj-f32 and\n" \
+"              nj-q16 (scanning float and 16-bit copies of the matrix), bionj,\n" \
+"              upgma, wpgma, rnj (relaxed neighbor joining), nj-batch (several\n" \
+"              joins per scan), single (single linkage from a minimum spanning tree),\n" \
+"              dc (divide and conquer over clusters of nearby taxa) or nj-lazy\n" \
+"              (computing the distances from the sequences as they are needed).\n" \
+"   -R <seed>  Visit rows in a random order determined by <seed> in the relaxed\n" \
+"              neighbor joining engine, instead of in order (only permitted with -e rnj).\n" \
+"   -b <refinement> Refine the tree under the balanced minimum evolution criterion\n" \
+"              with NNI moves (nni) or with NNI and SPR moves (spr).\n" \
+"   -k <clusters> Output the minimum spanning tree cut into <clusters> clusters\n" \
+"              as the edge data (only permitted with -e single).\n" \
+"   -l <distance> Output the minimum spanning tree cut at edges longer than <distance>\n" \
+"              as the edge data (only permitted with -e single).\n" \
+"   -L <KiB>   Size the clusters of the divide-and-conquer engine so that the\n" \
+"              distances of each would fit in <KiB> (only permitted with -e dc).\n" \
+"   -w <ms>    Finish the tree with the batched engine if it is not complete <ms>\n" \
+"              milliseconds after the build started (the clustering engines finish\n" \
+"              with their own steps).\n" \
+"   -j <threads> Number of worker threads for parallel engines (default: all processors).\n" \
+"   -i <format> Read the input in <format>, one of:\n" \
+"                csv      a distance matrix (the default);\n" \
+"                fasta    aligned nucleotide sequences in FASTA format, from which\n" \
+"                         p-distances are computed;\n" \
+"                protein  aligned amino acid sequences in FASTA format, from which\n" \
+"                         p-distances are computed;\n" \
+"                genomes  a list of paths of genome assemblies in FASTA format, from\n" \
+"                         which Mash distances are estimated;\n" \
+"                vcf      biallelic genotypes in VCF format, from which allele-sharing\n" \
+"                         distances are computed.\n" \
+"   -d <model> Correct the distances computed from an alignment for multiple\n" \
+"              substitutions under the jc69, k2p or tn93 model (only permitted\n" \
+"              with -i fasta), or the poisson or kimura model (only permitted\n" \
+"              with -i protein).\n" \
+"   -K <k>     Size of the k-mers of the genome sketches, from 1 to 32 (default: 21).\n" \
+"   -S <size>  Number of hashes in each genome sketch, from 1 to 10000 (default: 1000).\n" \
+"   -C <dir>   Cache the genome sketches in the directory <dir>. The options -K, -S\n" \
+"              and -C are only permitted with -i genomes.\n" \
+"   -F <rows>  Number of rows of distances cached by the nj-lazy engine (default: 16).\n" \
+"              The nj-lazy engine needs -i fasta or -i protein, and is not permitted\n" \
+"              with -m, -M, -p, -u, -b, -w or -D, which need the whole matrix.\n" \
+"   -q <file>  Output the lengths of the paths in the tree between the pairs of nodes\n" \
+"              listed in <file>, one 'a,b' per line by name or index, instead of\n" \
+"              the edge data (not permitted with -m or -n).\n" \
+"   -p         Output the matrix of the lengths of the paths in the tree between the\n" \
+"              taxa, instead of edge data, and report on the standard error how far\n" \
+"              they are from the input distances (not permitted with -m, -n or -q).\n" \
+"   -u         Build the tree on one taxon of each set of taxa with identical rows of\n" \
+"              distances, and attach the others to it by edges of length zero.\n" \
+"   -D         Report on the standard error the largest difference of any row sum\n" \
+"              from an exact recomputation.\n" \
+"   -V         Verify that every exact engine builds the same tree as nj, instead of\n" \
+"              producing any output (not permitted with -e).\n" \
 "\n" \
 "If -h is specified, then it must be the first option on the command line, and any\n"\
 "other options are ignored.\n" \
@@ -35,6 +104,9 @@ fprintf(stderr, "USAGE: %s %s\n", program_name, \
 "after -n, is used to specify the name of an 'outlier' node to be used in constructing a rooted\n" \
 "tree for Newick output.\n" \
 "\n" \
+"The -E, -N and -M options may be combined with each other and with -m or -n.  The tree\n" \
+"is then synthesized only once and the requested outputs are written concurrently.\n" \
+"\n" \
 ); \
 exit(retcode); \
 } while(0)
@@ -52,10 +124,141 @@ long global_options;
 #define HELP_OPTION      (0x00000001)
 #define NEWICK_OPTION    (0x00000002)
 #define MATRIX_OPTION    (0x00000004)
+#define EDGES_FILE_OPTION  (0x00000008)
+#define NEWICK_FILE_OPTION (0x00000010)
+#define MATRIX_FILE_OPTION (0x00000020)
+#define COMPRESS_OPTION    (0x00000040)
+#define TRIANGLE_OPTION    (0x00000080)
+#define ROWS_OPTION        (0x00000100)
+#define COLUMNS_OPTION     (0x00000200)
+#define SPARSE_OPTION      (0x00000400)
+#define ENGINE_OPTION      (0x00000800)
+#define THREADS_OPTION     (0x00001000)
+#define VERIFY_OPTION      (0x00002000)
+#define SEED_OPTION        (0x00004000)
+#define REFINE_OPTION      (0x00008000)
+#define CLUSTERS_OPTION    (0x00010000)
+#define THRESHOLD_OPTION   (0x00020000)
+#define DRIFT_OPTION       (0x00040000)
+#define COLLAPSE_OPTION    (0x00080000)
+#define BUDGET_OPTION      (0x00100000)
+#define DEADLINE_OPTION    (0x00200000)
+#define INPUT_OPTION       (0x00400000)
+#define MODEL_OPTION       (0x00800000)
+#define KMER_OPTION        (0x01000000)
+#define SKETCH_OPTION      (0x02000000)
+#define CACHE_OPTION       (0x04000000)
+#define ROW_CACHE_OPTION   (0x08000000)
+#define QUERY_OPTION       (0x10000000)
+#define PATRISTIC_OPTION   (0x20000000)
 
 /* Name of a leaf node to be used as an "outlier", otherwise NULL. */
 char *outlier_name;
 
+/*
+ * Names of the files given with -E, -N and -M, to which the edge data,
+ * the Newick tree and the distance matrix are written, otherwise NULL.
+ */
+char *edges_filename;
+char *newick_filename;
+char *matrix_filename;
+
+/* Name of the file of pairs of nodes given with -q, otherwise NULL. */
+char *query_filename;
+
+/* Gzip compression level (1-9) for the matrix output given with -z, otherwise 0. */
+int compression_level;
+
+/*
+ * Comma-separated lists of node names given with -r and -c, selecting the
+ * rows and columns of the matrix output, otherwise NULL for all of them.
+ */
+char *matrix_rows;
+char *matrix_columns;
+
+/* Largest distance included in the sparse matrix output selected by -s. */
+double matrix_cutoff;
+
+/* Name of the engine given with -e, otherwise NULL for the reference engine. */
+char *engine_name;
+
+/* Number of worker threads given with -j, otherwise 0 for all processors. */
+int num_threads;
+
+/* Seed given with -R for randomized row visiting, otherwise 0 for ordered visiting. */
+unsigned long random_seed;
+
+/* Refinement of the tree given with -b, otherwise REFINE_NONE. */
+int refinement;
+#define REFINE_NONE 0
+#define REFINE_NNI  1
+#define REFINE_SPR  2
+
+/*
+ * Number of clusters given with -k, or the longest spanning tree edge
+ * kept given with -l, for the flat clusters of the single-linkage engine.
+ */
+int num_clusters;
+double cluster_threshold;
+
+/* Budget in KiB that sets the cluster size of the divide-and-conquer engine, given with -L. */
+long memory_budget;
+
+/* Format of the input given with -i, otherwise INPUT_CSV. */
+int input_format;
+#define INPUT_CSV   0
+#define INPUT_FASTA 1
+#define INPUT_GENOMES 2
+#define INPUT_PROTEIN 3
+#define INPUT_VCF     4
+
+/* Evolutionary model of the distances computed from an alignment, given with -d. */
+int distance_model;
+#define MODEL_P    0
+#define MODEL_JC69 1
+#define MODEL_K2P  2
+#define MODEL_TN93 3
+#define MODEL_POISSON 4
+#define MODEL_KIMURA  5
+
+/* Distance given to pairs of sequences too different for the model. */
+#define SATURATED_DISTANCE 10.0
+
+/*
+ * Numbers of sites compared between two aligned sequences, and of the
+ * differences of each kind among them.
+ */
+typedef struct site_counts {
+    long compared;
+    long purine_transitions;
+    long pyrimidine_transitions;
+    long transversions;
+} SITE_COUNTS;
+
+/*
+ * Size of the k-mers and number of hashes of the genome sketches, given
+ * with -K and -S, and directory caching the sketches, given with -C,
+ * otherwise NULL.
+ */
+int kmer_size;
+int sketch_size;
+char *sketch_cache;
+#define MAX_SKETCH 10000
+
+/*
+ * Number of rows of distances between taxa cached by the matrix-free
+ * engine, given with -F, otherwise ROW_CACHE_DEFAULT with -e nj-lazy, and
+ * 0 when the distances are stored as a matrix.
+ */
+int row_cache_size;
+#define ROW_CACHE_DEFAULT 16
+
+/* Deadline in milliseconds for building the tree, given with -w. */
+long time_budget;
+
+/* Largest difference of a row sum from an exact recomputation, measured with -D. */
+double row_sum_drift;
+
 /* Maximum size of an input field (taxon name or distance). */
 #define INPUT_MAX 100
 
@@ -133,6 +336,149 @@ typedef struct node {
 /* Array containing storage for NODE structures. */
 NODE nodes[MAX_NODES];
 
+/* Maximum number of edges in a tree having at most MAX_NODES nodes. */
+#define MAX_EDGES (MAX_NODES - 1)
+
+/* Number of edges synthesized so far. */
+int num_edges;
+
+/*
+ * Edges of the synthesized tree, in the order in which they were created.
+ * Entry i connects nodes edge_nodes[i][0] and edge_nodes[i][1] (indices
+ * into the nodes array), and has the estimated length edge_lengths[i].
+ * Recording the edges allows all of the outputs to be produced after
+ * a single run of build_taxonomy().
+ */
+int edge_nodes[MAX_EDGES][2];
+double edge_lengths[MAX_EDGES];
+
+/*
+ * Compact copy of the synthesized tree, made by compact_tree() once the
+ * tree is complete, as a structure of arrays indexed by position rather
+ * than as NODE structures linked by pointers.  The positions number the
+ * nodes in breadth-first order from the position 0, so that a traversal
+ * reads the arrays nearly in order.  tree_neighbors[p] holds the positions
+ * of the neighbors of position p, in the order of the neighbors of its
+ * NODE, or -1, and tree_branches[p] the lengths of the edges to them.  The
+ * name of position p starts at offset tree_name_offsets[p] in the
+ * tree_names arena, and tree_nodes[p] is its index in the nodes array,
+ * whose position is tree_positions[tree_nodes[p]].  The NODE structures
+ * are kept as they are.
+ */
+int tree_size;
+int tree_neighbors[MAX_NODES][3];
+double tree_branches[MAX_NODES][3];
+int tree_name_offsets[MAX_NODES];
+char tree_names[MAX_NODES * (INPUT_MAX + 1)];
+int tree_nodes[MAX_NODES];
+int tree_positions[MAX_NODES];
+
+/*
+ * Engines that build the tree.  An engine repeatedly joins active nodes
+ * until only two remain, using the helper functions below so that the
+ * NODE structures, the edge data and the distances matrix are maintained
+ * in the same way by every engine.  "init", if non-NULL, is called once
+ * before the first join; "step" performs one or more joins; "last_edge",
+ * if non-NULL, gives the length of the final edge joining the last two
+ * active nodes, which is otherwise their distance.
+ *
+ * The active nodes are kept in increasing order of node index in
+ * active_node_map, and the row sums are accumulated in that order.
+ * Ties in Q(i,j) are broken canonically: of two pairs (f,g) with f < g
+ * and equal Q value, the one with the smaller f is chosen, and for equal f
+ * the one with the smaller g (see BETTER_PAIR).  The new node takes the
+ * next index and the edge to f is recorded before the edge to g.
+ *
+ * Engine contract: an engine marked "exact" must produce exactly the same
+ * result as the reference engine "nj" -- the same edges with bitwise
+ * identical lengths, the same NODE structures and the same distances
+ * matrix -- however it parallelizes, vectorizes or prunes its search.
+ * In practice this means choosing the same pair, applying the canonical
+ * tie-break, and computing row sums and joins with row_sum() and nj_join().
+ * The -V option checks the contract for all exact engines.
+ */
+typedef struct engine {
+    char *name;
+    int exact;
+    int (*init)(void);
+    int (*step)(void);
+    double (*last_edge)(int a, int b);
+} ENGINE;
+
+/* Table of engines, terminated by an entry whose name is NULL. */
+extern ENGINE engines[];
+
+/*
+ * Whether a pair (f,g) with Q value q is to be chosen over the pair
+ * (best_f,best_g) with Q value best_q under the canonical tie-break.
+ */
+#define BETTER_PAIR(q, f, g, best_q, best_f, best_g) \
+((q) < (best_q) || ((q) == (best_q) && ((f) < (best_f) || ((f) == (best_f) && (g) < (best_g)))))
+
+extern ENGINE *find_engine(char *name);
+extern int worker_threads(void);
+extern void run_parallel(void *(*routine)(void *), void *work, size_t size, int threads);
+extern double row_sum(int i);
+extern double active_sum(double *row);
+extern void compute_row_sums(void);
+extern void update_row_sums(int f, int g, int u);
+extern void check_row_sums(void);
+extern int new_node(void);
+extern void join_nodes(int f, int g, int u, double f_branch, double g_branch);
+extern void finish_tree(ENGINE *engine);
+extern int nj_join(int f, int g);
+extern void nj_best_pair(int *f, int *g);
+
+/* Engines defined outside engine.c. */
+extern int bionj_init(void);
+extern int bionj_step(void);
+extern int cluster_init(void);
+extern int upgma_step(void);
+extern int wpgma_step(void);
+extern double cluster_last_edge(int a, int b);
+extern int rnj_init(void);
+extern int rnj_step(void);
+extern int nj_batch_step(void);
+extern int nj_f32_init(void);
+extern int nj_f32_step(void);
+extern int nj_q16_init(void);
+extern int nj_q16_step(void);
+extern int single_init(void);
+extern int single_step(void);
+extern double single_last_edge(int a, int b);
+extern int dc_init(void);
+extern int dc_step(void);
+extern int nj_lazy_init(void);
+extern int nj_lazy_step(void);
+extern double nj_lazy_last_edge(int a, int b);
+extern double nj_lazy_distance(int i, int j);
+extern int emit_cluster_edges(FILE *out);
+extern void compact_tree(void);
+extern double patristic_distance(int a, int b);
+extern int emit_patristic_queries(FILE *in, FILE *out);
+extern int emit_patristic_matrix(FILE *out);
+extern int taxonomy_init(void);
+extern int taxonomy_step(int joins);
+extern int taxonomy_expired(void);
+extern int taxonomy_finalize(void);
+extern void reset_taxonomy(void);
+extern int verify_engines(FILE *out);
+extern int refine_tree(int mode);
+extern int collapse_duplicates(void);
+extern int reattach_duplicates(void);
+
+/*
+ * Buffered output stream used for large outputs such as the distance
+ * matrix.  A writer can compress its output in gzip format on a background
+ * thread, overlapping compression with formatting.  See writer.c.
+ */
+typedef struct writer WRITER;
+
+extern WRITER *writer_open(FILE *out, int level);
+extern void writer_write(WRITER *writer, char *data, size_t length);
+extern void writer_printf(WRITER *writer, char *format, ...);
+extern int writer_close(WRITER *writer);
+
 /*
  * Function you are to implement that validates and interprets command-line arguments
  * to the program.  See the stub in validargs.c for specifications.
@@ -146,8 +492,16 @@ extern int validargs(int argc, char **argv);
  */
 
 extern int read_distance_data(FILE *in);
+extern int read_alignment_data(FILE *in);
+extern int read_genome_data(FILE *in);
+extern int read_genotype_data(FILE *in);
+extern void count_differences(int i, int j, SITE_COUNTS *counts);
+extern int model_init(long *base_counts);
+extern int model_distances(SITE_COUNTS *counts, double *values, int n);
 extern int build_taxonomy(FILE *out);
 extern int emit_newick_format(FILE *out);
 extern int emit_distance_matrix(FILE *out);
+extern int emit_edge_data(FILE *out);
+extern int emit_outputs(FILE *edges_out, FILE *newick_out, FILE *matrix_out, FILE *patristic_out);
 
 #endif
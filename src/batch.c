@@ -0,0 +1,215 @@
+#include <stdlib.h>
+
+#include "global.h"
+#include "debug.h"
+
+/* Best partner of each active node in the current scan. */
+static int partners[MAX_NODES];
+
+/* The pairs joined in the current step, in increasing order of f. */
+static int pair_f[MAX_NODES / 2];
+static int pair_g[MAX_NODES / 2];
+static int pair_u[MAX_NODES / 2];
+static double pair_f_branch[MAX_NODES / 2];
+static double pair_g_branch[MAX_NODES / 2];
+static int num_pairs;
+
+/*
+ * Work of one thread of the batched engine.  In phase 0 the row sums of
+ * the active slots from, from + stride, ... are computed, in phase 1 the
+ * best partners of those rows are found, and in phase 2 the rows of the
+ * new nodes of the pairs from, from + stride, ... are filled in.
+ */
+typedef struct batch_work {
+    int from;
+    int stride;
+    int phase;
+} BATCH_WORK;
+
+/*
+ * Returns the active node j that minimizes Q(i,j) within the row of node i,
+ * preferring the node of smaller index in case of ties.
+ */
+static int best_partner(int i)
+{
+    int m = num_active_nodes;
+    double *row = *(distances + i);
+    double s_i = *(row_sums + i);
+    double best_q = 0.0;
+    int best = -1;
+    for (int k = 0; k < m; k++)
+    {
+        int k_index = *(active_node_map + k);
+        if (k_index == i)
+        {
+            continue;
+        }
+        double value = (m - 2) * *(row + k_index) - s_i - *(row_sums + k_index);
+        if (best == -1 || value < best_q)
+        {
+            best_q = value;
+            best = k_index;
+        }
+    }
+    return best;
+}
+
+/*
+ * Fills in the row of the new node of pair p, from the distances before
+ * any join of the step.  Only the row of the new node and the columns of
+ * the old nodes are written, so that pairs can be done concurrently: the
+ * distance between two new nodes is written into each row by its own pair.
+ */
+static void batch_new_row(int p)
+{
+    int f = *(pair_f + p);
+    int g = *(pair_g + p);
+    int u = *(pair_u + p);
+    double *f_row = *(distances + f);
+    double *g_row = *(distances + g);
+    double *u_row = *(distances + u);
+    double f_g = *(f_row + g);
+    for (int k = 0; k < num_active_nodes; k++)
+    {
+        int k_index = *(active_node_map + k);
+        double value;
+        if (k_index == f)
+            value = *(pair_f_branch + p);
+        else if (k_index == g)
+            value = *(pair_g_branch + p);
+        else
+            value = (*(f_row + k_index) + *(g_row + k_index) - f_g) / 2.0;
+        *(u_row + k_index) = value;
+        *(*(distances + k_index) + u) = value;
+    }
+    for (int q = 0; q < num_pairs; q++)
+    {
+        if (q == p)
+        {
+            continue;
+        }
+        int f2 = *(pair_f + q);
+        int g2 = *(pair_g + q);
+        double value = (*(f_row + f2) + *(f_row + g2) + *(g_row + f2) + *(g_row + g2)) / 4.0
+            - f_g / 2.0 - *(*(distances + f2) + g2) / 2.0;
+        *(u_row + *(pair_u + q)) = value;
+    }
+}
+
+/*
+ * Thread start routine for the batched engine.
+ */
+static void *batch_thread(void *arg)
+{
+    BATCH_WORK *work = arg;
+    if (work->phase == 0)
+    {
+        for (int i = work->from; i < num_active_nodes; i += work->stride)
+        {
+            int i_index = *(active_node_map + i);
+            *(row_sums + i_index) = row_sum(i_index);
+        }
+    }
+    else if (work->phase == 1)
+    {
+        for (int i = work->from; i < num_active_nodes; i += work->stride)
+        {
+            int i_index = *(active_node_map + i);
+            *(partners + i_index) = best_partner(i_index);
+        }
+    }
+    else
+    {
+        for (int p = work->from; p < num_pairs; p += work->stride)
+        {
+            batch_new_row(p);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Runs one phase of the batched engine on the given number of threads.
+ */
+static void batch_run(BATCH_WORK *work, int threads, int phase)
+{
+    for (int t = 0; t < threads; t++)
+    {
+        (work + t)->from = t;
+        (work + t)->stride = threads;
+        (work + t)->phase = phase;
+    }
+    run_parallel(batch_thread, work, sizeof(BATCH_WORK), threads);
+}
+
+/**
+ * @brief  Perform one batched neighbor joining step.
+ * @details  Instead of joining only the pair with the globally minimal Q,
+ * every pair of active nodes each of which minimizes Q within the row of
+ * the other is joined in the same step.  Such mutually best pairs are
+ * disjoint, and the canonical best pair of neighbor joining is always one
+ * of them.  All branch lengths of the step are computed from the row sums
+ * before it, and the distances of a new node u = (f, g) are
+ *
+ *    D(u, k) = (D(f, k) + D(g, k) - D(f, g)) / 2
+ *    D(u, u') = (D(f, f') + D(f, g') + D(g, f') + D(g, g')) / 4
+ *               - D(f, g) / 2 - D(f', g') / 2
+ *
+ * for another new node u' = (f', g'), which are the distances sequential
+ * joins of the same pairs would give.  The row sums, the row scans and
+ * the rows of the new nodes are divided among worker threads.  The nodes
+ * are created and joined in increasing order of f, so the result depends
+ * only on the distances and not on the number of threads.  Typically a
+ * sizeable fraction of the nodes is joined in each step, so far fewer
+ * than N - 3 O(N^2) scans are needed.
+ *
+ * @return 0 if the joins were performed, otherwise -1.
+ */
+int nj_batch_step(void) {
+    BATCH_WORK work[MAX_NODES];
+    int m = num_active_nodes;
+    int threads = worker_threads();
+    if (threads > m)
+    {
+        threads = m;
+    }
+    batch_run(work, threads, 0);
+    check_row_sums();
+    batch_run(work, threads, 1);
+
+    //! Collect the mutually best pairs and create their nodes
+    num_pairs = 0;
+    for (int i = 0; i < m; i++)
+    {
+        int f = *(active_node_map + i);
+        int g = *(partners + f);
+        if (g <= f || *(partners + g) != f)
+        {
+            continue;
+        }
+        int u = new_node();
+        if (u == -1)
+        {
+            return -1;
+        }
+        double f_g = *(*(distances + f) + g);
+        double f_branch = ((f_g/2) + (*(row_sums + f) - *(row_sums + g)) / (2 * (m - 2)));
+        *(pair_f + num_pairs) = f;
+        *(pair_g + num_pairs) = g;
+        *(pair_u + num_pairs) = u;
+        *(pair_f_branch + num_pairs) = f_branch;
+        *(pair_g_branch + num_pairs) = f_g - f_branch;
+        num_pairs++;
+    }
+    if (num_pairs == 0)
+    {
+        return -1;
+    }
+
+    batch_run(work, threads < num_pairs ? threads : num_pairs, 2);
+    for (int p = 0; p < num_pairs; p++)
+    {
+        join_nodes(*(pair_f + p), *(pair_g + p), *(pair_u + p), *(pair_f_branch + p), *(pair_g_branch + p));
+    }
+    return 0;
+}
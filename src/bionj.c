@@ -0,0 +1,120 @@
+#include <stdlib.h>
+
+#include "global.h"
+#include "debug.h"
+
+/*
+ * Estimated variances of the entries of the distances matrix, as used by
+ * BIONJ (O. Gascuel, "BIONJ: An Improved Version of the NJ Algorithm Based
+ * on a Simple Model of Sequence Data", Mol. Biol. Evol. 14(7):685-695, 1997).
+ * The variances of the input distances are taken to be the distances
+ * themselves.
+ */
+static double variances[MAX_NODES][MAX_NODES];
+
+/**
+ * @brief  Initialize the BIONJ engine.
+ * @details  Sets the variance of each distance between active nodes to the
+ * distance itself.
+ * @return 0.
+ */
+int bionj_init(void) {
+    for (int i = 0; i < num_active_nodes; i++)
+    {
+        int i_index = *(active_node_map + i);
+        for (int j = 0; j < num_active_nodes; j++)
+        {
+            int j_index = *(active_node_map + j);
+            *(*(variances + i_index) + j_index) = *(*(distances + i_index) + j_index);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief  Perform one BIONJ join.
+ * @details  The pair to join and the branch lengths are chosen exactly as
+ * in neighbor joining.  The distances from the new node u are then a
+ * weighted combination of the distances from f and g,
+ *
+ *    D'(u, k) = l * (D(f, k) - D'(u, f)) + (1 - l) * (D(g, k) - D'(u, g))
+ *    V'(u, k) = l * V(f, k) + (1 - l) * V(g, k) - l * (1 - l) * V(f, g)
+ *
+ * where the weight l, which minimizes the variance of the new distances, is
+ *
+ *    l = 1/2 + sum over k of (V(g, k) - V(f, k)) / (2 * (N - 2) * V(f, g))
+ *
+ * restricted to [0, 1].  Both matrices are updated in the same pass over
+ * the active nodes.
+ *
+ * @return 0 if the join was performed, otherwise -1.
+ */
+int bionj_step(void) {
+    int f, g;
+    compute_row_sums();
+    nj_best_pair(&f, &g);
+    int u = new_node();
+    if (u == -1)
+    {
+        return -1;
+    }
+    double *f_row = *(distances + f);
+    double *g_row = *(distances + g);
+    double *f_variances = *(variances + f);
+    double *g_variances = *(variances + g);
+    double *u_variances = *(variances + u);
+    double f_g = *(f_row + g);
+    double f_g_variance = *(f_variances + g);
+    double f_branch = ((f_g/2) + (*(row_sums + f) - *(row_sums + g)) / (2 * (num_active_nodes - 2)));
+    double g_branch = f_g - f_branch;
+
+    //? lambda from the variances, 1/2 when they carry no information
+    double lambda = 0.5;
+    if (f_g_variance > 0.0)
+    {
+        double difference = 0.0;
+        for (int k = 0; k < num_active_nodes; k++)
+        {
+            int k_index = *(active_node_map + k);
+            if (k_index != f && k_index != g)
+            {
+                difference += *(g_variances + k_index) - *(f_variances + k_index);
+            }
+        }
+        lambda = 0.5 + difference / (2 * (num_active_nodes - 2) * f_g_variance);
+        if (lambda < 0.0)
+            lambda = 0.0;
+        else if (lambda > 1.0)
+            lambda = 1.0;
+    }
+
+    //! Matrix and variance update
+    for (int k = 0; k < num_active_nodes; k++)
+    {
+        int k_index = *(active_node_map + k);
+        double value;
+        double variance;
+        if (k_index == f)
+        {
+            value = f_branch;
+            variance = lambda * (1 - lambda) * f_g_variance;
+        }
+        else if (k_index == g)
+        {
+            value = g_branch;
+            variance = lambda * (1 - lambda) * f_g_variance;
+        }
+        else
+        {
+            value = lambda * (*(f_row + k_index) - f_branch) + (1 - lambda) * (*(g_row + k_index) - g_branch);
+            variance = lambda * *(f_variances + k_index) + (1 - lambda) * *(g_variances + k_index) - lambda * (1 - lambda) * f_g_variance;
+        }
+        *(*(distances + u) + k_index) = value;
+        *(*(distances + k_index) + u) = value;
+        *(u_variances + k_index) = variance;
+        *(*(variances + k_index) + u) = variance;
+    }
+    *(u_variances + u) = 0.0;
+    join_nodes(f, g, u, f_branch, g_branch);
+    return 0;
+}
@@ -0,0 +1,429 @@
+#include <stdlib.h>
+
+#include "global.h"
+#include "debug.h"
+
+/*
+ * Balanced minimum evolution refinement.  The tree is held here as the
+ * neighbor indices of each node, with a leaf's single neighbor in slot 0.
+ * A rooted subtree is identified by the directed edge it hangs from: the
+ * subtree (x, s) is rooted at node x and contains everything that can be
+ * reached from x without passing through the neighbor in slot s of x.
+ * Its id is 3 * x + s.
+ */
+static int adjacent[MAX_NODES][3];
+
+/* Number of neighbors of each node: 1 for a leaf, 3 for an internal node. */
+static int degrees[MAX_NODES];
+
+/*
+ * Balanced averages of pairs of disjoint subtrees, computed on demand.
+ * Each entry is stamped when it is computed, and each subtree is stamped
+ * when a move changes it; an entry is valid when it is no older than
+ * either of its subtrees, so that a move invalidates only the averages of
+ * the subtrees it changed.
+ */
+#define MAX_SUBTREES (3 * MAX_NODES)
+static double averages[MAX_SUBTREES][MAX_SUBTREES];
+static unsigned int stamps[MAX_SUBTREES][MAX_SUBTREES];
+static unsigned int changed[MAX_SUBTREES];
+static unsigned int current_stamp;
+
+/* Smallest decrease in tree length regarded as an improvement. */
+#define BME_EPSILON 1e-10
+
+/*
+ * Returns the slot of node y in the neighbors of node x.
+ */
+static int slot_of(int x, int y)
+{
+    for (int k = 0; k < 2; k++)
+    {
+        if (*(*(adjacent + x) + k) == y)
+        {
+            return k;
+        }
+    }
+    return 2;
+}
+
+/*
+ * Returns the id of the subtree rooted at x that hangs from its neighbor y.
+ */
+static int subtree(int x, int y)
+{
+    return 3 * x + slot_of(x, y);
+}
+
+/*
+ * Replaces the neighbor y of node x by z.
+ */
+static void relink(int x, int y, int z)
+{
+    *(*(adjacent + x) + slot_of(x, y)) = z;
+}
+
+/*
+ * Returns the balanced average distance between the disjoint subtrees s
+ * and t.  Each leaf of a subtree is weighted by 2^-k, where k is the number
+ * of edges between it and the root of the subtree, so that the average
+ * over a subtree with children s1 and s2 is the mean of the averages over
+ * s1 and s2.  Each average is computed once, from those of the children,
+ * so all of them together cost O(N^2).
+ */
+static double average(int s, int t)
+{
+    unsigned int stamp = *(*(stamps + s) + t);
+    if (stamp >= *(changed + s) && stamp >= *(changed + t))
+    {
+        return *(*(averages + s) + t);
+    }
+    int x = s / 3;
+    int y = t / 3;
+    double value;
+    if (*(degrees + x) == 1 && *(degrees + y) == 1)
+    {
+        value = *(*(distances + x) + y);
+    }
+    else
+    {
+        // split whichever of the two subtrees is not a leaf
+        int split = *(degrees + x) == 1 ? t : s;
+        int other = split == s ? t : s;
+        int z = split / 3;
+        int excluded = split % 3;
+        value = 0.0;
+        for (int k = 0; k < 3; k++)
+        {
+            if (k != excluded)
+            {
+                int child = *(*(adjacent + z) + k);
+                value += average(subtree(child, z), other) / 2.0;
+            }
+        }
+    }
+    *(*(averages + s) + t) = value;
+    *(*(averages + t) + s) = value;
+    *(*(stamps + s) + t) = current_stamp;
+    *(*(stamps + t) + s) = current_stamp;
+    return value;
+}
+
+/*
+ * Marks as changed the subtrees rooted at x that contain the neighbor
+ * parent of x (all of them if parent is -1), and those of the nodes beyond,
+ * so that every subtree containing x is marked.  Subtrees hanging away
+ * from x keep their averages.
+ */
+static void touch_subtrees(int x, int parent)
+{
+    for (int k = 0; k < *(degrees + x); k++)
+    {
+        int y = *(*(adjacent + x) + k);
+        if (y != parent)
+        {
+            *(changed + 3 * x + k) = current_stamp;
+            touch_subtrees(y, x);
+        }
+    }
+}
+
+/*
+ * Invalidates the averages of the subtrees changed by a move at node x:
+ * those containing x and, if y is not -1, the subtree at its neighbor y
+ * hanging from x.  This costs O(N), against the O(N^2) averages.
+ */
+static void moved_at(int x, int y)
+{
+    current_stamp++;
+    if (y != -1)
+    {
+        *(changed + subtree(y, x)) = current_stamp;
+    }
+    touch_subtrees(x, -1);
+}
+
+/*
+ * Sets *a and *b to the two neighbors of the internal node x other than y.
+ */
+static void other_neighbors(int x, int y, int *a, int *b)
+{
+    int found = 0;
+    *a = -1;
+    *b = -1;
+    for (int k = 0; k < 3; k++)
+    {
+        int z = *(*(adjacent + x) + k);
+        if (z != y)
+        {
+            if (found++ == 0)
+                *a = z;
+            else
+                *b = z;
+        }
+    }
+}
+
+/*
+ * Performs the best balanced NNI move, if any decreases the tree length.
+ * For an internal edge u-v with subtrees A and B at u and C and D at v,
+ * exchanging B and C decreases the balanced tree length by
+ *
+ *    ((D(A|B) + D(C|D)) - (D(A|C) + D(B|D))) / 4
+ *
+ * where D(X|Y) is the balanced average distance between X and Y, so that
+ * with the averages at hand each of the two moves at an edge is evaluated
+ * in O(1).  Returns 1 if a move was made, otherwise 0.
+ */
+static int bme_nni(void)
+{
+    double best_gain = BME_EPSILON;
+    int best_u = -1, best_v = -1, best_b = -1, best_c = -1;
+    for (int u = num_taxa; u < num_all_nodes; u++)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            int v = *(*(adjacent + u) + k);
+            if (v < u || *(degrees + v) == 1)
+            {
+                continue;
+            }
+            int a, b, c, d;
+            other_neighbors(u, v, &a, &b);
+            other_neighbors(v, u, &c, &d);
+            int A = subtree(a, u), B = subtree(b, u);
+            int C = subtree(c, v), D = subtree(d, v);
+            double current = average(A, B) + average(C, D);
+            double gain_c = (current - average(A, C) - average(B, D)) / 4.0;
+            double gain_d = (current - average(A, D) - average(B, C)) / 4.0;
+            if (gain_c > best_gain)
+            {
+                best_gain = gain_c;
+                best_u = u, best_v = v, best_b = b, best_c = c;
+            }
+            if (gain_d > best_gain)
+            {
+                best_gain = gain_d;
+                best_u = u, best_v = v, best_b = b, best_c = d;
+            }
+        }
+    }
+    if (best_u == -1)
+    {
+        return 0;
+    }
+    relink(best_u, best_b, best_c);
+    relink(best_b, best_u, best_v);
+    relink(best_v, best_c, best_b);
+    relink(best_c, best_v, best_u);
+    moved_at(best_u, best_v);
+    return 1;
+}
+
+/*
+ * Walks the edges of the tree without the pruned subtree X, moving X from
+ * the edge p-q onto the edges beyond q.  Moving X from p-q onto q-r, where
+ * s is the other neighbor of q, is an NNI exchanging X and S, so the
+ * decreases in length accumulate along the path as
+ *
+ *    ((D(U|X) + D(R|S)) - (D(U|S) + D(X|R))) / 4
+ *
+ * where U is the subtree at p away from q.  The edge with the largest
+ * total decrease is recorded in *best_p and *best_q.
+ */
+static void spr_walk(int X, int p, int q, double gain, double *best_gain, int *best_p, int *best_q)
+{
+    if (*(degrees + q) == 1)
+    {
+        return;
+    }
+    int r, s;
+    other_neighbors(q, p, &r, &s);
+    int U = subtree(p, q);
+    for (int k = 0; k < 2; k++)
+    {
+        int R = subtree(r, q), S = subtree(s, q);
+        double step = (average(U, X) + average(R, S) - average(U, S) - average(X, R)) / 4.0;
+        if (gain + step > *best_gain)
+        {
+            *best_gain = gain + step;
+            *best_p = q;
+            *best_q = r;
+        }
+        spr_walk(X, q, r, gain + step, best_gain, best_p, best_q);
+        int t = r;
+        r = s;
+        s = t;
+    }
+}
+
+/*
+ * Tries to move the subtree at x hanging from its internal neighbor w to
+ * the edge where it gives the shortest balanced tree.  The subtree is
+ * pruned, w is bypassed, and the remaining tree is searched from the
+ * edge that w was on; w is then inserted into the best edge found.
+ * Returns 1 if the subtree was moved, otherwise 0.
+ */
+static int bme_spr(int x, int w)
+{
+    int a, b;
+    other_neighbors(w, x, &a, &b);
+    relink(a, w, b);
+    relink(b, w, a);
+    moved_at(a, b);
+    int X = subtree(x, w);
+    double best_gain = BME_EPSILON;
+    int best_p = -1, best_q = -1;
+    spr_walk(X, a, b, 0.0, &best_gain, &best_p, &best_q);
+    spr_walk(X, b, a, 0.0, &best_gain, &best_p, &best_q);
+    if (best_p == -1)
+    {
+        relink(a, b, w);
+        relink(b, a, w);
+        moved_at(w, -1);
+        return 0;
+    }
+    relink(w, a, best_p);
+    relink(w, b, best_q);
+    relink(best_p, best_q, w);
+    relink(best_q, best_p, w);
+    moved_at(w, -1);
+    return 1;
+}
+
+/*
+ * Sets the branch lengths to their balanced minimum evolution estimates.
+ * For an internal edge with subtrees A and B at one end and C and D at
+ * the other, the length is
+ *
+ *    (D(A|C) + D(A|D) + D(B|C) + D(B|D)) / 4 - (D(A|B) + D(C|D)) / 2
+ *
+ * and for the edge to a leaf i whose neighbor has other subtrees B and C
+ * it is (D(i|B) + D(i|C) - D(B|C)) / 2.  The edges are recorded afresh,
+ * each as its smaller node index followed by its larger one, in order of
+ * the larger index, and the NODE structures are rebuilt.
+ */
+static void bme_lengths(void)
+{
+    num_edges = 0;
+    for (int u = num_taxa; u < num_all_nodes; u++)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            int v = *(*(adjacent + u) + k);
+            *((nodes + u)->neighbors + k) = nodes + v;
+            if (v > u)
+            {
+                continue;
+            }
+            int a, b, c, d;
+            other_neighbors(u, v, &a, &b);
+            int A = subtree(a, u), B = subtree(b, u);
+            int V = subtree(v, u);
+            double length;
+            if (*(degrees + v) == 1)
+            {
+                length = (average(V, A) + average(V, B) - average(A, B)) / 2.0;
+                *((nodes + v)->neighbors + 0) = nodes + u;
+            }
+            else
+            {
+                other_neighbors(v, u, &c, &d);
+                int C = subtree(c, v), D = subtree(d, v);
+                length = (average(A, C) + average(A, D) + average(B, C) + average(B, D)) / 4.0
+                    - (average(A, B) + average(C, D)) / 2.0;
+            }
+            *(*(edge_nodes + num_edges) + 0) = v;
+            *(*(edge_nodes + num_edges) + 1) = u;
+            *(edge_lengths + num_edges) = length;
+            num_edges++;
+        }
+    }
+}
+
+/**
+ * @brief  Refine the synthesized tree under the balanced minimum evolution
+ * criterion.
+ * @details  This function assumes that build_taxonomy() has built a tree
+ * with at least three leaves.  Following FastME (R. Desper and O. Gascuel,
+ * "Fast and Accurate Phylogeny Reconstruction Algorithms Based on the
+ * Minimum-Evolution Principle", J. Comput. Biol. 9:687-705, 2002), the
+ * balanced NNI move that most decreases the balanced tree length is made
+ * until none does.  The balanced averages between subtrees are computed
+ * once in O(N^2), after which each move is evaluated in O(1); a move then
+ * invalidates only the averages of the subtrees that contain it, which are
+ * recomputed from the unchanged averages of their children when needed,
+ * along the path from the move to the edges evaluated.
+ * With REFINE_SPR, each subtree is then in turn pruned and regrafted onto
+ * the edge that minimizes the tree length, the regrafting positions being
+ * evaluated in O(1) each as a path of NNI moves, and the NNI passes are
+ * repeated after each move until no move improves the tree.  Finally the
+ * branch lengths are set to their balanced estimates and the edges and
+ * NODE structures are rebuilt from the refined tree; the distances
+ * matrix is left unchanged.
+ *
+ * @param mode  REFINE_NNI or REFINE_SPR.
+ * @return 0 if the tree was refined, otherwise -1 if the tree is not of
+ * the expected form.
+ */
+int refine_tree(int mode) {
+    if (num_taxa < 3)
+    {
+        return 0;
+    }
+    for (int x = 0; x < num_all_nodes; x++)
+    {
+        *(degrees + x) = 0;
+        for (int k = 0; k < 3; k++)
+        {
+            NODE *neighbor = *((nodes + x)->neighbors + k);
+            *(*(adjacent + x) + k) = neighbor == NULL ? -1 : neighbor - nodes;
+            if (neighbor != NULL)
+            {
+                (*(degrees + x))++;
+            }
+        }
+        if (*(degrees + x) != (x < num_taxa ? 1 : 3) || **(adjacent + x) == -1)
+        {
+            fprintf(stderr, "Error: Tree cannot be refined!\n");
+            return -1;
+        }
+    }
+    // all the averages are computed afresh for the initial pass
+    current_stamp++;
+    for (int s = 0; s < 3 * num_all_nodes; s++)
+    {
+        *(changed + s) = current_stamp;
+    }
+    // each move strictly shortens the tree, so the moves are bounded only by
+    // the number of topologies; a generous cap guards against rounding cycles
+    long moves = 0;
+    long max_moves = (long)MAX_NODES * MAX_NODES;
+    while (moves < max_moves && bme_nni())
+    {
+        moves++;
+    }
+    int improved = mode == REFINE_SPR;
+    while (improved && moves < max_moves)
+    {
+        improved = 0;
+        for (int x = 0; x < num_all_nodes && moves < max_moves; x++)
+        {
+            for (int k = 0; k < *(degrees + x); k++)
+            {
+                int w = *(*(adjacent + x) + k);
+                if (*(degrees + w) == 3 && bme_spr(x, w))
+                {
+                    improved = 1;
+                    moves++;
+                    while (moves < max_moves && bme_nni())
+                    {
+                        moves++;
+                    }
+                }
+            }
+        }
+    }
+    bme_lengths();
+    return 0;
+}
@@ -0,0 +1,192 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "global.h"
+#include "debug.h"
+
+/*
+ * For each taxon, the taxon of smallest index having the same row of
+ * distances, or -1 if that is the taxon itself.
+ */
+static int representatives[MAX_TAXA];
+
+/* Open-addressing hash table of the representatives, keyed by row hash. */
+#define HASH_SLOTS (4 * MAX_TAXA)
+static int hash_slots[HASH_SLOTS];
+static uint64_t row_hashes[MAX_TAXA];
+
+/*
+ * Returns the FNV-1a hash of the row of distances of taxon i.  A
+ * distance of -0.0 is hashed as 0.0, since the two compare equal.
+ */
+static uint64_t hash_row(int i)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    double *row = *(distances + i);
+    for (int k = 0; k < num_taxa; k++)
+    {
+        double value = *(row + k) == 0.0 ? 0.0 : *(row + k);
+        unsigned char bytes[sizeof(double)];
+        memcpy(bytes, &value, sizeof(double));
+        for (size_t b = 0; b < sizeof(double); b++)
+        {
+            hash = (hash ^ *(bytes + b)) * 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+/*
+ * Returns whether taxa i and j have the same row of distances, which
+ * implies that the distance between them is zero.
+ */
+static int same_row(int i, int j)
+{
+    double *i_row = *(distances + i);
+    double *j_row = *(distances + j);
+    for (int k = 0; k < num_taxa; k++)
+    {
+        if (*(i_row + k) != *(j_row + k))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief  Set aside taxa whose rows of distances duplicate others.
+ * @details  This function assumes that the distance data has just been
+ * read by read_distance_data().  The rows are hashed in O(N^2) overall,
+ * and a taxon whose row equals that of a taxon of smaller index, found by
+ * comparing it with the rows of the same hash only, is removed from the
+ * active nodes.  The tree is then built on the remaining representatives,
+ * which can be far fewer, and the duplicates are put back into it by
+ * reattach_duplicates().
+ *
+ * @return the number of taxa set aside.
+ */
+int collapse_duplicates(void) {
+    for (int s = 0; s < HASH_SLOTS; s++)
+    {
+        *(hash_slots + s) = -1;
+    }
+    int kept = 0;
+    int collapsed = 0;
+    for (int i = 0; i < num_taxa; i++)
+    {
+        *(representatives + i) = -1;
+        *(row_hashes + i) = hash_row(i);
+        int s = *(row_hashes + i) % HASH_SLOTS;
+        while (*(hash_slots + s) != -1)
+        {
+            int j = *(hash_slots + s);
+            if (*(row_hashes + j) == *(row_hashes + i) && same_row(i, j))
+            {
+                *(representatives + i) = j;
+                break;
+            }
+            s = (s + 1) % HASH_SLOTS;
+        }
+        if (*(representatives + i) == -1)
+        {
+            *(hash_slots + s) = i;
+            *(active_node_map + kept++) = i;
+        }
+        else
+        {
+            collapsed++;
+        }
+    }
+    num_active_nodes = kept;
+    return collapsed;
+}
+
+/*
+ * Replaces the neighbor old of node x by new.
+ */
+static void replace_neighbor(int x, int old, int new)
+{
+    for (int k = 0; k < 3; k++)
+    {
+        if (*((nodes + x)->neighbors + k) == nodes + old)
+        {
+            *((nodes + x)->neighbors + k) = nodes + new;
+            return;
+        }
+    }
+}
+
+/**
+ * @brief  Put the taxa set aside by collapse_duplicates() back into the tree.
+ * @details  This function assumes that the tree has been built on the
+ * representatives.  Each duplicate d of a representative r is attached by
+ * splitting the edge between r and its neighbor p with a new internal
+ * node c, which becomes the neighbor of r and d through edges of length
+ * zero; the edge c-p keeps the length of the edge r-p, and the distances
+ * from c are those from r.  A duplicate of a representative that is the
+ * only node of the tree is simply joined to it by an edge of length zero.
+ *
+ * @return 0 if the duplicates were attached, otherwise -1.
+ */
+int reattach_duplicates(void) {
+    for (int d = 0; d < num_taxa; d++)
+    {
+        int r = *(representatives + d);
+        if (r == -1)
+        {
+            continue;
+        }
+        NODE *parent = *((nodes + r)->neighbors + 0);
+        if (parent == NULL)
+        {
+            *((nodes + r)->neighbors + 0) = nodes + d;
+            *((nodes + d)->neighbors + 0) = nodes + r;
+            *(*(edge_nodes + num_edges) + 0) = r;
+            *(*(edge_nodes + num_edges) + 1) = d;
+            *(edge_lengths + num_edges) = 0.0;
+            num_edges++;
+            continue;
+        }
+        int p = parent - nodes;
+        int c = new_node();
+        if (c == -1)
+        {
+            return -1;
+        }
+        for (int k = 0; k < num_all_nodes; k++)
+        {
+            *(*(distances + c) + k) = *(*(distances + r) + k);
+            *(*(distances + k) + c) = *(*(distances + k) + r);
+        }
+        *(*(distances + c) + c) = 0.0;
+        *(*(distances + c) + r) = 0.0;
+        *(*(distances + r) + c) = 0.0;
+
+        //! Split the edge r-p, which keeps its place in the edge list
+        for (int e = 0; e < num_edges; e++)
+        {
+            int *ends = *(edge_nodes + e);
+            if ((*(ends + 0) == r && *(ends + 1) == p) || (*(ends + 0) == p && *(ends + 1) == r))
+            {
+                *(ends + (*(ends + 0) == r ? 0 : 1)) = c;
+                break;
+            }
+        }
+        replace_neighbor(p, r, c);
+        *((nodes + c)->neighbors + 0) = nodes + p;
+        *((nodes + c)->neighbors + 1) = nodes + r;
+        *((nodes + c)->neighbors + 2) = nodes + d;
+        *((nodes + r)->neighbors + 0) = nodes + c;
+        *((nodes + d)->neighbors + 0) = nodes + c;
+        for (int k = 0; k < 2; k++)
+        {
+            *(*(edge_nodes + num_edges) + 0) = k == 0 ? r : d;
+            *(*(edge_nodes + num_edges) + 1) = c;
+            *(edge_lengths + num_edges) = 0.0;
+            num_edges++;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,279 @@
+#include <stdlib.h>
+#include <math.h>
+#include <float.h>
+
+#include "global.h"
+#include "debug.h"
+
+/*
+ * Compact copies of the distances matrix, scanned in place of it by the
+ * single-precision and 16-bit engines.  The distances matrix itself is
+ * still maintained in double precision, since the joins and all of the
+ * outputs are computed from it.  A 16-bit entry q stands for the distance
+ * q * quantum, where the quantum is chosen per matrix so that the largest
+ * distance maps to the largest 16-bit value.
+ */
+static float single_distances[MAX_NODES][MAX_NODES];
+static short quantized_distances[MAX_NODES][MAX_NODES];
+static double quantum;
+
+/* Largest absolute value of any distance stored in the compact matrix. */
+static double largest_distance;
+
+/* Approximate row sums, accumulated in double from the compact matrix. */
+static double approximate_sums[MAX_NODES];
+
+/* One row of the compact matrix converted back to double. */
+static double row_values[MAX_NODES];
+
+/*
+ * Pairs whose approximate Q is near enough to the least so far to be
+ * re-checked, which can be every pair in the worst case.
+ */
+#define MAX_CANDIDATES (MAX_NODES * MAX_NODES / 2)
+static int candidate_f[MAX_CANDIDATES];
+static int candidate_g[MAX_CANDIDATES];
+static double candidate_q[MAX_CANDIDATES];
+
+/* Whether the exact row sum of each node has been computed in this step. */
+static int exact_sum_known[MAX_NODES];
+
+#define COMPACT_SINGLE 0
+#define COMPACT_QUANTIZED 1
+
+/*
+ * Stores the distance between nodes i and k in the compact matrix.
+ * Returns 0, or -1 if it does not fit the 16-bit range of the current
+ * quantum, in which case the matrix has to be quantized again.
+ */
+static int store_compact(int mode, int i, int k, double value)
+{
+    if (fabs(value) > largest_distance)
+    {
+        largest_distance = fabs(value);
+    }
+    if (mode == COMPACT_SINGLE)
+    {
+        *(*(single_distances + i) + k) = (float)value;
+        *(*(single_distances + k) + i) = (float)value;
+        return 0;
+    }
+    double steps = nearbyint(value / quantum);
+    if (fabs(steps) > 32767)
+    {
+        return -1;
+    }
+    *(*(quantized_distances + i) + k) = (short)steps;
+    *(*(quantized_distances + k) + i) = (short)steps;
+    return 0;
+}
+
+/*
+ * Fills in the compact matrix for all pairs of active nodes, choosing the
+ * quantum from the largest distance among them.
+ */
+static void fill_compact(int mode)
+{
+    largest_distance = 0.0;
+    for (int i = 0; i < num_active_nodes; i++)
+    {
+        double *row = *(distances + *(active_node_map + i));
+        for (int k = 0; k < num_active_nodes; k++)
+        {
+            double value = fabs(*(row + *(active_node_map + k)));
+            if (value > largest_distance)
+                largest_distance = value;
+        }
+    }
+    quantum = largest_distance > 0.0 ? largest_distance / 32767 : 1.0;
+    for (int i = 0; i < num_active_nodes; i++)
+    {
+        int i_index = *(active_node_map + i);
+        for (int k = i; k < num_active_nodes; k++)
+        {
+            int k_index = *(active_node_map + k);
+            store_compact(mode, i_index, k_index, *(*(distances + i_index) + k_index));
+        }
+    }
+}
+
+/*
+ * Converts the row of node i of the compact matrix back to double, for
+ * the active nodes in the active slots [from, m).
+ */
+static void load_row(int mode, int i, int from)
+{
+    int m = num_active_nodes;
+    if (mode == COMPACT_SINGLE)
+    {
+        float *row = *(single_distances + i);
+        for (int k = from; k < m; k++)
+        {
+            *(row_values + k) = *(row + *(active_node_map + k));
+        }
+    }
+    else
+    {
+        short *row = *(quantized_distances + i);
+        for (int k = from; k < m; k++)
+        {
+            *(row_values + k) = *(row + *(active_node_map + k)) * quantum;
+        }
+    }
+}
+
+/*
+ * Returns the exact row sum of node i, as the reference engine computes it.
+ */
+static double exact_sum(int i)
+{
+    if (!*(exact_sum_known + i))
+    {
+        *(row_sums + i) = row_sum(i);
+        *(exact_sum_known + i) = 1;
+    }
+    return *(row_sums + i);
+}
+
+/*
+ * Performs one neighbor joining step scanning the compact matrix.  The
+ * approximate Q values differ from those of the reference engine by at
+ * most
+ *
+ *    delta = (N - 2) * e + 2 * N * e + rounding
+ *
+ * where e bounds the error of a compact entry: half a quantum, or the
+ * largest distance times 2^-24 in single precision.  So the pair that the
+ * reference engine would choose is among the pairs whose approximate Q
+ * is within 2 * delta of the least.  Those pairs are kept as the scan
+ * proceeds and re-checked with the exact Q values and the canonical
+ * tie-break, which needs the exact row sums of their rows only.  Ties
+ * and near ties are rare, so the re-check is usually of a single pair.
+ */
+static int compact_step(int mode)
+{
+    int m = num_active_nodes;
+    for (int i = 0; i < m; i++)
+    {
+        int i_index = *(active_node_map + i);
+        load_row(mode, i_index, 0);
+        double sum = 0;
+        for (int k = 0; k < m; k++)
+        {
+            sum += *(row_values + k);
+        }
+        *(approximate_sums + i_index) = sum;
+        *(exact_sum_known + i_index) = 0;
+    }
+    double error = mode == COMPACT_SINGLE ? largest_distance * FLT_EPSILON / 2 : quantum / 2;
+    double delta = 4 * m * error + 4.0 * m * m * largest_distance * DBL_EPSILON;
+
+    //! Scan the compact matrix, keeping the pairs near the least Q
+    double least = 0.0;
+    int count = 0;
+    for (int i = 0; i < m; i++)
+    {
+        int i_index = *(active_node_map + i);
+        double s_i = *(approximate_sums + i_index);
+        load_row(mode, i_index, i + 1);
+        for (int j = i + 1; j < m; j++)
+        {
+            int j_index = *(active_node_map + j);
+            double q = (m - 2) * *(row_values + j) - s_i - *(approximate_sums + j_index);
+            if (count == 0 || q < least)
+            {
+                least = q;
+            }
+            if (q <= least + 2 * delta)
+            {
+                *(candidate_f + count) = i_index;
+                *(candidate_g + count) = j_index;
+                *(candidate_q + count) = q;
+                count++;
+            }
+        }
+    }
+
+    //! Re-check the candidates at full precision
+    int f = -1, g = -1;
+    double best_q = 0.0;
+    for (int c = 0; c < count; c++)
+    {
+        if (*(candidate_q + c) > least + 2 * delta)
+        {
+            continue;
+        }
+        int i_index = *(candidate_f + c);
+        int j_index = *(candidate_g + c);
+        double q = (m - 2) * *(*(distances + i_index) + j_index) - exact_sum(i_index) - exact_sum(j_index);
+        if (f == -1 || BETTER_PAIR(q, i_index, j_index, best_q, f, g))
+        {
+            best_q = q;
+            f = i_index;
+            g = j_index;
+        }
+    }
+    int u = nj_join(f, g);
+    if (u == -1)
+    {
+        return -1;
+    }
+
+    //! Bring the compact matrix up to date with the row of the new node
+    double *u_row = *(distances + u);
+    for (int k = 0; k < num_active_nodes; k++)
+    {
+        int k_index = *(active_node_map + k);
+        if (store_compact(mode, u, k_index, *(u_row + k_index)) == -1)
+        {
+            fill_compact(mode);
+            break;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief  Initialize the single-precision engine.
+ * @return 0.
+ */
+int nj_f32_init(void) {
+    fill_compact(COMPACT_SINGLE);
+    return 0;
+}
+
+/**
+ * @brief  Perform one neighbor joining step scanning a single-precision
+ * copy of the distances matrix.
+ * @details  The row sums and Q values are accumulated in double from
+ * entries stored as float, halving the memory read by each scan, and the
+ * near-tie pairs are re-checked at full precision, so that the pair joined
+ * is the one the reference engine joins.
+ * @return 0 if the join was performed, otherwise -1.
+ */
+int nj_f32_step(void) {
+    return compact_step(COMPACT_SINGLE);
+}
+
+/**
+ * @brief  Initialize the 16-bit engine.
+ * @return 0.
+ */
+int nj_q16_init(void) {
+    fill_compact(COMPACT_QUANTIZED);
+    return 0;
+}
+
+/**
+ * @brief  Perform one neighbor joining step scanning a 16-bit fixed-point
+ * copy of the distances matrix.
+ * @details  Distances are stored as multiples of a per-matrix quantum,
+ * which is chosen again if a new distance falls outside the 16-bit range.
+ * This reads a quarter of the memory of a scan of the distances matrix.
+ * The coarser values leave more pairs to re-check at full precision, but
+ * the pair joined is still the one the reference engine joins.
+ * @return 0 if the join was performed, otherwise -1.
+ */
+int nj_q16_step(void) {
+    return compact_step(COMPACT_QUANTIZED);
+}
@@ -0,0 +1,642 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "global.h"
+#include "debug.h"
+
+/*
+ * Divide-and-conquer engine.  The active nodes are partitioned into
+ * clusters of nearby taxa, the subtree of each cluster is built from its
+ * own submatrix in a child process of its own, and the joins of the
+ * subtrees are then replayed here wherever they agree with the whole
+ * matrix, the reference engine making the joins that they do not supply.
+ */
+
+/* The clusters, as lists of node indices in cluster_members. */
+static int cluster_members[MAX_NODES];
+static int cluster_starts[MAX_NODES + 1];
+static int num_clusters_found;
+
+/* Medoid assigned to each node by the last partition. */
+static int assigned_medoids[MAX_NODES];
+
+/* The engine that joins the remains of the clusters. */
+static ENGINE *base_engine;
+
+/* Number of k-medoids iterations after which the medoids are taken as they are. */
+#define MEDOID_ITERATIONS 10
+
+/*
+ * A join made in a child process: nodes f and g were joined to node u,
+ * all in the numbering of the child.
+ */
+typedef struct join_record {
+    int f;
+    int g;
+    int u;
+} JOIN_RECORD;
+
+/*
+ * The joins made in all of the children, by cluster, and the position of
+ * the first join of each cluster.  Once collected, the nodes f and g of
+ * each join are translated: a taxon by its node index, and a node made by
+ * an earlier join r of the same cluster as -(r + 1).
+ */
+static JOIN_RECORD join_records[MAX_NODES];
+static int record_starts[MAX_NODES + 1];
+static int num_records;
+
+/* The node made by replaying each join, or -1 if it has not been replayed. */
+static int made_nodes[MAX_NODES];
+
+/* Whether row_sums holds the row sums of the active nodes. */
+static int sums_current;
+
+/*
+ * Returns the largest number of taxa in a subproblem.  With -L it is the
+ * largest n whose (2n)^2 distances of a full subproblem would fit the
+ * budget; this only chooses the size of the clusters, since the children
+ * work in the global matrix.  Otherwise it is 2 sqrt(N), which gives about
+ * sqrt(N) / 2 subproblems for the cores.
+ */
+static int subproblem_size(int m)
+{
+    int size;
+    if (global_options & BUDGET_OPTION)
+        size = (int)sqrt(memory_budget * 1024.0 / (4 * sizeof(double)));
+    else
+        size = 2 * (int)ceil(sqrt(m));
+    return size < 4 ? 4 : size;
+}
+
+/*
+ * Partitions the nodes in members[0..n) into k clusters by k-medoids
+ * (Voronoi iteration), stored consecutively from position *count of
+ * cluster_members.  The medoids are chosen on a sample of the nodes, every
+ * stride-th one, starting from the farthest-first traversal of the
+ * sample, and then every node is assigned to its nearest medoid.
+ */
+static void partition(int *members, int n, int k)
+{
+    int medoids[MAX_NODES];
+    int sample[MAX_NODES];
+    int stride = n / (8 * k) > 1 ? n / (8 * k) : 1;
+    int sample_size = 0;
+    if (n < 1)
+    {
+        return;
+    }
+    for (int i = 0; i < n; i += stride)
+    {
+        *(sample + sample_size++) = *(members + i);
+    }
+    if (k > sample_size)
+    {
+        k = sample_size;
+    }
+
+    //! Farthest-first initial medoids
+    *(medoids + 0) = *(sample + 0);
+    for (int c = 1; c < k; c++)
+    {
+        int farthest = -1;
+        double farthest_distance = -1.0;
+        for (int s = 0; s < sample_size; s++)
+        {
+            int x = *(sample + s);
+            double nearest = HUGE_VAL;
+            for (int d = 0; d < c; d++)
+            {
+                double value = *(*(distances + x) + *(medoids + d));
+                if (value < nearest)
+                    nearest = value;
+            }
+            if (nearest > farthest_distance)
+            {
+                farthest_distance = nearest;
+                farthest = x;
+            }
+        }
+        *(medoids + c) = farthest;
+    }
+
+    //! Voronoi iteration on the sample
+    for (int iteration = 0; iteration < MEDOID_ITERATIONS; iteration++)
+    {
+        for (int s = 0; s < sample_size; s++)
+        {
+            int x = *(sample + s);
+            int best = 0;
+            for (int c = 1; c < k; c++)
+            {
+                if (*(*(distances + x) + *(medoids + c)) < *(*(distances + x) + *(medoids + best)))
+                    best = c;
+            }
+            *(assigned_medoids + x) = best;
+        }
+        int changed = 0;
+        for (int c = 0; c < k; c++)
+        {
+            int best = *(medoids + c);
+            double best_cost = HUGE_VAL;
+            for (int s = 0; s < sample_size; s++)
+            {
+                int x = *(sample + s);
+                if (*(assigned_medoids + x) != c)
+                    continue;
+                double cost = 0.0;
+                for (int t = 0; t < sample_size; t++)
+                {
+                    int y = *(sample + t);
+                    if (*(assigned_medoids + y) == c)
+                        cost += *(*(distances + x) + y);
+                }
+                if (cost < best_cost)
+                {
+                    best_cost = cost;
+                    best = x;
+                }
+            }
+            if (best != *(medoids + c))
+            {
+                *(medoids + c) = best;
+                changed = 1;
+            }
+        }
+        if (!changed)
+            break;
+    }
+
+    //! Assign every node to its nearest medoid and store the clusters
+    for (int i = 0; i < n; i++)
+    {
+        int x = *(members + i);
+        int best = 0;
+        for (int c = 1; c < k; c++)
+        {
+            if (*(*(distances + x) + *(medoids + c)) < *(*(distances + x) + *(medoids + best)))
+                best = c;
+        }
+        *(assigned_medoids + x) = best;
+    }
+    int position = *(cluster_starts + num_clusters_found);
+    for (int c = 0; c < k; c++)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            if (*(assigned_medoids + *(members + i)) == c)
+                *(cluster_members + position++) = *(members + i);
+        }
+        if (position > *(cluster_starts + num_clusters_found))
+        {
+            num_clusters_found++;
+            *(cluster_starts + num_clusters_found) = position;
+        }
+    }
+}
+
+/*
+ * Splits the clusters larger than the subproblem size in two by
+ * k-medoids, until none is.  A cluster that cannot be split, because all
+ * of its nodes are at the same distance from the medoids, is split in
+ * half in order of node index.
+ */
+static void split_large_clusters(int size)
+{
+    for (int c = 0; c < num_clusters_found; c++)
+    {
+        int start = *(cluster_starts + c);
+        int n = *(cluster_starts + c + 1) - start;
+        if (n <= size)
+        {
+            continue;
+        }
+        int members[MAX_NODES];
+        for (int i = 0; i < n; i++)
+        {
+            *(members + i) = *(cluster_members + start + i);
+        }
+        // remove cluster c, then append its parts at the end
+        for (int d = c + 1; d <= num_clusters_found; d++)
+        {
+            *(cluster_starts + d) -= n;
+        }
+        for (int i = start; i < *(cluster_starts + num_clusters_found); i++)
+        {
+            *(cluster_members + i) = *(cluster_members + i + n);
+        }
+        for (int d = c; d < num_clusters_found; d++)
+        {
+            *(cluster_starts + d) = *(cluster_starts + d + 1);
+        }
+        num_clusters_found--;
+        int before = num_clusters_found;
+        partition(members, n, 2);
+        if (num_clusters_found == before + 1)
+        {
+            // a single part: halve it
+            num_clusters_found = before;
+            int position = *(cluster_starts + before);
+            for (int i = 0; i < n; i++)
+            {
+                *(cluster_members + position + i) = *(members + i);
+            }
+            *(cluster_starts + before + 1) = position + n / 2;
+            *(cluster_starts + before + 2) = position + n;
+            num_clusters_found += 2;
+        }
+        c--;
+    }
+}
+
+/*
+ * Sorts the nodes of a cluster into increasing order of index.
+ */
+static void sort_members(int *members, int n)
+{
+    for (int i = 1; i < n; i++)
+    {
+        int x = *(members + i);
+        int j = i - 1;
+        while (j >= 0 && *(members + j) > x)
+        {
+            *(members + j + 1) = *(members + j);
+            j--;
+        }
+        *(members + j + 1) = x;
+    }
+}
+
+/*
+ * Adjacency of the tree built in a child process, in the numbering of the
+ * child: the neighbors of each node and their number.
+ */
+static int child_adjacent[MAX_NODES][3];
+static int child_degrees[MAX_NODES];
+
+/*
+ * Adds the edge a-b to the adjacency of the child.
+ */
+static void child_edge(int a, int b)
+{
+    *(*(child_adjacent + a) + (*(child_degrees + a))++) = b;
+    *(*(child_adjacent + b) + (*(child_degrees + b))++) = a;
+}
+
+/*
+ * Writes to the pipe the joins that build the subtree below node v,
+ * regarding parent as its parent, children first, so that each join only
+ * involves nodes already made.  Returns -1 if a write fails.
+ */
+static int write_joins(int v, int parent, int fd)
+{
+    if (*(child_degrees + v) == 1)
+    {
+        return 0;
+    }
+    int children[2];
+    int n = 0;
+    for (int k = 0; k < *(child_degrees + v); k++)
+    {
+        int w = *(*(child_adjacent + v) + k);
+        if (w == parent)
+        {
+            continue;
+        }
+        *(children + n++) = w;
+        if (write_joins(w, v, fd) == -1)
+        {
+            return -1;
+        }
+    }
+    JOIN_RECORD record;
+    record.f = *(children + 0);
+    record.g = *(children + 1);
+    record.u = v;
+    return write(fd, &record, sizeof(record)) == sizeof(record) ? 0 : -1;
+}
+
+/*
+ * Runs in a child process: builds the subtree of the cluster c from its
+ * own submatrix and writes its joins to the pipe, then exits.  The rest of
+ * the tree is stood for by an outgroup, whose distance to each member of
+ * the cluster is its average distance to the active nodes outside it, so
+ * the submatrix has one row more than the cluster.  It is copied into the
+ * first rows of the distances matrix, renumbering the members from 0 with
+ * the outgroup last, and the tree of it is built by the reference engine.
+ * The subtree is that of the cluster rooted at the neighbor of the
+ * outgroup, whose joins are written children first in the numbering of the
+ * child.  Only the rows of the cluster are read, and only the first rows
+ * of the matrix are written.
+ */
+static void build_cluster(int c, int fd)
+{
+    static double submatrix[MAX_NODES][MAX_NODES];
+    static char in_cluster[MAX_NODES];
+    int start = *(cluster_starts + c);
+    int n = *(cluster_starts + c + 1) - start;
+    int *members = cluster_members + start;
+    int m = num_active_nodes;
+    int status = 0;
+
+    //! The submatrix of the cluster, with the outgroup
+    for (int i = 0; i < n; i++)
+    {
+        *(in_cluster + *(members + i)) = 1;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        double *row = *(distances + *(members + i));
+        double outside = 0.0;
+        for (int k = 0; k < m; k++)
+        {
+            int k_index = *(active_node_map + k);
+            if (!*(in_cluster + k_index))
+            {
+                outside += *(row + k_index);
+            }
+        }
+        for (int j = 0; j < n; j++)
+        {
+            *(*(submatrix + i) + j) = *(row + *(members + j));
+        }
+        *(*(submatrix + i) + n) = outside / (m - n);
+        *(*(submatrix + n) + i) = outside / (m - n);
+    }
+    *(*(submatrix + n) + n) = 0.0;
+    for (int i = 0; i <= n; i++)
+    {
+        for (int j = 0; j <= n; j++)
+        {
+            *(*(distances + i) + j) = *(*(submatrix + i) + j);
+        }
+        *(active_node_map + i) = i;
+        *(child_degrees + i) = 0;
+    }
+    num_all_nodes = n + 1;
+    num_active_nodes = n + 1;
+    num_edges = 0;
+
+    //! The tree of the submatrix, by the reference engine
+    while (num_active_nodes > 2 && status == 0)
+    {
+        if (base_engine->step() == -1)
+        {
+            status = 1;
+        }
+    }
+    if (status == 0)
+    {
+        for (int v = n + 1; v < num_all_nodes; v++)
+        {
+            *(child_degrees + v) = 0;
+        }
+        for (int e = 0; e < num_edges; e++)
+        {
+            child_edge(*(*(edge_nodes + e) + 0), *(*(edge_nodes + e) + 1));
+        }
+        child_edge(*(active_node_map + 0), *(active_node_map + 1));
+        int root = *(*(child_adjacent + n) + 0);
+        if (write_joins(root, n, fd) == -1)
+        {
+            status = 1;
+        }
+    }
+    close(fd);
+    _exit(status);
+}
+
+/*
+ * Returns the active node j that minimizes Q(i,j) among all active nodes,
+ * or -1 if the minimum is tied, since of tied partners only some need be
+ * neighbors of i.
+ */
+static int best_partner(int i)
+{
+    int m = num_active_nodes;
+    double *row = *(distances + i);
+    double best_q = 0.0;
+    int best = -1;
+    int tied = 0;
+    for (int k = 0; k < m; k++)
+    {
+        int k_index = *(active_node_map + k);
+        if (k_index == i)
+        {
+            continue;
+        }
+        double q = (m - 2) * *(row + k_index) - *(row_sums + i) - *(row_sums + k_index);
+        if (best == -1 || q < best_q)
+        {
+            best_q = q;
+            best = k_index;
+            tied = 0;
+        }
+        else if (q == best_q)
+        {
+            tied = 1;
+        }
+    }
+    return tied ? -1 : best;
+}
+
+/*
+ * Returns the node of a translated reference of a join, or -1 if it is a
+ * node that has not been made.
+ */
+static int join_node(int reference)
+{
+    return reference >= 0 ? reference : *(made_nodes + (-reference - 1));
+}
+
+/*
+ * Reads the joins of a cluster from the pipe of its child into
+ * join_records, from position *count, and waits for the child.  The joins
+ * of a child that failed are discarded, leaving its cluster unreduced.
+ */
+static void collect_cluster(pid_t pid, int fd, int *count)
+{
+    char *buffer = (char *)(join_records + *count);
+    size_t capacity = (MAX_NODES - *count) * sizeof(JOIN_RECORD);
+    size_t filled = 0;
+    ssize_t got;
+    while (filled < capacity && (got = read(fd, buffer + filled, capacity - filled)) > 0)
+    {
+        filled += got;
+    }
+    close(fd);
+    int status;
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        return;
+    }
+    *count += filled / sizeof(JOIN_RECORD);
+}
+
+/**
+ * @brief  Initialize the divide-and-conquer engine.
+ * @details  If there are more active nodes than the subproblem size (set
+ * by the memory budget given with -L, otherwise 2 sqrt(N)), they are
+ * partitioned by k-medoids into clusters of nearby nodes, with clusters
+ * that are still too large split again.  The subtree of each cluster is
+ * built in a child process of its own, as many at a time as there are
+ * worker threads, since the engines work on the global data structures:
+ * the child builds the tree of the submatrix of the cluster and an
+ * outgroup standing for the rest of the nodes, which takes O(n^3) time for
+ * a cluster of n nodes, and sends back the joins of the
+ * subtree rooted at the outgroup.  The joins are then replayed by
+ * dc_step().  A cluster whose child cannot be started or fails is left to
+ * the reference engine.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+int dc_init(void) {
+    base_engine = find_engine(NULL);
+    num_records = 0;
+    sums_current = 0;
+    int m = num_active_nodes;
+    int size = subproblem_size(m);
+    if (m <= size)
+    {
+        return 0;
+    }
+    int members[MAX_NODES];
+    for (int i = 0; i < m; i++)
+    {
+        *(members + i) = *(active_node_map + i);
+    }
+    num_clusters_found = 0;
+    *(cluster_starts + 0) = 0;
+    partition(members, m, (m + size - 1) / size);
+    split_large_clusters(size);
+    for (int c = 0; c < num_clusters_found; c++)
+    {
+        sort_members(cluster_members + *(cluster_starts + c), *(cluster_starts + c + 1) - *(cluster_starts + c));
+    }
+
+    //! Reduce the clusters in child processes, a bounded number at a time
+    int threads = worker_threads();
+    pid_t pids[MAX_NODES];
+    int fds[MAX_NODES];
+    int next = 0;
+    int count = 0;
+    fflush(NULL);
+    for (int c = 0; c < num_clusters_found; c++)
+    {
+        while (next < num_clusters_found && next < c + threads)
+        {
+            int pipe_fds[2];
+            *(pids + next) = -1;
+            int n = *(cluster_starts + next + 1) - *(cluster_starts + next);
+            if (n >= 2 && pipe(pipe_fds) == 0)
+            {
+                *(pids + next) = fork();
+                if (*(pids + next) == 0)
+                {
+                    close(*(pipe_fds + 0));
+                    build_cluster(next, *(pipe_fds + 1));
+                }
+                close(*(pipe_fds + 1));
+                *(fds + next) = *(pipe_fds + 0);
+                if (*(pids + next) == -1)
+                {
+                    close(*(pipe_fds + 0));
+                }
+            }
+            next++;
+        }
+        *(record_starts + c) = count;
+        if (*(pids + c) != -1)
+        {
+            collect_cluster(*(pids + c), *(fds + c), &count);
+        }
+    }
+    *(record_starts + num_clusters_found) = count;
+
+    //! Translate the nodes of the joins from the numbering of each child
+    num_records = count;
+    for (int c = 0; c < num_clusters_found; c++)
+    {
+        int n = *(cluster_starts + c + 1) - *(cluster_starts + c);
+        int references[MAX_NODES];
+        for (int i = 0; i < n; i++)
+        {
+            *(references + i) = *(cluster_members + *(cluster_starts + c) + i);
+        }
+        for (int r = *(record_starts + c); r < *(record_starts + c + 1); r++)
+        {
+            JOIN_RECORD *record = join_records + r;
+            record->f = *(references + record->f);
+            record->g = *(references + record->g);
+            *(references + record->u) = -(r + 1);
+            *(made_nodes + r) = -1;
+        }
+    }
+    sums_current = 0;
+    return 0;
+}
+
+/**
+ * @brief  Perform one step of the divide-and-conquer engine.
+ * @details  The joins of the subtrees built by dc_init() are replayed, in
+ * order, in a pass over those whose nodes are both active: a join is
+ * replayed if its two nodes are each the best Q partner of the other
+ * among all active nodes, as in relaxed neighbor joining, so that the
+ * subtrees are merged only where they agree with the whole matrix.  This
+ * is a heuristic: a mutually best pair need not be the pair of least Q,
+ * so the tree can differ from that of neighbor joining on any input, even
+ * additive distances.  Each check costs O(N), with the row sums
+ * kept up to date in O(N) per join.  If the pass replays no join, one step
+ * of the reference engine is made instead, and the joins of a subtree
+ * that need a node it has joined are dropped.  The result does not depend
+ * on the number of threads.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+int dc_step(void) {
+    if (!sums_current)
+    {
+        compute_row_sums();
+        sums_current = 1;
+    }
+    int replayed = 0;
+    for (int r = 0; r < num_records && num_active_nodes > 2; r++)
+    {
+        int f = join_node((join_records + r)->f);
+        int g = join_node((join_records + r)->g);
+        if (*(made_nodes + r) != -1 || f == -1 || g == -1
+            || *((nodes + f)->neighbors + 0) != NULL || *((nodes + g)->neighbors + 0) != NULL)
+        {
+            continue;
+        }
+        if (best_partner(f) != g || best_partner(g) != f)
+        {
+            continue;
+        }
+        if (f > g)
+        {
+            int t = f;
+            f = g;
+            g = t;
+        }
+        int u = nj_join(f, g);
+        if (u == -1)
+        {
+            return -1;
+        }
+        update_row_sums(f, g, u);
+        *(made_nodes + r) = u;
+        replayed++;
+    }
+    if (replayed > 0)
+    {
+        return 0;
+    }
+    sums_current = 0;
+    return base_engine->step();
+}
@@ -0,0 +1,653 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <math.h>
+
+#include "global.h"
+#include "debug.h"
+
+/*
+ * Engines that can be selected with -e.  The first entry is the reference
+ * neighbor joining engine, used when no engine is selected.  See the
+ * description of the engine contract in global.h.
+ */
+static int nj_step(void);
+static int nj_mt_step(void);
+
+ENGINE engines[] = {
+    { "nj", 1, NULL, nj_step, NULL },
+    { "nj-mt", 1, NULL, nj_mt_step, NULL },
+    { "nj-f32", 1, nj_f32_init, nj_f32_step, NULL },
+    { "nj-q16", 1, nj_q16_init, nj_q16_step, NULL },
+    { "bionj", 0, bionj_init, bionj_step, NULL },
+    { "upgma", 0, cluster_init, upgma_step, cluster_last_edge },
+    { "wpgma", 0, cluster_init, wpgma_step, cluster_last_edge },
+    { "rnj", 0, rnj_init, rnj_step, NULL },
+    { "nj-batch", 0, NULL, nj_batch_step, NULL },
+    { "single", 0, single_init, single_step, single_last_edge },
+    { "dc", 0, dc_init, dc_step, NULL },
+    { "nj-lazy", 0, nj_lazy_init, nj_lazy_step, nj_lazy_last_edge },
+    { NULL, 0, NULL, NULL, NULL }
+};
+
+/**
+ * @brief  Look up an engine by name.
+ * @param name  The name of the engine, or NULL for the reference engine.
+ * @return the engine, or NULL if there is no engine with that name.
+ */
+ENGINE *find_engine(char *name) {
+    if (name == NULL)
+    {
+        return engines;
+    }
+    for (ENGINE *engine = engines; engine->name != NULL; engine++)
+    {
+        if (strcmp(engine->name, name) == 0)
+        {
+            return engine;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief  Number of worker threads used by the parallel engines.
+ * @return the value given with -j, or else the number of online processors.
+ */
+int worker_threads(void) {
+    if (num_threads > 0)
+    {
+        return num_threads;
+    }
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    return processors > 0 ? (int)processors : 1;
+}
+
+/*
+ * Records an edge of the synthesized tree in the edge_nodes and edge_lengths arrays.
+ */
+static void add_edge(int a, int b, double length)
+{
+    *(*(edge_nodes + num_edges) + 0) = a;
+    *(*(edge_nodes + num_edges) + 1) = b;
+    *(edge_lengths + num_edges) = length;
+    num_edges++;
+}
+
+/*
+ * Running sums and compensation terms of the row sums maintained by
+ * update_row_sums(), whose sum is the value stored in row_sums.
+ */
+static double running_sums[MAX_NODES];
+static double running_errors[MAX_NODES];
+
+/* Number of distances summed directly at the leaves of a pairwise summation. */
+#define PAIRWISE_BLOCK 32
+
+/*
+ * Sums the entries of a row for the active nodes in the active slots
+ * [from, to) by pairwise summation, so that the rounding error grows with
+ * the logarithm of the number of terms rather than linearly.  The blocks
+ * at the leaves are summed with four independent accumulators, which
+ * keeps the additions pipelined and lets them be done in vector registers.
+ */
+static double pairwise_sum(double *row, int from, int to)
+{
+    if (to - from > PAIRWISE_BLOCK)
+    {
+        int middle = from + (to - from) / 2;
+        return pairwise_sum(row, from, middle) + pairwise_sum(row, middle, to);
+    }
+    double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    int k = from;
+    for (; k + 4 <= to; k += 4)
+    {
+        s0 += *(row + *(active_node_map + k));
+        s1 += *(row + *(active_node_map + k + 1));
+        s2 += *(row + *(active_node_map + k + 2));
+        s3 += *(row + *(active_node_map + k + 3));
+    }
+    for (; k < to; k++)
+    {
+        s0 += *(row + *(active_node_map + k));
+    }
+    return (s0 + s1) + (s2 + s3);
+}
+
+/*
+ * Adds x to the sum *sum, accumulating the rounding error in *error
+ * (Neumaier's variant of Kahan summation).
+ */
+static void compensated_add(double *sum, double *error, double x)
+{
+    double t = *sum + x;
+    if (fabs(*sum) >= fabs(x))
+        *error += (*sum - t) + x;
+    else
+        *error += (x - t) + *sum;
+    *sum = t;
+}
+
+/**
+ * @brief  Compute the row sum S(i) of one active node.
+ * @details  The distances to the active nodes are summed pairwise in the
+ * order of active_node_map, that is, in increasing order of node index,
+ * so that every engine obtains exactly the same value, and the error
+ * stays small even for large N.
+ *
+ * @param i  Index of the node.
+ * @return the sum of the distances from node i to all active nodes.
+ */
+double row_sum(int i) {
+    return pairwise_sum(*(distances + i), 0, num_active_nodes);
+}
+
+/**
+ * @brief  Sum the entries of a row for the active nodes, as row_sum() does.
+ * @details  This is for engines that hold rows of distances outside the
+ * distances matrix.
+ *
+ * @param row  The row, indexed by node.
+ * @return the sum of the entries of the row for all active nodes.
+ */
+double active_sum(double *row) {
+    return pairwise_sum(row, 0, num_active_nodes);
+}
+
+/**
+ * @brief  Compute the row sums S(i) of all active nodes into row_sums.
+ */
+void compute_row_sums(void) {
+    for (int i = 0; i < num_active_nodes; i++)
+    {
+        int i_index = *(active_node_map + i);
+        *(row_sums + i_index) = row_sum(i_index);
+        *(running_sums + i_index) = *(row_sums + i_index);
+        *(running_errors + i_index) = 0.0;
+    }
+    check_row_sums();
+}
+
+/**
+ * @brief  Update the row sums incrementally after a join.
+ * @details  Instead of recomputing every row sum in O(N^2), the
+ * contributions of the joined nodes f and g are replaced by that of the
+ * new node u in O(N), and the row sum of u is computed directly.  The
+ * row sums must have been computed by compute_row_sums() and since kept
+ * up to date by this function.  The additions are compensated, so the
+ * values do not drift from a recomputation as the joins go on, but they
+ * can still differ in the last bits, so engines under the exact contract
+ * do not use this.
+ *
+ * @param f  Index of the first node joined.
+ * @param g  Index of the second node joined.
+ * @param u  Index of the new node, which must be active.
+ */
+void update_row_sums(int f, int g, int u) {
+    double *f_row = *(distances + f);
+    double *g_row = *(distances + g);
+    double *u_row = *(distances + u);
+    for (int k = 0; k < num_active_nodes; k++)
+    {
+        int k_index = *(active_node_map + k);
+        if (k_index != u)
+        {
+            double *sum = running_sums + k_index;
+            double *error = running_errors + k_index;
+            compensated_add(sum, error, *(u_row + k_index));
+            compensated_add(sum, error, -*(f_row + k_index));
+            compensated_add(sum, error, -*(g_row + k_index));
+            *(row_sums + k_index) = *sum + *error;
+        }
+    }
+    *(row_sums + u) = row_sum(u);
+    *(running_sums + u) = *(row_sums + u);
+    *(running_errors + u) = 0.0;
+    check_row_sums();
+}
+
+/**
+ * @brief  Record the drift of the row sums from an exact recomputation.
+ * @details  If the -D option was given, each active node's row sum is
+ * compared with its sum recomputed in extended precision with
+ * compensation, and row_sum_drift is raised to the largest difference.
+ * Otherwise this does nothing.  It is called wherever the row sums of all
+ * active nodes have just been computed or updated.
+ */
+void check_row_sums(void) {
+    if (!(global_options & DRIFT_OPTION))
+    {
+        return;
+    }
+    for (int i = 0; i < num_active_nodes; i++)
+    {
+        int i_index = *(active_node_map + i);
+        double *row = *(distances + i_index);
+        long double sum = 0, error = 0;
+        for (int k = 0; k < num_active_nodes; k++)
+        {
+            long double x = *(row + *(active_node_map + k));
+            long double t = sum + x;
+            if (fabsl(sum) >= fabsl(x))
+                error += (sum - t) + x;
+            else
+                error += (x - t) + sum;
+            sum = t;
+        }
+        double drift = fabsl(*(row_sums + i_index) - (sum + error));
+        if (drift > row_sum_drift)
+        {
+            row_sum_drift = drift;
+        }
+    }
+}
+
+/**
+ * @brief  Create a new internal node, which is not yet joined to any others.
+ * @details  The node is given the index num_all_nodes, which is then
+ * incremented, and the name "#nnn", where nnn is its index.  The caller is
+ * expected to fill in its row and column of the distances matrix for the
+ * active nodes, and then call join_nodes().  Several nodes may be created
+ * before they are joined.
+ *
+ * @return the index of the new node, or -1 if the maximum number of nodes
+ * would be exceeded.
+ */
+int new_node(void) {
+    if (num_all_nodes >= MAX_NODES)
+    {
+        fprintf(stderr, "Error: Number of nodes exceeds maximum nodes!\n");
+        return -1;
+    }
+    int u_index = num_all_nodes;
+    NODE *node = nodes + u_index;
+    char *node_names_pointer = *(node_names + u_index);
+    *node_names_pointer = '#';
+    sprintf(node_names_pointer + 1, "%d", u_index);
+    node->name = node_names_pointer;
+    *(node->neighbors + 0) = NULL;
+    *(node->neighbors + 1) = NULL;
+    *(node->neighbors + 2) = NULL;
+    *(*(distances + u_index) + u_index) = 0.0;
+    num_all_nodes++;
+    return u_index;
+}
+
+/**
+ * @brief  Join two active nodes to a new node created by new_node().
+ * @details  Edges f-u and g-u are recorded with the given lengths, u becomes
+ * the parent (neighbors[0]) of f and g, and f and g are replaced by u in the
+ * set of active nodes.  The active nodes are kept in increasing order of
+ * node index: f and g are removed by closing up the gaps, and u, which has
+ * the largest index of the active nodes, is appended.  This costs O(N) per
+ * join, which is small compared to any search for the pair to join, and it
+ * is what makes the order of active_node_map independent of the history of
+ * joins.
+ *
+ * @param f  Index of the first node joined, which must be less than g.
+ * @param g  Index of the second node joined.
+ * @param u  Index of the new node.
+ * @param f_branch  Length of the edge f-u.
+ * @param g_branch  Length of the edge g-u.
+ */
+void join_nodes(int f, int g, int u, double f_branch, double g_branch) {
+    add_edge(f, u, f_branch);
+    add_edge(g, u, g_branch);
+    *((nodes + f)->neighbors + 0) = nodes + u;
+    *((nodes + g)->neighbors + 0) = nodes + u;
+    *((nodes + u)->neighbors + 1) = nodes + f;
+    *((nodes + u)->neighbors + 2) = nodes + g;
+    int kept = 0;
+    for (int k = 0; k < num_active_nodes; k++)
+    {
+        int k_index = *(active_node_map + k);
+        if (k_index != f && k_index != g)
+        {
+            *(active_node_map + kept++) = k_index;
+        }
+    }
+    *(active_node_map + kept++) = u;
+    num_active_nodes = kept;
+}
+
+/**
+ * @brief  Join the last two active nodes by a single edge.
+ * @details  The edge is stored in the neighbors[0] field of both nodes,
+ * and its length is their estimated distance, unless the engine computes
+ * it otherwise.  It is recorded with the node of smaller index first.
+ *
+ * @param engine  The engine that built the tree.
+ */
+void finish_tree(ENGINE *engine) {
+    if (num_active_nodes != 2)
+    {
+        num_active_nodes = 0;
+        return;
+    }
+    int a_index = *(active_node_map + 0);
+    int b_index = *(active_node_map + 1);
+    *((nodes + a_index)->neighbors + 0) = (nodes + b_index);
+    *((nodes + b_index)->neighbors + 0) = (nodes + a_index);
+    if (engine->last_edge != NULL)
+        add_edge(a_index, b_index, engine->last_edge(a_index, b_index));
+    else
+        add_edge(a_index, b_index, *(*(distances + a_index) + b_index));
+    num_active_nodes = 0;
+}
+
+/**
+ * @brief  Perform one neighbor joining step on a chosen pair of nodes.
+ * @details  The row sums must be current.  A new node u is created, the
+ * branch lengths are estimated and the distances from u to the active nodes
+ * are computed as:
+ *
+ *    D'(u, f) = (D(f, g) + (S(f) - S(g)) / (N - 2)) / 2
+ *    D'(u, g) = D(f, g) - D'(u, f)
+ *    D'(u, k) = (D(f, k) + D(g, k) - D(f, g)) / 2
+ *
+ * after which f and g are joined to u.  Every NJ-family engine uses this
+ * function for its joins, so that given the same pair they produce the
+ * same values bit for bit.
+ *
+ * @param f  Index of the first node to join, which must be less than g.
+ * @param g  Index of the second node to join.
+ * @return the index of the new node, or -1 if an error occurred.
+ */
+int nj_join(int f, int g) {
+    int u = new_node();
+    if (u == -1)
+    {
+        return -1;
+    }
+    double *f_row = *(distances + f);
+    double *g_row = *(distances + g);
+    double f_g = *(f_row + g);
+    double f_branch = ((f_g/2) + (*(row_sums + f) - *(row_sums + g)) / (2 * (num_active_nodes - 2)));
+    double g_branch = f_g - f_branch;
+    for (int k = 0; k < num_active_nodes; k++)
+    {
+        int k_index = *(active_node_map + k);
+        double value;
+        if (k_index == f)
+            value = f_branch;
+        else if (k_index == g)
+            value = g_branch;
+        else
+            value = (*(f_row + k_index) + *(g_row + k_index) - f_g) / 2.0;
+        *(*(distances + u) + k_index) = value;
+        *(*(distances + k_index) + u) = value;
+    }
+    join_nodes(f, g, u, f_branch, g_branch);
+    return u;
+}
+
+/*
+ * Finds the pair of active nodes with minimal Q(i,j) = (N-2) * D(i,j) - S(i) - S(j)
+ * among the pairs whose first node is in the active slots [from, to),
+ * breaking ties canonically.  Returns the best Q value in *best_q and the
+ * pair in *best_f and *best_g (-1 if there is none).
+ */
+static void nj_scan_rows(int from, int to, double *best_q, int *best_f, int *best_g)
+{
+    int m = num_active_nodes;
+    *best_f = -1;
+    *best_g = -1;
+    for (int i = from; i < to; i++)
+    {
+        int i_index = *(active_node_map + i);
+        double *row = *(distances + i_index);
+        double s_i = *(row_sums + i_index);
+        for (int j = i + 1; j < m; j++)
+        {
+            int j_index = *(active_node_map + j);
+            double q = (m - 2) * *(row + j_index) - s_i - *(row_sums + j_index);
+            if (*best_f == -1 || BETTER_PAIR(q, i_index, j_index, *best_q, *best_f, *best_g))
+            {
+                *best_q = q;
+                *best_f = i_index;
+                *best_g = j_index;
+            }
+        }
+    }
+}
+
+/**
+ * @brief  Find the pair of active nodes to join by the neighbor joining
+ * criterion.
+ * @details  The row sums must be current.  All pairs are scanned for the
+ * minimal value of Q(i,j) = (N-2) * D(i,j) - S(i) - S(j), with ties broken
+ * canonically.
+ *
+ * @param f  Set to the smaller index of the pair.
+ * @param g  Set to the larger index of the pair.
+ */
+void nj_best_pair(int *f, int *g) {
+    double best_q;
+    nj_scan_rows(0, num_active_nodes, &best_q, f, g);
+}
+
+/*
+ * Reference engine: recompute the row sums, scan all pairs for the minimal
+ * Q value and join that pair.
+ */
+static int nj_step(void)
+{
+    int f, g;
+    compute_row_sums();
+    nj_best_pair(&f, &g);
+    return nj_join(f, g) == -1 ? -1 : 0;
+}
+
+/*
+ * Work assigned to one thread of the parallel engine: a block of active
+ * slots for which to compute the row sums, or a set of rows to scan.
+ */
+typedef struct nj_work {
+    int from;
+    int to;
+    int stride;
+    int phase;
+    double best_q;
+    int best_f;
+    int best_g;
+} NJ_WORK;
+
+/*
+ * Thread start routine for the parallel engine.  In phase 0 the row sums
+ * of a block of active slots are computed; in phase 1 the rows
+ * from, from + stride, ... are scanned for the best pair.
+ */
+static void *nj_mt_thread(void *arg)
+{
+    NJ_WORK *work = arg;
+    if (work->phase == 0)
+    {
+        for (int i = work->from; i < work->to; i++)
+        {
+            int i_index = *(active_node_map + i);
+            *(row_sums + i_index) = row_sum(i_index);
+        }
+        return NULL;
+    }
+    work->best_f = -1;
+    for (int i = work->from; i < num_active_nodes; i += work->stride)
+    {
+        double q;
+        int f, g;
+        nj_scan_rows(i, i + 1, &q, &f, &g);
+        if (f != -1 && (work->best_f == -1 || BETTER_PAIR(q, f, g, work->best_q, work->best_f, work->best_g)))
+        {
+            work->best_q = q;
+            work->best_f = f;
+            work->best_g = g;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief  Run a thread routine on an array of work items in parallel.
+ * @details  One thread is started per work item and all are waited for.
+ * If a thread cannot be created, its work is done on the calling thread.
+ *
+ * @param routine  The thread start routine, which is passed a pointer to
+ * its work item.
+ * @param work  The array of work items.
+ * @param size  The size of each work item.
+ * @param threads  The number of work items, at most MAX_NODES.
+ */
+void run_parallel(void *(*routine)(void *), void *work, size_t size, int threads)
+{
+    pthread_t ids[MAX_NODES];
+    int started[MAX_NODES];
+    for (int t = 0; t < threads; t++)
+    {
+        void *item = (char *)work + t * size;
+        *(started + t) = pthread_create(ids + t, NULL, routine, item) == 0;
+        if (!*(started + t))
+        {
+            routine(item);
+        }
+    }
+    for (int t = 0; t < threads; t++)
+    {
+        if (*(started + t))
+        {
+            pthread_join(*(ids + t), NULL);
+        }
+    }
+}
+
+/*
+ * Parallel engine: the row sums and the Q search are divided among
+ * worker threads.  The rows of the upper triangle are dealt out
+ * cyclically, which balances their decreasing lengths.  Each thread
+ * applies the canonical tie-break to its own rows and the results are
+ * combined in the same way, so the chosen pair is that of the reference.
+ */
+static int nj_mt_step(void)
+{
+    NJ_WORK work[MAX_NODES];
+    int threads = worker_threads();
+    if (threads > num_active_nodes / 2)
+    {
+        threads = num_active_nodes / 2;
+    }
+    if (threads < 2)
+    {
+        return nj_step();
+    }
+    int block = (num_active_nodes + threads - 1) / threads;
+    for (int t = 0; t < threads; t++)
+    {
+        (work + t)->phase = 0;
+        (work + t)->from = t * block < num_active_nodes ? t * block : num_active_nodes;
+        (work + t)->to = (t + 1) * block < num_active_nodes ? (t + 1) * block : num_active_nodes;
+    }
+    run_parallel(nj_mt_thread, work, sizeof(NJ_WORK), threads);
+    check_row_sums();
+    for (int t = 0; t < threads; t++)
+    {
+        (work + t)->phase = 1;
+        (work + t)->from = t;
+        (work + t)->stride = threads;
+    }
+    run_parallel(nj_mt_thread, work, sizeof(NJ_WORK), threads);
+    NJ_WORK *best = NULL;
+    for (int t = 0; t < threads; t++)
+    {
+        NJ_WORK *w = work + t;
+        if (w->best_f != -1 && (best == NULL || BETTER_PAIR(w->best_q, w->best_f, w->best_g, best->best_q, best->best_f, best->best_g)))
+        {
+            best = w;
+        }
+    }
+    return nj_join(best->best_f, best->best_g) == -1 ? -1 : 0;
+}
+
+/**
+ * @brief  Check the engine contract for every exact engine.
+ * @details  This function assumes that the distance data has been read
+ * by read_distance_data().  It builds the tree with the reference engine
+ * and then with each other exact engine, and compares the edges, the
+ * NODE structures and the distances matrix bit for bit with the
+ * reference.  One line reporting the outcome is printed for each engine.
+ * The data structures are left holding the reference tree.
+ *
+ * @param out  Stream to which to report the outcome for each engine.
+ * @return 0 if every exact engine matched the reference, otherwise -1.
+ */
+int verify_engines(FILE *out) {
+    static int reference_edges[MAX_EDGES][2];
+    static double reference_lengths[MAX_EDGES];
+    static double reference_distances[MAX_NODES][MAX_NODES];
+    static int reference_neighbors[MAX_NODES][3];
+    char *selected = engine_name;
+    int reference_num_edges = 0;
+    int reference_num_nodes = 0;
+    int result = 0;
+    for (ENGINE *engine = engines; engine->name != NULL; engine++)
+    {
+        if (!engine->exact)
+        {
+            continue;
+        }
+        engine_name = engine->name;
+        if (build_taxonomy(NULL) == -1)
+        {
+            fprintf(out, "%s: FAILED\n", engine->name);
+            result = -1;
+            continue;
+        }
+        int mismatch = 0;
+        for (int i = 0; i < num_all_nodes; i++)
+        {
+            for (int k = 0; k < 3; k++)
+            {
+                NODE *neighbor = *((nodes + i)->neighbors + k);
+                int index = neighbor == NULL ? -1 : (int)(neighbor - nodes);
+                if (engine == engines)
+                    *(*(reference_neighbors + i) + k) = index;
+                else if (*(*(reference_neighbors + i) + k) != index)
+                    mismatch = 1;
+            }
+        }
+        if (engine == engines)
+        {
+            reference_num_edges = num_edges;
+            reference_num_nodes = num_all_nodes;
+            memcpy(reference_edges, edge_nodes, num_edges * sizeof(*edge_nodes));
+            memcpy(reference_lengths, edge_lengths, num_edges * sizeof(*edge_lengths));
+            for (int i = 0; i < num_all_nodes; i++)
+            {
+                memcpy(*(reference_distances + i), *(distances + i), num_all_nodes * sizeof(double));
+            }
+            fprintf(out, "%s: reference\n", engine->name);
+            continue;
+        }
+        if (num_edges != reference_num_edges || num_all_nodes != reference_num_nodes
+            || memcmp(reference_edges, edge_nodes, num_edges * sizeof(*edge_nodes)) != 0
+            || memcmp(reference_lengths, edge_lengths, num_edges * sizeof(*edge_lengths)) != 0)
+        {
+            mismatch = 1;
+        }
+        for (int i = 0; i < num_all_nodes && !mismatch; i++)
+        {
+            if (memcmp(*(reference_distances + i), *(distances + i), num_all_nodes * sizeof(double)) != 0)
+            {
+                mismatch = 1;
+            }
+        }
+        fprintf(out, "%s: %s\n", engine->name, mismatch ? "MISMATCH" : "ok");
+        if (mismatch)
+        {
+            result = -1;
+        }
+    }
+    // leave the reference tree in place
+    engine_name = NULL;
+    build_taxonomy(NULL);
+    engine_name = selected;
+    return result;
+}
@@ -0,0 +1,573 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "global.h"
+#include "debug.h"
+
+/* Maximum number of sites in an alignment, and of 64-bit words to hold one bit per site. */
+#define MAX_SITES (1 << 20)
+#define SITE_WORDS (MAX_SITES / 64)
+
+/*
+ * The aligned sequences, packed two bits per site into two bit planes:
+ * A, C, G and T (or U) are coded 0, 1, 2 and 3, and bit s of the high
+ * and low planes of a sequence hold the high and low bits of the code of
+ * site s.  Bit s of the valid plane is set if site s holds one of those
+ * four bases, and is clear for gaps and ambiguity codes, whose high and
+ * low bits are zero.  Mismatches between two sequences are thus found 64
+ * sites at a time by XOR, masked by the sites valid in both, and counted
+ * with popcount.
+ */
+static uint64_t high_bits[MAX_TAXA][SITE_WORDS];
+static uint64_t low_bits[MAX_TAXA][SITE_WORDS];
+static uint64_t valid_bits[MAX_TAXA][SITE_WORDS];
+
+/*
+ * Aligned amino acid sequences, packed five bits per site into five bit
+ * planes: the 20 amino acids are coded 0 to 19, and bit s of plane b of a
+ * sequence holds bit b of the code of site s.  As for nucleotides, the
+ * valid plane marks the sites holding an amino acid, so two residues
+ * differ where any plane differs, and the mismatches are counted 64 sites
+ * at a time by OR-ing the XOR of the planes.
+ */
+#define MAX_RESIDUES (1 << 16)
+#define RESIDUE_WORDS (MAX_RESIDUES / 64)
+#define RESIDUE_PLANES 5
+static uint64_t residue_bits[RESIDUE_PLANES][MAX_TAXA][RESIDUE_WORDS];
+
+/* The amino acids in the order of their codes. */
+static const char amino_acids[] = "ARNDCQEGHILKMFPSTWYV";
+
+/*
+ * Largest number of sequences in a tile of the all-pairs computation, and
+ * number of 64-site words in a block of sites, chosen so that the three
+ * bit planes of two full tiles over a block take 384 KiB, which fits in
+ * the L2 cache of current processors.
+ */
+#define TILE_TAXA 16
+#define BLOCK_WORDS 512
+
+/* Number of sites of each sequence read so far, and of the alignment. */
+static long sequence_lengths[MAX_TAXA];
+static long num_sites;
+
+/*
+ * Returns the code of a base (0-3), 4 for a gap or an ambiguity code, or
+ * -1 for a character that cannot appear in a nucleotide sequence.
+ */
+static int base_code(int c)
+{
+    switch (c)
+    {
+    case 'A': case 'a':
+        return 0;
+    case 'C': case 'c':
+        return 1;
+    case 'G': case 'g':
+        return 2;
+    case 'T': case 't': case 'U': case 'u':
+        return 3;
+    case '-': case '.': case '?':
+    case 'N': case 'n': case 'R': case 'r': case 'Y': case 'y':
+    case 'K': case 'k': case 'M': case 'm': case 'S': case 's':
+    case 'W': case 'w': case 'B': case 'b': case 'D': case 'd':
+    case 'H': case 'h': case 'V': case 'v':
+        return 4;
+    default:
+        return -1;
+    }
+}
+
+/*
+ * Returns the code of an amino acid (0-19), 20 for a gap, a stop or an
+ * ambiguous or rare residue, or -1 for a character that cannot appear in a
+ * protein sequence.
+ */
+static int residue_code(int c)
+{
+    char *found = c == '\0' ? NULL : strchr(amino_acids, toupper(c));
+    if (found != NULL)
+    {
+        return found - amino_acids;
+    }
+    return c != '\0' && strchr("BZJXUO*-.?", toupper(c)) != NULL ? 20 : -1;
+}
+
+/*
+ * Appends the amino acid of the given code to sequence i.
+ */
+static void append_residue(int i, int code)
+{
+    long s = *(sequence_lengths + i);
+    uint64_t bit = (uint64_t)1 << (s % 64);
+    if (code < 20)
+    {
+        for (int b = 0; b < RESIDUE_PLANES; b++)
+        {
+            if (code & (1 << b))
+                *(*(*(residue_bits + b) + i) + s / 64) |= bit;
+        }
+        *(*(valid_bits + i) + s / 64) |= bit;
+    }
+    *(sequence_lengths + i) = s + 1;
+}
+
+/*
+ * Appends the base of the given code to sequence i.
+ */
+static void append_site(int i, int code)
+{
+    long s = *(sequence_lengths + i);
+    uint64_t bit = (uint64_t)1 << (s % 64);
+    if (code < 4)
+    {
+        if (code & 2)
+            *(*(high_bits + i) + s / 64) |= bit;
+        if (code & 1)
+            *(*(low_bits + i) + s / 64) |= bit;
+        *(*(valid_bits + i) + s / 64) |= bit;
+    }
+    *(sequence_lengths + i) = s + 1;
+}
+
+#if defined(__AVX2__)
+/*
+ * Returns the number of set bits in each of the four 64-bit lanes of v,
+ * by looking up the count of each half byte with a byte shuffle and
+ * summing the bytes of each lane.
+ */
+static __m256i popcount_lanes(__m256i v)
+{
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i nibbles = _mm256_set1_epi8(0x0f);
+    __m256i low = _mm256_and_si256(v, nibbles);
+    __m256i high = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibbles);
+    __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, low), _mm256_shuffle_epi8(lookup, high));
+    return _mm256_sad_epu8(counts, _mm256_setzero_si256());
+}
+#endif
+
+/*
+ * Adds the counts of the sites compared, the purine and pyrimidine
+ * transitions and the transversions between sequences i and j, in the
+ * 64-site words [from, to), to totals[0..3].  With the codes A = 00,
+ * C = 01, G = 10 and T = 11, a transition (A-G or C-T) changes the high
+ * bit only, and a transversion changes the low bit, while the low bit
+ * tells purines (0) from pyrimidines (1).  So all of the counts come out
+ * of the XOR of the bit planes, 64 sites at a time, and 256 at a time
+ * with AVX2 when the program is compiled for it.
+ */
+static void count_block(int i, int j, int from, int to, long *totals)
+{
+    uint64_t *i_high = *(high_bits + i), *j_high = *(high_bits + j);
+    uint64_t *i_low = *(low_bits + i), *j_low = *(low_bits + j);
+    uint64_t *i_valid = *(valid_bits + i), *j_valid = *(valid_bits + j);
+    int w = from;
+#if defined(__AVX2__)
+    __m256i lane_totals[4];
+    for (int c = 0; c < 4; c++)
+    {
+        *(lane_totals + c) = _mm256_setzero_si256();
+    }
+    for (; w + 4 <= to; w += 4)
+    {
+        __m256i both = _mm256_and_si256(_mm256_loadu_si256((__m256i *)(i_valid + w)),
+                                        _mm256_loadu_si256((__m256i *)(j_valid + w)));
+        __m256i low = _mm256_loadu_si256((__m256i *)(i_low + w));
+        __m256i high_differ = _mm256_xor_si256(_mm256_loadu_si256((__m256i *)(i_high + w)),
+                                               _mm256_loadu_si256((__m256i *)(j_high + w)));
+        __m256i low_differ = _mm256_and_si256(_mm256_xor_si256(low, _mm256_loadu_si256((__m256i *)(j_low + w))), both);
+        __m256i transitions = _mm256_andnot_si256(low_differ, _mm256_and_si256(high_differ, both));
+        *(lane_totals + 0) = _mm256_add_epi64(*(lane_totals + 0), popcount_lanes(both));
+        *(lane_totals + 1) = _mm256_add_epi64(*(lane_totals + 1), popcount_lanes(_mm256_andnot_si256(low, transitions)));
+        *(lane_totals + 2) = _mm256_add_epi64(*(lane_totals + 2), popcount_lanes(_mm256_and_si256(low, transitions)));
+        *(lane_totals + 3) = _mm256_add_epi64(*(lane_totals + 3), popcount_lanes(low_differ));
+    }
+    for (int c = 0; c < 4; c++)
+    {
+        uint64_t lanes[4];
+        _mm256_storeu_si256((__m256i *)lanes, *(lane_totals + c));
+        *(totals + c) += *(lanes + 0) + *(lanes + 1) + *(lanes + 2) + *(lanes + 3);
+    }
+#endif
+    for (; w < to; w++)
+    {
+        uint64_t both = *(i_valid + w) & *(j_valid + w);
+        uint64_t low = *(i_low + w);
+        uint64_t low_differ = (low ^ *(j_low + w)) & both;
+        uint64_t transitions = (*(i_high + w) ^ *(j_high + w)) & both & ~low_differ;
+        *(totals + 0) += __builtin_popcountll(both);
+        *(totals + 1) += __builtin_popcountll(transitions & ~low);
+        *(totals + 2) += __builtin_popcountll(transitions & low);
+        *(totals + 3) += __builtin_popcountll(low_differ);
+    }
+}
+
+/*
+ * As count_block(), for amino acid sequences: adds the number of sites
+ * compared to totals[0] and the number of differences, which are all
+ * counted as transversions, to totals[3].
+ */
+static void count_residue_block(int i, int j, int from, int to, long *totals)
+{
+    uint64_t *i_valid = *(valid_bits + i), *j_valid = *(valid_bits + j);
+    int w = from;
+#if defined(__AVX2__)
+    __m256i compared = _mm256_setzero_si256(), differences = _mm256_setzero_si256();
+    for (; w + 4 <= to; w += 4)
+    {
+        __m256i both = _mm256_and_si256(_mm256_loadu_si256((__m256i *)(i_valid + w)),
+                                        _mm256_loadu_si256((__m256i *)(j_valid + w)));
+        __m256i differ = _mm256_setzero_si256();
+        for (int b = 0; b < RESIDUE_PLANES; b++)
+        {
+            differ = _mm256_or_si256(differ, _mm256_xor_si256(_mm256_loadu_si256((__m256i *)(*(*(residue_bits + b) + i) + w)),
+                                                              _mm256_loadu_si256((__m256i *)(*(*(residue_bits + b) + j) + w))));
+        }
+        compared = _mm256_add_epi64(compared, popcount_lanes(both));
+        differences = _mm256_add_epi64(differences, popcount_lanes(_mm256_and_si256(differ, both)));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, compared);
+    *(totals + 0) += *(lanes + 0) + *(lanes + 1) + *(lanes + 2) + *(lanes + 3);
+    _mm256_storeu_si256((__m256i *)lanes, differences);
+    *(totals + 3) += *(lanes + 0) + *(lanes + 1) + *(lanes + 2) + *(lanes + 3);
+#endif
+    for (; w < to; w++)
+    {
+        uint64_t both = *(i_valid + w) & *(j_valid + w);
+        uint64_t differ = 0;
+        for (int b = 0; b < RESIDUE_PLANES; b++)
+        {
+            differ |= *(*(*(residue_bits + b) + i) + w) ^ *(*(*(residue_bits + b) + j) + w);
+        }
+        *(totals + 0) += __builtin_popcountll(both);
+        *(totals + 3) += __builtin_popcountll(differ & both);
+    }
+}
+
+/*
+ * Stores the counts accumulated in totals[0..3] into *counts.
+ */
+static void store_counts(long *totals, SITE_COUNTS *counts)
+{
+    counts->compared = *(totals + 0);
+    counts->purine_transitions = *(totals + 1);
+    counts->pyrimidine_transitions = *(totals + 2);
+    counts->transversions = *(totals + 3);
+}
+
+/**
+ * @brief  Count the differences between two of the aligned sequences.
+ * @details  Only the sites holding one of the four bases (or, in a protein
+ * alignment, one of the 20 amino acids) in both sequences are compared.
+ *
+ * @param i  Index of the first sequence.
+ * @param j  Index of the second sequence.
+ * @param counts  Set to the numbers of sites compared, of purine and
+ * pyrimidine transitions, and of transversions.
+ */
+void count_differences(int i, int j, SITE_COUNTS *counts) {
+    long totals[4] = { 0, 0, 0, 0 };
+    if (input_format == INPUT_PROTEIN)
+        count_residue_block(i, j, 0, (num_sites + 63) / 64, totals);
+    else
+        count_block(i, j, 0, (num_sites + 63) / 64, totals);
+    store_counts(totals, counts);
+}
+
+/*
+ * Work of one thread computing distances: the tiles of pairs are taken
+ * in turn from next_tile, and the thread reports the pairs it found
+ * saturated, and whether it found a pair with no sites to compare.
+ */
+typedef struct tile_work {
+    int saturated;
+    int incomparable;
+} TILE_WORK;
+
+/* Number of sequences in a tile, number of tiles per side, and the next pair of tiles to do. */
+static int tile_taxa;
+static int num_tiles;
+static int next_tile;
+
+/*
+ * Computes the distances between the sequences of tiles a and b (a <= b),
+ * writing them straight into the distances matrix.  The sites are taken
+ * in blocks, small enough for the bit planes of both tiles to stay in the
+ * L2 cache while every pair of the tiles is counted over the block.
+ */
+static void compute_tile(int a, int b, TILE_WORK *work)
+{
+    long totals[TILE_TAXA][TILE_TAXA][4];
+    SITE_COUNTS counts[TILE_TAXA];
+    double values[TILE_TAXA];
+    int i_from = a * tile_taxa, i_to = i_from + tile_taxa < num_taxa ? i_from + tile_taxa : num_taxa;
+    int j_from = b * tile_taxa, j_to = j_from + tile_taxa < num_taxa ? j_from + tile_taxa : num_taxa;
+    int words = (num_sites + 63) / 64;
+    // amino acids take twice as many planes as bases
+    int block = input_format == INPUT_PROTEIN ? BLOCK_WORDS / 2 : BLOCK_WORDS;
+    memset(totals, 0, sizeof(totals));
+    for (int from = 0; from < words; from += block)
+    {
+        int to = from + block < words ? from + block : words;
+        for (int i = i_from; i < i_to; i++)
+        {
+            for (int j = (i + 1 > j_from ? i + 1 : j_from); j < j_to; j++)
+            {
+                if (input_format == INPUT_PROTEIN)
+                    count_residue_block(i, j, from, to, *(*(totals + i - i_from) + j - j_from));
+                else
+                    count_block(i, j, from, to, *(*(totals + i - i_from) + j - j_from));
+            }
+        }
+    }
+    for (int i = i_from; i < i_to; i++)
+    {
+        int j_start = i + 1 > j_from ? i + 1 : j_from;
+        int n = j_to - j_start;
+        if (n <= 0)
+        {
+            continue;
+        }
+        for (int j = j_start; j < j_to; j++)
+        {
+            store_counts(*(*(totals + i - i_from) + j - j_from), counts + j - j_start);
+            if ((counts + j - j_start)->compared == 0)
+            {
+                work->incomparable = 1;
+                return;
+            }
+        }
+        work->saturated += model_distances(counts, values, n);
+        for (int j = j_start; j < j_to; j++)
+        {
+            *(*(distances + i) + j) = *(values + j - j_start);
+            *(*(distances + j) + i) = *(values + j - j_start);
+        }
+    }
+}
+
+/*
+ * Thread start routine computing distances: takes pairs of tiles, in
+ * order of the rows of the upper triangle of tiles, until none is left,
+ * so that threads that get cheaper tiles simply take more of them.
+ */
+static void *tile_thread(void *arg)
+{
+    TILE_WORK *work = arg;
+    int pairs = num_tiles * (num_tiles + 1) / 2;
+    int t;
+    while ((t = __atomic_fetch_add(&next_tile, 1, __ATOMIC_RELAXED)) < pairs)
+    {
+        int a = 0;
+        while (t >= num_tiles - a)
+        {
+            t -= num_tiles - a;
+            a++;
+        }
+        compute_tile(a, a + t, work);
+    }
+    return NULL;
+}
+
+/**
+ * @brief  Read aligned nucleotide or amino acid sequences in FASTA format
+ * and initialize data structures.
+ * @details  This function is used instead of read_distance_data() when
+ * the -i fasta or -i protein option is given, and sets the same global variables and
+ * data structures.  Each sequence starts with a line beginning with '>',
+ * the first word of which (up to INPUT_MAX characters) is the name of the
+ * taxon; the following lines, up to the next such line, hold the
+ * sequence, in which whitespace is ignored.  The sequences must all have
+ * the same length, as in an alignment.  The bases A, C, G and T (or U)
+ * are packed two bits per site, with gaps and ambiguity codes masked out,
+ * and the differences between two taxa are counted among the sites
+ * holding a base in both.  With -i protein, the 20 amino acids are
+ * packed five bits per site in the same way, with gaps, stops and
+ * ambiguous residues masked out.  The distance between them is the proportion of
+ * differing sites (the p-distance), or the distance under the model
+ * selected with -d, computed by model_distances().  The pairs are
+ * computed by tiles, which are spread over the worker threads given with
+ * -j, and the distances are stored straight into the distances matrix.
+ *
+ * @param in  The input stream from which to read the alignment.
+ * @return 0 in case the alignment was successfully read, otherwise -1
+ * if there was any error, after printing a one-line error message to
+ * stderr.
+ */
+int read_alignment_data(FILE *in) {
+    int current_character;
+    int at_line_start = 1;
+    int taxon = -1;
+    int protein = input_format == INPUT_PROTEIN;
+    num_taxa = 0;
+    num_sites = 0;
+    while ((current_character = fgetc(in)) != EOF)
+    {
+        if (current_character == '>' && at_line_start)
+        {
+            //a new sequence: its name is the first word of the line
+            if (num_taxa + 1 > MAX_TAXA)
+            {
+                fprintf(stderr, "Error: Number of taxa exceeds taxa max!\n");
+                return -1;
+            }
+            taxon = num_taxa++;
+            memset(*(high_bits + taxon), 0, sizeof(*high_bits));
+            memset(*(low_bits + taxon), 0, sizeof(*low_bits));
+            memset(*(valid_bits + taxon), 0, sizeof(*valid_bits));
+            for (int b = 0; b < RESIDUE_PLANES && input_format == INPUT_PROTEIN; b++)
+            {
+                memset(*(*(residue_bits + b) + taxon), 0, sizeof(**residue_bits));
+            }
+            *(sequence_lengths + taxon) = 0;
+            char *name = *(node_names + taxon);
+            int length = 0;
+            while ((current_character = fgetc(in)) != EOF && current_character != '\n'
+                   && current_character != ' ' && current_character != '\t' && current_character != '\r')
+            {
+                if (length == INPUT_MAX)
+                {
+                    fprintf(stderr, "Error: Input field character length exceeds input max!\n");
+                    return -1;
+                }
+                *(name + length++) = current_character;
+            }
+            *(name + length) = '\0';
+            if (length == 0)
+            {
+                fprintf(stderr, "Error: Missing sequence name!\n");
+                return -1;
+            }
+            while (current_character != EOF && current_character != '\n')
+            {
+                current_character = fgetc(in);
+            }
+            at_line_start = 1;
+            continue;
+        }
+        at_line_start = current_character == '\n';
+        if (current_character == '\n' || current_character == '\r' || current_character == ' ' || current_character == '\t')
+        {
+            continue;
+        }
+        if (taxon == -1)
+        {
+            fprintf(stderr, "Error: Sequence data before the first sequence name!\n");
+            return -1;
+        }
+        int code = protein ? residue_code(current_character) : base_code(current_character);
+        if (code == -1)
+        {
+            fprintf(stderr, "Error: Invalid character in sequence!\n");
+            return -1;
+        }
+        if (*(sequence_lengths + taxon) == (protein ? MAX_RESIDUES : MAX_SITES))
+        {
+            fprintf(stderr, "Error: Sequence length exceeds sites max!\n");
+            return -1;
+        }
+        if (protein)
+            append_residue(taxon, code);
+        else
+            append_site(taxon, code);
+    }
+    if (num_taxa == 0)
+    {
+        fprintf(stderr, "Error: No sequences in alignment!\n");
+        return -1;
+    }
+    num_sites = *(sequence_lengths + 0);
+    for (int i = 1; i < num_taxa; i++)
+    {
+        if (*(sequence_lengths + i) != num_sites)
+        {
+            fprintf(stderr, "Error: Sequences are not all of the same length!\n");
+            return -1;
+        }
+    }
+
+    //! Count the bases, for the models that depend on their frequencies
+    long base_counts[4] = { 0, 0, 0, 0 };
+    for (int i = 0; i < num_taxa; i++)
+    {
+        for (int w = 0; w < (num_sites + 63) / 64; w++)
+        {
+            uint64_t high = *(*(high_bits + i) + w), low = *(*(low_bits + i) + w), valid = *(*(valid_bits + i) + w);
+            *(base_counts + 0) += __builtin_popcountll(valid & ~high & ~low);
+            *(base_counts + 1) += __builtin_popcountll(valid & ~high & low);
+            *(base_counts + 2) += __builtin_popcountll(valid & high & ~low);
+            *(base_counts + 3) += __builtin_popcountll(valid & high & low);
+        }
+    }
+    if (model_init(base_counts) == -1)
+    {
+        return -1;
+    }
+
+    //! Fill in the distances matrix by tiles of pairs, spread over the worker threads,
+    //! unless the matrix-free engine computes them as it needs them
+    int saturated = 0;
+    if (row_cache_size == 0)
+    {
+        TILE_WORK work[MAX_NODES];
+        int threads = worker_threads();
+        if (threads > num_taxa)
+        {
+            threads = num_taxa;
+        }
+        tile_taxa = TILE_TAXA;
+        num_tiles = (num_taxa + tile_taxa - 1) / tile_taxa;
+        while (tile_taxa > 1 && num_tiles * (num_tiles + 1) / 2 < 4 * threads)
+        {
+            // smaller tiles, so that there are several for each thread
+            tile_taxa /= 2;
+            num_tiles = (num_taxa + tile_taxa - 1) / tile_taxa;
+        }
+        if (threads > num_tiles * (num_tiles + 1) / 2)
+        {
+            threads = num_tiles * (num_tiles + 1) / 2;
+        }
+        next_tile = 0;
+        for (int t = 0; t < threads; t++)
+        {
+            (work + t)->saturated = 0;
+            (work + t)->incomparable = 0;
+        }
+        run_parallel(tile_thread, work, sizeof(TILE_WORK), threads);
+        for (int t = 0; t < threads; t++)
+        {
+            if ((work + t)->incomparable)
+            {
+                fprintf(stderr, "Error: Sequences have no sites to compare!\n");
+                return -1;
+            }
+            saturated += (work + t)->saturated;
+        }
+    }
+    for (int i = 0; i < num_taxa; i++)
+    {
+        (nodes + i)->name = *(node_names + i);
+        *(active_node_map + i) = i;
+        *(*(distances + i) + i) = 0.0;
+    }
+    if (saturated > 0)
+    {
+        fprintf(stderr, "Pairs too different for the model, given distance %g: %d\n", SATURATED_DISTANCE, saturated);
+    }
+    num_all_nodes = num_taxa;
+    num_active_nodes = num_taxa;
+    if (global_options & COLLAPSE_OPTION)
+    {
+        collapse_duplicates();
+    }
+    return 0;
+}
@@ -0,0 +1,293 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "global.h"
+#include "debug.h"
+
+/*
+ * Matrix-free engine: the distances between taxa are never stored as a
+ * matrix, but computed a row at a time from the aligned sequences when
+ * they are needed, and a cache of the most recently used rows, of the
+ * size given with -F, saves computing them again.  Only the rows of the
+ * internal nodes, which the joins create, are stored in the distances
+ * matrix, so a distance between a taxon and an internal node is read from
+ * the row of the internal node.
+ */
+
+/* Rows of distances between one taxon and all of the taxa, held in the cache. */
+static double cached_rows[MAX_TAXA][MAX_TAXA];
+
+/*
+ * The taxon of the row held in each slot of the cache, or -1, the slot
+ * holding the row of each taxon, or -1, and the time each slot was last
+ * used, on a clock that advances at every use.
+ */
+static int slot_taxa[MAX_TAXA];
+static int taxon_slots[MAX_TAXA];
+static long slot_uses[MAX_TAXA];
+static long use_clock;
+
+/* A row of distances from one active node to all of the active nodes. */
+static double scratch_rows[2][MAX_NODES];
+
+/*
+ * Returns the row of distances from taxon i to all of the taxa, from the
+ * cache if it is there, and otherwise computed from the sequences into
+ * the least recently used slot of the cache.  Returns NULL if two of the
+ * sequences have no sites to compare.
+ */
+static double *taxon_row(int i)
+{
+    int slot = *(taxon_slots + i);
+    if (slot == -1)
+    {
+        SITE_COUNTS counts[MAX_TAXA];
+        slot = 0;
+        for (int s = 1; s < row_cache_size; s++)
+        {
+            if (*(slot_uses + s) < *(slot_uses + slot))
+            {
+                slot = s;
+            }
+        }
+        if (*(slot_taxa + slot) != -1)
+        {
+            *(taxon_slots + *(slot_taxa + slot)) = -1;
+        }
+        for (int j = 0; j < num_taxa; j++)
+        {
+            count_differences(i, j, counts + j);
+            if ((counts + j)->compared == 0)
+            {
+                fprintf(stderr, "Error: Sequences have no sites to compare!\n");
+                *(slot_taxa + slot) = -1;
+                return NULL;
+            }
+        }
+        model_distances(counts, *(cached_rows + slot), num_taxa);
+        *(slot_taxa + slot) = i;
+        *(taxon_slots + i) = slot;
+    }
+    *(slot_uses + slot) = ++use_clock;
+    return *(cached_rows + slot);
+}
+
+/*
+ * Fills row with the distances from active node i to all of the active
+ * nodes, indexed by node.  Returns -1 if the row of a taxon cannot be
+ * computed.
+ */
+static int active_row(int i, double *row)
+{
+    if (i >= num_taxa)
+    {
+        memcpy(row, *(distances + i), num_all_nodes * sizeof(double));
+        return 0;
+    }
+    double *taxon = taxon_row(i);
+    if (taxon == NULL)
+    {
+        return -1;
+    }
+    for (int k = 0; k < num_active_nodes; k++)
+    {
+        int k_index = *(active_node_map + k);
+        *(row + k_index) = k_index < num_taxa ? *(taxon + k_index) : *(*(distances + k_index) + i);
+    }
+    return 0;
+}
+
+/*
+ * Sets order to the active slots, those of the nodes whose rows are at
+ * hand (internal nodes and cached taxa) first, in decreasing order of
+ * last use, so that a pass over the rows uses the cache before it evicts
+ * from it.
+ */
+static void row_order(int *order)
+{
+    int n = 0;
+    for (int k = 0; k < num_active_nodes; k++)
+    {
+        int k_index = *(active_node_map + k);
+        if (k_index >= num_taxa || *(taxon_slots + k_index) != -1)
+        {
+            *(order + n++) = k;
+        }
+    }
+    // most recently used first, by insertion, as the cache is small
+    for (int a = 1; a < n; a++)
+    {
+        int k = *(order + a);
+        int k_index = *(active_node_map + k);
+        long use = k_index >= num_taxa ? use_clock + 1 : *(slot_uses + *(taxon_slots + k_index));
+        int b = a;
+        while (b > 0)
+        {
+            int o_index = *(active_node_map + *(order + b - 1));
+            long o_use = o_index >= num_taxa ? use_clock + 1 : *(slot_uses + *(taxon_slots + o_index));
+            if (o_use >= use)
+            {
+                break;
+            }
+            *(order + b) = *(order + b - 1);
+            b--;
+        }
+        *(order + b) = k;
+    }
+    for (int k = 0; k < num_active_nodes; k++)
+    {
+        int k_index = *(active_node_map + k);
+        if (k_index < num_taxa && *(taxon_slots + k_index) == -1)
+        {
+            *(order + n++) = k;
+        }
+    }
+}
+
+/**
+ * @brief  Initialize the matrix-free engine.
+ * @details  The cache is emptied.  The distances between the taxa must
+ * not have been stored in the distances matrix by read_alignment_data(),
+ * which is the case when the engine was selected with -e nj-lazy.
+ *
+ * @return 0 if successful.
+ */
+int nj_lazy_init(void) {
+    for (int s = 0; s < row_cache_size; s++)
+    {
+        *(slot_taxa + s) = -1;
+        *(slot_uses + s) = 0;
+    }
+    for (int i = 0; i < num_taxa; i++)
+    {
+        *(taxon_slots + i) = -1;
+    }
+    use_clock = 0;
+    return 0;
+}
+
+/**
+ * @brief  Perform one step of the matrix-free engine.
+ * @details  This is the reference neighbor joining step, with each row of
+ * distances obtained as it is needed: the row sums are computed, all
+ * pairs are scanned for the minimal Q value, and the pair is joined, by
+ * the same arithmetic as nj_join(), so that the tree is that of the
+ * reference engine.  The row of the new node is stored in the distances
+ * matrix, along with its column for the other internal nodes.  Each step
+ * goes over the rows twice, for the row sums and for the scan, visiting
+ * the rows at hand first; with a cache smaller than the number of active
+ * taxa, the rest of the rows are computed again at each pass.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+int nj_lazy_step(void) {
+    int order[MAX_NODES];
+    double *row = *(scratch_rows + 0);
+    int m = num_active_nodes;
+
+    //! Row sums, as compute_row_sums() computes them
+    row_order(order);
+    for (int k = 0; k < m; k++)
+    {
+        int i_index = *(active_node_map + *(order + k));
+        if (active_row(i_index, row) == -1)
+        {
+            return -1;
+        }
+        *(row_sums + i_index) = active_sum(row);
+    }
+
+    //! Scan of the pairs, as nj_best_pair() scans them, rows at hand first
+    double best_q = 0.0;
+    int f = -1, g = -1;
+    row_order(order);
+    for (int k = 0; k < m; k++)
+    {
+        int i = *(order + k);
+        int i_index = *(active_node_map + i);
+        if (active_row(i_index, row) == -1)
+        {
+            return -1;
+        }
+        double s_i = *(row_sums + i_index);
+        for (int j = i + 1; j < m; j++)
+        {
+            int j_index = *(active_node_map + j);
+            double q = (m - 2) * *(row + j_index) - s_i - *(row_sums + j_index);
+            if (f == -1 || BETTER_PAIR(q, i_index, j_index, best_q, f, g))
+            {
+                best_q = q;
+                f = i_index;
+                g = j_index;
+            }
+        }
+    }
+
+    //! The join, as nj_join() makes it
+    double *f_row = *(scratch_rows + 0);
+    double *g_row = *(scratch_rows + 1);
+    if (active_row(f, f_row) == -1 || active_row(g, g_row) == -1)
+    {
+        return -1;
+    }
+    int u = new_node();
+    if (u == -1)
+    {
+        return -1;
+    }
+    double f_g = *(f_row + g);
+    double f_branch = ((f_g/2) + (*(row_sums + f) - *(row_sums + g)) / (2 * (num_active_nodes - 2)));
+    double g_branch = f_g - f_branch;
+    for (int k = 0; k < num_active_nodes; k++)
+    {
+        int k_index = *(active_node_map + k);
+        double value;
+        if (k_index == f)
+            value = f_branch;
+        else if (k_index == g)
+            value = g_branch;
+        else
+            value = (*(f_row + k_index) + *(g_row + k_index) - f_g) / 2.0;
+        *(*(distances + u) + k_index) = value;
+        if (k_index >= num_taxa)
+        {
+            *(*(distances + k_index) + u) = value;
+        }
+    }
+    join_nodes(f, g, u, f_branch, g_branch);
+    return 0;
+}
+
+/**
+ * @brief  The distance between two nodes, for the matrix-free engine.
+ * @details  This is what reading distances[i][j] is for the other
+ * engines: the distance between two taxa comes from the row cache, and
+ * computed from the sequences if it is not there, and any other distance
+ * from the row of the internal node.
+ *
+ * @param i  Index of the first node.
+ * @param j  Index of the second node.
+ * @return the distance between them.
+ */
+double nj_lazy_distance(int i, int j) {
+    if (j >= num_taxa)
+    {
+        return *(*(distances + j) + i);
+    }
+    if (i >= num_taxa)
+    {
+        return *(*(distances + i) + j);
+    }
+    double *row = taxon_row(i);
+    return row == NULL ? 0.0 : *(row + j);
+}
+
+/**
+ * @brief  Length of the final edge of a tree built by the matrix-free engine.
+ * @param a  Index of one of the last two active nodes.
+ * @param b  Index of the other.
+ * @return the distance between them.
+ */
+double nj_lazy_last_edge(int a, int b) {
+    return nj_lazy_distance(a, b);
+}
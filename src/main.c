@@ -4,50 +4,115 @@
 #include "global.h"
 #include "debug.h"
 
+/*
+ * Opens the file named by an output option for writing, or returns NULL
+ * if the option was not given.  Sets *error if the file cannot be opened.
+ */
+static FILE *open_output(char *filename, int *error)
+{
+    if (filename == NULL)
+    {
+        return NULL;
+    }
+    FILE *file = fopen(filename, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Error: Cannot open output file '%s'!\n", filename);
+        *error = 1;
+    }
+    return file;
+}
+
 int main(int argc, char **argv)
 {
     if(validargs(argc, argv))
         USAGE(*argv, EXIT_FAILURE);
     if(global_options == HELP_OPTION)
         USAGE(*argv, EXIT_SUCCESS);
-    //*read distance data
+    //*read distance data, or compute it from an alignment, genomes or genotypes
     int result;
-    result = read_distance_data(stdin);
+    if (input_format == INPUT_FASTA || input_format == INPUT_PROTEIN)
+        result = read_alignment_data(stdin);
+    else if (input_format == INPUT_GENOMES)
+        result = read_genome_data(stdin);
+    else if (input_format == INPUT_VCF)
+        result = read_genotype_data(stdin);
+    else
+        result = read_distance_data(stdin);
     if (result == -1)
     {
         return EXIT_FAILURE;
     }
-    if (global_options == MATRIX_OPTION)
+    //*check the engine contract instead of producing output
+    if (global_options & VERIFY_OPTION)
+    {
+        return verify_engines(stdout) == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    //*open output files, if any
+    int error = 0;
+    FILE *edges_file = open_output(edges_filename, &error);
+    FILE *newick_file = open_output(newick_filename, &error);
+    FILE *matrix_file = open_output(matrix_filename, &error);
+    FILE *query_file = NULL;
+    if (query_filename != NULL && (query_file = fopen(query_filename, "r")) == NULL)
+    {
+        fprintf(stderr, "Error: Cannot open query file '%s'!\n", query_filename);
+        error = 1;
+    }
+    if (error)
+    {
+        return EXIT_FAILURE;
+    }
+    //*standard output gets the matrix (-m), the Newick tree (-n), the query answers (-q),
+    //*the patristic matrix (-p) or else the edge data
+    FILE *edges_out = edges_file;
+    FILE *newick_out = newick_file;
+    FILE *matrix_out = matrix_file;
+    FILE *patristic_out = NULL;
+    if (global_options & MATRIX_OPTION)
+    {
+        matrix_out = stdout;
+    }
+    else if (global_options & NEWICK_OPTION)
+    {
+        newick_out = stdout;
+    }
+    else if (global_options & PATRISTIC_OPTION)
+    {
+        patristic_out = stdout;
+    }
+    //*build the tree once, streaming the edge data if that is the only output
+    if (newick_out == NULL && matrix_out == NULL && edges_out == NULL && patristic_out == NULL && query_file == NULL)
     {
-        //*matrix option
         result = build_taxonomy(stdout);
-        if (result == -1)
+    }
+    else
+    {
+        if (edges_out == NULL && !(global_options & (MATRIX_OPTION | NEWICK_OPTION | QUERY_OPTION | PATRISTIC_OPTION)))
         {
-            return EXIT_FAILURE;
+            edges_out = stdout;
         }
-        emit_distance_matrix(stdout);
-        if (result == -1)
+        result = build_taxonomy(NULL);
+        if (result != -1)
         {
-            return EXIT_FAILURE;
+            result = emit_outputs(edges_out, newick_out, matrix_out, patristic_out);
         }
-    }
-    else if (global_options == NEWICK_OPTION)
-    {
-        //*newick option
-        result = emit_newick_format(stdout);
-        if (result == -1)
+        if (result != -1 && query_file != NULL)
         {
-            return EXIT_FAILURE;
+            result = emit_patristic_queries(query_file, stdout);
         }
     }
-    else 
+    if (query_file != NULL)
+        fclose(query_file);
+    if (edges_file != NULL && fclose(edges_file) == EOF)
+        result = -1;
+    if (newick_file != NULL && fclose(newick_file) == EOF)
+        result = -1;
+    if (matrix_file != NULL && fclose(matrix_file) == EOF)
+        result = -1;
+    if (result == -1)
     {
-        //*base option
-        result = build_taxonomy(stdout);
-        if (result == -1)
-        {
-            return EXIT_FAILURE;
-        }
+        return EXIT_FAILURE;
     }
     return EXIT_SUCCESS; 
 }
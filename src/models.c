@@ -0,0 +1,239 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "global.h"
+#include "debug.h"
+
+/*
+ * Each model is evaluated as
+ *
+ *    d = c_1 ln(a_1) + ... + c_k ln(a_k),   a_t = 1 - w_t1 P1 - w_t2 P2 - w_t3 Q - v_t P^2
+ *
+ * where P1, P2 and Q are the proportions of purine transitions (A-G),
+ * pyrimidine transitions (C-T) and transversions among the sites
+ * compared, P = P1 + P2 + Q, and the coefficients c and weights w and v
+ * depend only on the model and the base frequencies of the alignment.
+ * The p-distance has no terms, and is P.  Amino acids have no
+ * transitions, so in a protein alignment every difference counts in Q.
+ */
+#define MAX_TERMS 3
+static int num_terms;
+static double coefficients[MAX_TERMS];
+static double weights[MAX_TERMS][3];
+static double square_weights[MAX_TERMS];
+
+/*
+ * Pairs of doubles processed together by the logarithm.  As in the
+ * single-linkage engine, GCC lowers these to SSE2 or NEON instructions
+ * where available, and to scalar code elsewhere.
+ */
+typedef double v2df __attribute__((vector_size(16)));
+typedef long long v2di __attribute__((vector_size(16)));
+
+/*
+ * Returns the natural logarithms of two positive normal numbers.  Each
+ * is split as 2^e m, with m in [sqrt(1/2), sqrt(2)), by integer operations
+ * on its bits, and ln(m) = 2 atanh(s), s = (m - 1) / (m + 1), is summed
+ * from its series, which with |s| < 0.172 reaches double precision by the
+ * term in s^21.  There are no branches, so both lanes are done at once.
+ */
+static v2df log_v2df(v2df x)
+{
+    const v2df sqrt2 = { 1.4142135623730951, 1.4142135623730951 };
+    const v2df ln2_high = { 6.93147180369123816490e-01, 6.93147180369123816490e-01 };
+    const v2df ln2_low = { 1.90821492927058770002e-10, 1.90821492927058770002e-10 };
+    v2di bits;
+    memcpy(&bits, &x, sizeof(bits));
+    v2di exponent = ((bits >> 52) & 0x7ff) - 1023;
+    v2di mantissa_bits = (bits & 0x000fffffffffffffLL) | 0x3ff0000000000000LL;
+    v2df m;
+    memcpy(&m, &mantissa_bits, sizeof(m));
+    v2di large = m >= sqrt2;
+    v2df halved = m * 0.5;
+    v2di m_bits, halved_bits;
+    memcpy(&m_bits, &m, sizeof(m_bits));
+    memcpy(&halved_bits, &halved, sizeof(halved_bits));
+    m_bits = (halved_bits & large) | (m_bits & ~large);
+    memcpy(&m, &m_bits, sizeof(m));
+    exponent -= large;
+    v2df e = __builtin_convertvector(exponent, v2df);
+    v2df s = (m - 1.0) / (m + 1.0);
+    v2df z = s * s;
+    v2df series = { 1.0 / 21, 1.0 / 21 };
+    series = series * z + 1.0 / 19;
+    series = series * z + 1.0 / 17;
+    series = series * z + 1.0 / 15;
+    series = series * z + 1.0 / 13;
+    series = series * z + 1.0 / 11;
+    series = series * z + 1.0 / 9;
+    series = series * z + 1.0 / 7;
+    series = series * z + 1.0 / 5;
+    series = series * z + 1.0 / 3;
+    v2df log_m = 2.0 * s + 2.0 * s * z * series;
+    return e * ln2_high + (log_m + e * ln2_low);
+}
+
+/*
+ * Replaces the n values of an array by their natural logarithms, two at a
+ * time.
+ */
+static void log_array(double *values, int n)
+{
+    int k = 0;
+    for (; k + 2 <= n; k += 2)
+    {
+        v2df x;
+        memcpy(&x, values + k, sizeof(x));
+        x = log_v2df(x);
+        memcpy(values + k, &x, sizeof(x));
+    }
+    if (k < n)
+    {
+        v2df x = { *(values + k), 1.0 };
+        x = log_v2df(x);
+        *(values + k) = x[0];
+    }
+}
+
+/*
+ * Sets term t of the model.
+ */
+static void set_term(int t, double coefficient, double purine_weight, double pyrimidine_weight, double transversion_weight,
+                     double square_weight)
+{
+    *(coefficients + t) = coefficient;
+    *(square_weights + t) = square_weight;
+    *(*(weights + t) + 0) = purine_weight;
+    *(*(weights + t) + 1) = pyrimidine_weight;
+    *(*(weights + t) + 2) = transversion_weight;
+}
+
+/**
+ * @brief  Prepare the evolutionary model selected with -d.
+ * @details  The Tamura-Nei model depends on the base frequencies of the
+ * alignment; the other models, including the Poisson and Kimura models
+ * of protein alignments, do not.
+ *
+ * @param base_counts  The number of occurrences of A, C, G and T in the
+ * alignment.
+ * @return 0 if successful, otherwise -1 if the model cannot be applied
+ * to the alignment.
+ */
+int model_init(long *base_counts) {
+    num_terms = 0;
+    if (distance_model == MODEL_JC69)
+    {
+        set_term(0, -0.75, 4.0 / 3, 4.0 / 3, 4.0 / 3, 0.0);
+        num_terms = 1;
+    }
+    else if (distance_model == MODEL_K2P)
+    {
+        set_term(0, -0.5, 2.0, 2.0, 1.0, 0.0);
+        set_term(1, -0.25, 0.0, 0.0, 2.0, 0.0);
+        num_terms = 2;
+    }
+    else if (distance_model == MODEL_TN93)
+    {
+        double total = *(base_counts + 0) + *(base_counts + 1) + *(base_counts + 2) + *(base_counts + 3);
+        double a = *(base_counts + 0) / total, c = *(base_counts + 1) / total;
+        double g = *(base_counts + 2) / total, t = *(base_counts + 3) / total;
+        double r = a + g, y = c + t;
+        if (a * g == 0.0 || c * t == 0.0)
+        {
+            fprintf(stderr, "Error: Base frequencies do not allow the TN93 model!\n");
+            return -1;
+        }
+        set_term(0, -2 * a * g / r, r / (2 * a * g), 0.0, 1 / (2 * r), 0.0);
+        set_term(1, -2 * c * t / y, 0.0, y / (2 * c * t), 1 / (2 * y), 0.0);
+        set_term(2, -2 * (r * y - a * g * y / r - c * t * r / y), 0.0, 0.0, 1 / (2 * r * y), 0.0);
+        num_terms = 3;
+    }
+    else if (distance_model == MODEL_POISSON)
+    {
+        set_term(0, -1.0, 1.0, 1.0, 1.0, 0.0);
+        num_terms = 1;
+    }
+    else if (distance_model == MODEL_KIMURA)
+    {
+        // Kimura's approximation of the Dayhoff PAM distance
+        set_term(0, -1.0, 1.0, 1.0, 1.0, 0.2);
+        num_terms = 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief  Compute distances under the evolutionary model selected with -d.
+ * @details  The arguments of the logarithms are computed for all of the
+ * pairs first, so that the logarithms are taken over contiguous arrays,
+ * two at a time.  A pair whose differences are too many for the model
+ * (a logarithm of a non-positive number) is saturated, and is given the
+ * distance SATURATED_DISTANCE.  Pairs can be computed by several
+ * threads at once.
+ *
+ * @param counts  The site counts of the pairs.
+ * @param values  Set to the distances of the pairs.
+ * @param n  The number of pairs, at most MAX_TAXA.
+ * @return the number of saturated pairs.
+ */
+int model_distances(SITE_COUNTS *counts, double *values, int n) {
+    double arguments[MAX_TERMS][MAX_TAXA];
+    int saturated = 0;
+    for (int k = 0; k < n; k++)
+    {
+        double compared = (counts + k)->compared;
+        double p1 = (counts + k)->purine_transitions / compared;
+        double p2 = (counts + k)->pyrimidine_transitions / compared;
+        double q = (counts + k)->transversions / compared;
+        double p = p1 + p2 + q;
+        *(values + k) = p;
+        for (int t = 0; t < num_terms; t++)
+        {
+            double *w = *(weights + t);
+            *(*(arguments + t) + k) = 1.0 - *(w + 0) * p1 - *(w + 1) * p2 - *(w + 2) * q - *(square_weights + t) * p * p;
+        }
+    }
+    if (num_terms == 0)
+    {
+        return 0;
+    }
+    for (int k = 0; k < n; k++)
+    {
+        // saturated pairs take the logarithm of 1, and are set afterwards
+        for (int t = 0; t < num_terms; t++)
+        {
+            if (!(*(*(arguments + t) + k) > 0.0))
+            {
+                *(values + k) = -1.0;
+            }
+        }
+        if (*(values + k) == -1.0)
+        {
+            for (int t = 0; t < num_terms; t++)
+            {
+                *(*(arguments + t) + k) = 1.0;
+            }
+        }
+    }
+    for (int t = 0; t < num_terms; t++)
+    {
+        log_array(*(arguments + t), n);
+    }
+    for (int k = 0; k < n; k++)
+    {
+        if (*(values + k) == -1.0)
+        {
+            *(values + k) = SATURATED_DISTANCE;
+            saturated++;
+            continue;
+        }
+        double d = 0.0;
+        for (int t = 0; t < num_terms; t++)
+        {
+            d += *(coefficients + t) * *(*(arguments + t) + k);
+        }
+        // identical sequences give -0.0
+        *(values + k) = d == 0.0 ? 0.0 : d;
+    }
+    return saturated;
+}
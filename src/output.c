@@ -0,0 +1,95 @@
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "global.h"
+#include "debug.h"
+
+/*
+ * One output to be formatted: the function that formats it, the stream
+ * to which it is written and the result returned by the function.
+ */
+typedef struct output_job {
+    int (*emit)(FILE *out);
+    FILE *out;
+    int result;
+} OUTPUT_JOB;
+
+/*
+ * Thread start routine that formats a single output.
+ */
+static void *output_thread(void *arg)
+{
+    OUTPUT_JOB *job = arg;
+    job->result = job->emit(job->out);
+    if (fflush(job->out) == EOF)
+    {
+        job->result = -1;
+    }
+    return NULL;
+}
+
+/**
+ * @brief  Emit any combination of the outputs of the synthesized tree.
+ * @details  This function assumes that a tree has been built by a prior
+ * successful invocation of build_taxonomy().  Each of the edge data,
+ * the Newick representation, the distance matrix and the patristic
+ * distance matrix whose stream is non-NULL is formatted and written on
+ * a thread of its own, so that the formatting of the different outputs
+ * is overlapped.  The outputs
+ * only read the data structures left by build_taxonomy(), so they can
+ * safely run concurrently; the streams must be distinct.
+ *
+ * @param edges_out  If non-NULL, stream to which to output the edge data.
+ * @param newick_out  If non-NULL, stream to which to output the tree in
+ * Newick format.
+ * @param matrix_out  If non-NULL, stream to which to output the matrix
+ * of estimated distances.
+ * @param patristic_out  If non-NULL, stream to which to output the matrix
+ * of patristic distances.
+ * @return 0 in case all the outputs are successfully emitted, otherwise -1
+ * if any error occurred.
+ */
+int emit_outputs(FILE *edges_out, FILE *newick_out, FILE *matrix_out, FILE *patristic_out) {
+    OUTPUT_JOB jobs[4] = {
+        { emit_edge_data, edges_out, 0 },
+        { emit_newick_format, newick_out, 0 },
+        { emit_distance_matrix, matrix_out, 0 },
+        { emit_patristic_matrix, patristic_out, 0 }
+    };
+    pthread_t threads[4];
+    int started[4] = { 0, 0, 0, 0 };
+    int result = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        if ((jobs + i)->out == NULL)
+        {
+            continue;
+        }
+        if (pthread_create(threads + i, NULL, output_thread, jobs + i) == 0)
+        {
+            *(started + i) = 1;
+        }
+        else
+        {
+            // fall back to formatting this output on the calling thread
+            output_thread(jobs + i);
+        }
+    }
+    for (int i = 0; i < 4; i++)
+    {
+        if (*(started + i))
+        {
+            pthread_join(*(threads + i), NULL);
+        }
+        if ((jobs + i)->out != NULL && (jobs + i)->result == -1)
+        {
+            // errors other than failed writes have already been reported
+            if (ferror((jobs + i)->out))
+            {
+                fprintf(stderr, "Error: Failed to write output!\n");
+            }
+            result = -1;
+        }
+    }
+    return result;
+}
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "global.h"
 #include "debug.h"
@@ -44,6 +45,10 @@
  *   active_node_map - initialized to the identity mapping on [0..N);
  *     that is, active_node_map[i] == i for 0 <= i < N.
  *
+ * If the -u option was given, taxa whose rows duplicate those of others
+ * are then removed from the active nodes by collapse_duplicates(), which
+ * reduces num_active_nodes accordingly.
+ *
  * @param in  The input stream from which to read the data.
  * @return 0 in case the data was successfully read, otherwise -1
  * if there was any error.  Premature termination of the input data,
@@ -77,7 +82,7 @@ int read_distance_data(FILE *in) {
     //end pointer for determining if the buffer string contains a valid double
     char *end_pointer;
     //value in double form of the current matrix input
-    double value;
+    double value = 0.0;
     //counts number of decimals in input field
     int dot_count = 0;
 
@@ -395,11 +400,77 @@ int read_distance_data(FILE *in) {
             }
         }
     }
+    if (global_options & COLLAPSE_OPTION)
+    {
+        collapse_duplicates();
+    }
     return 0;
     abort();
 }
 
 
+/**
+ * @brief  Restore the state left by read_distance_data().
+ * @details  Discards any tree built by a previous invocation of
+ * build_taxonomy(), including the internal nodes and their rows and
+ * columns of the distances matrix, so that another tree can be built
+ * from the same distance data.
+ */
+void reset_taxonomy(void) {
+    for (int i = 0; i < num_all_nodes; i++)
+    {
+        for (int j = num_taxa; j < num_all_nodes; j++)
+        {
+            *(*(distances + i) + j) = 0.0;
+            *(*(distances + j) + i) = 0.0;
+        }
+    }
+    for (int i = 0; i < num_taxa; i++)
+    {
+        *(active_node_map + i) = i;
+    }
+    num_all_nodes = num_taxa;
+    num_active_nodes = num_taxa;
+    num_edges = 0;
+}
+
+/*
+ * Emits in Newick format the subtree rooted at position p of the compact
+ * tree, regarding position parent as the parent of p in the rooted tree.
+ * The length of the edge to the parent, held at the slot of the parent
+ * among the neighbors of p, is omitted for the root, whose parent is the
+ * excluded outlier.
+ */
+static void emit_newick_subtree(FILE *out, int p, int parent, int is_root)
+{
+    int first_child = 1;
+    double branch = 0.0;
+    for (int k = 0; k < 3; k++)
+    {
+        int neighbor = *(*(tree_neighbors + p) + k);
+        if (neighbor == parent)
+        {
+            branch = *(*(tree_branches + p) + k);
+        }
+        if (neighbor == -1 || neighbor == parent)
+        {
+            continue;
+        }
+        fprintf(out, first_child ? "(" : ",");
+        first_child = 0;
+        emit_newick_subtree(out, neighbor, p, 0);
+    }
+    if (!first_child)
+    {
+        fprintf(out, ")");
+    }
+    fprintf(out, "%s", tree_names + *(tree_name_offsets + p));
+    if (!is_root)
+    {
+        fprintf(out, ":%.2lf", branch);
+    }
+}
+
 /**
  * @brief  Emit a representation of the phylogenetic tree in Newick
  * format to a specified output stream.
@@ -433,11 +504,125 @@ int read_distance_data(FILE *in) {
  * in the tree.
  */
 int emit_newick_format(FILE *out) {
-    // TO BE IMPLEMENTED
-    return 0;
+    if (num_taxa < 1)
+    {
+        fprintf(stderr, "Error: No taxa to output!\n");
+        return -1;
+    }
+    int outlier = -1;
+    if (outlier_name != NULL)
+    {
+        for (int i = 0; i < num_taxa; i++)
+        {
+            if (strcmp(*(node_names + i), outlier_name) == 0)
+            {
+                outlier = i;
+                break;
+            }
+        }
+        if (outlier == -1)
+        {
+            fprintf(stderr, "Error: Outlier node does not exist!\n");
+            return -1;
+        }
+    }
+    else
+    {
+        //the leaf with the greatest total distance to the other leaves
+        double largest_sum = 0.0;
+        for (int i = 0; i < num_taxa; i++)
+        {
+            double sum = 0.0;
+            for (int j = 0; j < num_taxa; j++)
+            {
+                // without the matrix, the distances come from the sequences
+                sum += row_cache_size > 0 ? nj_lazy_distance(i, j) : *(*(distances + i) + j);
+            }
+            if (outlier == -1 || sum > largest_sum)
+            {
+                largest_sum = sum;
+                outlier = i;
+            }
+        }
+    }
+    NODE *root = *((nodes + outlier)->neighbors + 0);
+    if (root == NULL)
+    {
+        //degenerate tree consisting of the outlier alone
+        fprintf(out, ";\n");
+    }
+    else
+    {
+        emit_newick_subtree(out, *(tree_positions + (root - nodes)), *(tree_positions + outlier), 1);
+        fprintf(out, ";\n");
+    }
+    return ferror(out) ? -1 : 0;
     abort();
 }
 
+/*
+ * Resolves a comma-separated list of node names into node indices, stored
+ * in the indices array, and returns their number, or -1 if a name is not
+ * the name of any node.  A NULL list selects all nodes.  The names @leaves
+ * and @internal select all leaf nodes and all internal nodes, respectively.
+ */
+static int select_nodes(char *names, int *indices)
+{
+    int count = 0;
+    if (names == NULL)
+    {
+        for (int i = 0; i < num_all_nodes; i++)
+        {
+            *(indices + count++) = i;
+        }
+        return count;
+    }
+    char *name = names;
+    while (1)
+    {
+        size_t length = strcspn(name, ",");
+        int from = -1;
+        int to = -1;
+        if (length == 7 && strncmp(name, "@leaves", length) == 0)
+        {
+            from = 0;
+            to = num_taxa;
+        }
+        else if (length == 9 && strncmp(name, "@internal", length) == 0)
+        {
+            from = num_taxa;
+            to = num_all_nodes;
+        }
+        else
+        {
+            for (int i = 0; i < num_all_nodes; i++)
+            {
+                if (strncmp(*(node_names + i), name, length) == 0 && *(*(node_names + i) + length) == '\0')
+                {
+                    from = i;
+                    to = i + 1;
+                    break;
+                }
+            }
+            if (from == -1)
+            {
+                fprintf(stderr, "Error: Unknown node name in matrix row or column list!\n");
+                return -1;
+            }
+        }
+        for (int i = from; i < to && count < MAX_NODES; i++)
+        {
+            *(indices + count++) = i;
+        }
+        if (*(name + length) == '\0')
+        {
+            break;
+        }
+        name += length + 1;
+    }
+    return count;
+}
+
 /**
  * @brief  Emit the synthesized distance matrix as CSV.
  * @details  This function emits to a specified output stream a representation
@@ -448,7 +633,19 @@ int emit_newick_format(FILE *out) {
  * The submatrix that consists of the first num_leaves rows and columns
  * is identical to the matrix given as input.  The remaining rows and columns
  * contain estimated distances to internal nodes that were synthesized during
- * the execution of the algorithm.
+ * the execution of the algorithm.  If a compression level has been
+ * selected with -z, the output is compressed in gzip format as it is
+ * formatted, on a background thread.
+ *
+ * Part of the matrix can be selected instead, and only the selected cells
+ * are generated.  With -r and -c, only the rows and columns for the given
+ * node names are output, in the order given.  With -t, only the cells
+ * above the main diagonal (those whose column node has a larger index than
+ * the row node) are output; in CSV the other cells are left empty, so
+ * that every cell stays under its column.  With -s, instead of CSV the
+ * selected cells whose distance does not exceed the cutoff are output one
+ * per line as "i,j,d", where i and j are node indices, in the format
+ * of the edge data.
  *
  * @param out  Stream to which to output a CSV representation of the
  * synthesized distance matrix.
@@ -456,44 +653,97 @@ int emit_newick_format(FILE *out) {
  * if any error occurred.
  */
 int emit_distance_matrix(FILE *out) {
-    fprintf(stdout, ",");
-    for (int i = 0; i < num_all_nodes; i++)
+    int rows[MAX_NODES];
+    int columns[MAX_NODES];
+    int num_rows = select_nodes(matrix_rows, rows);
+    int num_columns = select_nodes(matrix_columns, columns);
+    if (num_rows == -1 || num_columns == -1)
     {
-        int node_name_counter = 0;
-        while (*(*(node_names + i) + node_name_counter) != '\0')
-        {
-            fprintf(stdout, "%c", *(*(node_names + i) + node_name_counter));
-            node_name_counter++;
-        }
-        if (i < num_all_nodes - 1)
+        return -1;
+    }
+    int triangle = (global_options & TRIANGLE_OPTION) != 0;
+    WRITER *writer = writer_open(out, compression_level);
+    if (writer == NULL)
+    {
+        return -1;
+    }
+    if (global_options & SPARSE_OPTION)
+    {
+        //sparse triplets, formatting only the cells within the cutoff
+        for (int r = 0; r < num_rows; r++)
         {
-            fprintf(stdout, ",");
+            int i = *(rows + r);
+            double *row = *(distances + i);
+            for (int c = 0; c < num_columns; c++)
+            {
+                int j = *(columns + c);
+                if ((triangle && j <= i) || *(row + j) > matrix_cutoff)
+                {
+                    continue;
+                }
+                writer_printf(writer, "%d,%d,%.2lf\n", i, j, *(row + j));
+            }
         }
+        return writer_close(writer);
     }
-    fprintf(stdout, "\n");
-    for (int i = 0; i < num_all_nodes; i++)
+    writer_write(writer, ",", 1);
+    for (int c = 0; c < num_columns; c++)
     {
-        int node_name_counter = 0;
-        while (*(*(node_names + i) + node_name_counter) != '\0')
+        int j = *(columns + c);
+        writer_write(writer, *(node_names + j), strlen(*(node_names + j)));
+        if (c < num_columns - 1)
         {
-            fprintf(stdout, "%c", *(*(node_names + i) + node_name_counter));
-            node_name_counter++;
+            writer_write(writer, ",", 1);
         }
-        fprintf(stdout, ",");
-        for (int j = 0; j < num_all_nodes; j++)
+    }
+    writer_write(writer, "\n", 1);
+    for (int r = 0; r < num_rows; r++)
+    {
+        int i = *(rows + r);
+        double *row = *(distances + i);
+        writer_write(writer, *(node_names + i), strlen(*(node_names + i)));
+        for (int c = 0; c < num_columns; c++)
         {
-            fprintf(stdout,"%.2lf", *(*(distances + i) + j));
-            if (j < num_all_nodes - 1)
+            int j = *(columns + c);
+            if (triangle && j <= i)
             {
-                fprintf(stdout, ",");
+                // an empty cell, keeping the cells under their columns
+                writer_write(writer, ",", 1);
+                continue;
             }
+            writer_printf(writer, ",%.2lf", *(row + j));
         }
-        fprintf(stdout, "\n");
+        writer_write(writer, "\n", 1);
     }
-    return 0; 
+    return writer_close(writer);
     abort();
 }
 
+/**
+ * @brief  Emit the edges of the synthesized tree.
+ * @details  This function emits to a specified output stream the edges
+ * recorded by a prior successful invocation of build_taxonomy(), in the
+ * order in which they were created and in the same format that
+ * build_taxonomy() uses for its edge data.  If flat clusters were selected
+ * with -k or -l, the cut minimum spanning tree is emitted instead (see
+ * emit_cluster_edges()).
+ *
+ * @param out  Stream to which to output the edge data.
+ * @return 0 in case the output is successfully emitted, otherwise -1
+ * if any error occurred.
+ */
+int emit_edge_data(FILE *out) {
+    if (global_options & (CLUSTERS_OPTION | THRESHOLD_OPTION))
+    {
+        return emit_cluster_edges(out);
+    }
+    for (int i = 0; i < num_edges; i++)
+    {
+        fprintf(out, "%d,%d,%.2lf\n", *(*(edge_nodes + i) + 0), *(*(edge_nodes + i) + 1), *(edge_lengths + i));
+    }
+    return ferror(out) ? -1 : 0;
+}
+
 /**
  * @brief  Build a phylogenetic tree using the distance data read by
  * a prior successful invocation of read_distance_data().
@@ -532,7 +782,19 @@ int emit_distance_matrix(FILE *out) {
  * pointers in all three entries of its neighbors array.
  * In addition, the "name" field each NODE structure will contain a
  * pointer to the name of that node (which is stored in the corresponding
- * entry of the node_names array).
+ * entry of the node_names array).  Each edge is also recorded, together
+ * with its estimated length, in the edge_nodes and edge_lengths arrays,
+ * so that the other outputs can be produced from the same run.
+ *
+ * The joins are performed by the engine selected with -e (see global.h),
+ * by default the reference neighbor joining engine.  At each iteration it
+ * joins the pair of active nodes with minimal Q value; among pairs with
+ * equal Q value, the pair with the smallest node indices is joined.
+ * If a refinement was selected with -b, the tree is then refined by
+ * refine_tree() before any output is produced.  The build is carried out
+ * through taxonomy_init(), taxonomy_step() and taxonomy_finalize(), so if
+ * a deadline was given with -w and it passes, the joins that remain are
+ * made by a faster engine (see taxonomy_finalize()).
  *
  * @param out  If non-NULL, an output stream to which to emit the edge data.
  * If NULL, then no edge data is output.
@@ -540,172 +802,19 @@ int emit_distance_matrix(FILE *out) {
  * if any error occurred.
  */
 int build_taxonomy(FILE *out) {
-    if (num_taxa == 2)
+    int remaining = taxonomy_init();
+    while (remaining > 2 && !taxonomy_expired())
     {
-        if (global_options != MATRIX_OPTION)
-        {
-            fprintf(stdout, "%d,%d,%.2lf\n", *(active_node_map + 0), *(active_node_map + (num_all_nodes - 1)), *(*(distances + 0) + (num_all_nodes - 1)));
-        }
-        return 0;
+        remaining = taxonomy_step(1);
     }
-    int edge_index = 0;
-    double edge_data = 0;
-    for (int n = 0; n <= num_taxa - 3; n++)
-    { 
-        //! Compute row sums for vector S(i)
-        double *row_sums_pointer = (row_sums + 0);
-        double current_sum = 0;
-        for (int i = 0; i < num_active_nodes; i++)
-        {
-            row_sums_pointer = (row_sums + *(active_node_map + i));
-            current_sum = 0;
-            for (int j = 0; j < num_active_nodes; j++)
-            {
-                current_sum += *(*(distances + *(active_node_map + i)) + *(active_node_map + j));
-            }
-            *row_sums_pointer = current_sum;
-        }
-        //! Find the smallest distance pair
-        //? Q(i,j) = (N-2) * D(i,j) - S(i) - S(j)
-        double smallest_distance;
-        double current_Q_value;
-        int i_index;
-        int j_index;
-        for (int i = 0; i < num_active_nodes; i++)
-        {
-            for (int j = 0 + i; j < num_active_nodes; j++)
-            {
-                if (i != j)
-                {
-                    current_Q_value = (num_active_nodes - 2) * *(*(distances + *(active_node_map + i)) + *(active_node_map + j)) - *(row_sums + *(active_node_map + i)) - *(row_sums + *(active_node_map + j));
-                    if (i == 0 && j == 1)
-                    {
-                        smallest_distance = current_Q_value;
-                        i_index = *(active_node_map + i);
-                        j_index = *(active_node_map + j);
-                    }
-                    if (current_Q_value < smallest_distance)
-                    {
-                        smallest_distance = current_Q_value;
-                        i_index = *(active_node_map + i);
-                        j_index = *(active_node_map + j);
-                    }
-                }
-            }
-        }
-        
-        //Create new node u, name #nnn
-        NODE *newNode = (nodes + num_all_nodes);
-        char *node_names_pointer = *(node_names + num_all_nodes);
-        *node_names_pointer = '#';
-        node_names_pointer++;
-        sprintf(node_names_pointer, "%d", num_all_nodes);
-        newNode -> name = *(node_names + num_all_nodes);
-        int *active_node_map_pointer = (active_node_map + num_all_nodes);
-        *active_node_map_pointer = num_all_nodes;
-
-        //Join f with u and g with u
-        double f_branch = ((*(*(distances + i_index) + j_index)/2) + (*(row_sums + i_index) - *(row_sums + j_index)) / (2 * (num_active_nodes - 2)));
-        double g_branch = *(*(distances + i_index) + j_index) - f_branch;
-
-        //& Print edge data
-        if (global_options != MATRIX_OPTION)
-        {
-            fprintf(stdout, "%d,%d,%.2lf\n", *(active_node_map + i_index), *(active_node_map + num_all_nodes), f_branch);
-            fprintf(stdout, "%d,%d,%.2lf\n", *(active_node_map + j_index), *(active_node_map + num_all_nodes), g_branch);
-        }
-        edge_data = g_branch;
-        
-        //sets u to parent (neighbors[0] of f and g)
-        *((nodes + i_index)->neighbors + 0) = (nodes + num_all_nodes);
-        *((nodes + j_index)->neighbors + 0) = (nodes + num_all_nodes);
-        if (num_all_nodes <= num_taxa)
-        {
-            *((nodes + i_index)->neighbors + 1) = NULL;
-            *((nodes + i_index)->neighbors + 2) = NULL;
-            *((nodes + j_index)->neighbors + 1) = NULL;
-            *((nodes + j_index)->neighbors + 2) = NULL;
-        }
-        *((nodes + num_all_nodes)->neighbors + 1) = ((nodes + i_index));
-        *((nodes + num_all_nodes)->neighbors + 2) = ((nodes + j_index));
-        //! Matrix Update
-        /*
-        ?    D'(u, k) = D'(k, u) =
-        ?    if k = u then 0
-        ?    else if k = f then D'(u, k) = (D(f, g) + (S(f) - S(g)) / (N - 2)) / 2
-        ?    else if k = g then D'(u, k) = (D(f, g) + (S(g) - S(f)) / (N - 2)) / 2
-        ?    else D'(u, k) = (D(f, k) + D(g, k) - D(f, g)) / 2
-        */
-        for (int k = 0; k <= num_all_nodes; k++)
-        {
-            if (num_active_nodes == k)
-            {
-                *(*(distances + *(active_node_map + num_all_nodes)) + (num_all_nodes)) = 0.0;
-            }
-            else if (k == *(active_node_map + i_index))
-            {
-                *(*(distances + *(active_node_map + num_all_nodes)) + *(active_node_map + k)) = f_branch;
-                *(*(distances + *(active_node_map + k)) + *(active_node_map + num_all_nodes)) = f_branch;
-            }
-            else if (k == *(active_node_map + j_index))
-            {
-                *(*(distances + *(active_node_map + num_all_nodes)) + *(active_node_map + k)) = g_branch;
-                *(*(distances + *(active_node_map + k)) + *(active_node_map + num_all_nodes)) = g_branch;
-            }
-            else
-            {
-                *(*(distances + num_all_nodes) + *(active_node_map + k)) = (*(*(distances + *(active_node_map + i_index)) + *(active_node_map + k)) + *(*(distances + *(active_node_map + j_index)) + *(active_node_map + k)) - (*(*(distances + *(active_node_map + i_index)) + *(active_node_map + j_index)))) / 2.0; 
-                *(*(distances + *(active_node_map + k)) + num_all_nodes) = (*(*(distances + *(active_node_map + i_index)) + *(active_node_map + k)) + *(*(distances + *(active_node_map + j_index)) + *(active_node_map + k)) - (*(*(distances + *(active_node_map + i_index)) + *(active_node_map + j_index)))) / 2.0; 
-            }
-        }
-
-
-        //deactivates f and g
-        int node_map_index_i = 0;
-        int node_map_index_j = 0;
-        active_node_map_pointer = (active_node_map + 0);
-        for (int i = 0; i < num_active_nodes; i++)
-        {
-            if (*active_node_map_pointer == i_index)
-            {
-                node_map_index_i = i;
-            }
-            if (*active_node_map_pointer == j_index)
-            {
-                node_map_index_j = i;
-            }
-            active_node_map_pointer++;
-        }
-        active_node_map_pointer = (active_node_map + node_map_index_i);
-        *active_node_map_pointer = num_all_nodes;
-        active_node_map_pointer = (active_node_map + node_map_index_j);
-        edge_index = *(active_node_map + node_map_index_j);
-        *active_node_map_pointer = *(active_node_map + (num_active_nodes - 1));
-        num_all_nodes++;
-        num_active_nodes--;
-        if (num_active_nodes == 2)
-        {
-            //Setting neighbors for last remaining nodes correctly
-            *((nodes + *(active_node_map + 0))->neighbors + 0) = *((nodes + *(active_node_map + 0))->neighbors + 1);
-            *((nodes + *(active_node_map + 0))->neighbors + 1) = (nodes + *(active_node_map + 1));
-            *((nodes + *(active_node_map + 1))->neighbors + 0) = (nodes + *(active_node_map + 0));
-            *((nodes + *(active_node_map + 1))->neighbors + 1) = NULL;
-            *((nodes + *(active_node_map + 1))->neighbors + 2) = NULL;
-            //Join last remaining nodes 
-            double last_branch = (*(*(distances + *(active_node_map + 1)) + edge_index)) - edge_data;
-            //& Print edge data
-            if (global_options != MATRIX_OPTION)
-            {
-                fprintf(stdout, "%d,%d,%.2lf\n", *(active_node_map + 1), *(active_node_map + 0), last_branch);
-            }
-            num_active_nodes = 0;
-        }
-    }
-    if (num_all_nodes > MAX_NODES)
+    if (remaining == -1 || taxonomy_finalize() == -1)
     {
-        fprintf(stderr, "Error: Number of nodes exceeds maximum nodes!\n");
         return -1;
     }
+    if (out != NULL)
+    {
+        return emit_edge_data(out);
+    }
     return 0;
     abort();
 }
@@ -0,0 +1,116 @@
+#include <stdlib.h>
+
+#include "global.h"
+#include "debug.h"
+
+/* Position of the next row to visit when rows are visited in order. */
+static int cursor;
+
+/* State of the pseudo-random generator used when rows are visited at random. */
+static unsigned long random_state;
+
+/*
+ * Returns the next value of a xorshift pseudo-random sequence.
+ */
+static unsigned long next_random(void)
+{
+    random_state ^= (random_state << 13) & 0xffffffffUL;
+    random_state ^= random_state >> 17;
+    random_state ^= (random_state << 5) & 0xffffffffUL;
+    return random_state;
+}
+
+/*
+ * Returns the active node j that minimizes Q(i,j) within the row of node i,
+ * preferring the node of smaller index in case of ties, and sets *q to Q(i,j).
+ */
+static int best_in_row(int i, double *q)
+{
+    int m = num_active_nodes;
+    double *row = *(distances + i);
+    double s_i = *(row_sums + i);
+    int best = -1;
+    for (int k = 0; k < m; k++)
+    {
+        int k_index = *(active_node_map + k);
+        if (k_index == i)
+        {
+            continue;
+        }
+        double value = (m - 2) * *(row + k_index) - s_i - *(row_sums + k_index);
+        if (best == -1 || value < *q)
+        {
+            *q = value;
+            best = k_index;
+        }
+    }
+    return best;
+}
+
+/**
+ * @brief  Initialize the relaxed neighbor joining engine.
+ * @details  Computes the row sums, which are afterwards maintained
+ * incrementally, and seeds the row visiting order.
+ * @return 0.
+ */
+int rnj_init(void) {
+    compute_row_sums();
+    cursor = 0;
+    random_state = (random_seed & 0xffffffffUL) != 0 ? (random_seed & 0xffffffffUL) : 1;
+    return 0;
+}
+
+/**
+ * @brief  Perform one relaxed neighbor joining step.
+ * @details  Relaxed neighbor joining (J. Evans, L. Sheneman and J. Foster,
+ * "Relaxed Neighbor Joining: A Fast Distance-Based Phylogenetic Tree
+ * Construction Method", J. Mol. Evol. 62:785-792, 2006) joins any pair
+ * of nodes each of which minimizes Q within the other's row, rather than
+ * the pair with the globally minimal Q.  Starting from a row i, visited
+ * in order or at random, the best partner j of i is found; if i is also
+ * the best partner of j the pair is joined, and otherwise the search
+ * moves on to the row of j.  Since Q decreases along the way, the search
+ * ends at a mutually best pair, usually after a few O(N) row scans, so
+ * together with the O(N) row sum update a typical join costs O(N)
+ * rather than O(N^2).
+ *
+ * @return 0 if the join was performed, otherwise -1.
+ */
+int rnj_step(void) {
+    int m = num_active_nodes;
+    int i;
+    if (random_seed != 0)
+    {
+        i = *(active_node_map + next_random() % m);
+    }
+    else
+    {
+        cursor = cursor % m;
+        i = *(active_node_map + cursor);
+        cursor++;
+    }
+    double q;
+    int j = best_in_row(i, &q);
+    // at most m - 1 moves, each to a pair with strictly better Q or tie-break order
+    for (int moves = 0; moves < m; moves++)
+    {
+        double q_j;
+        int k = best_in_row(j, &q_j);
+        if (k == i)
+        {
+            break;
+        }
+        i = j;
+        j = k;
+        q = q_j;
+    }
+    int f = i < j ? i : j;
+    int g = i < j ? j : i;
+    int u = nj_join(f, g);
+    if (u == -1)
+    {
+        return -1;
+    }
+    update_row_sums(f, g, u);
+    return 0;
+}
@@ -0,0 +1,288 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "global.h"
+#include "debug.h"
+
+/*
+ * Edges of the minimum spanning tree of the active nodes, in increasing
+ * order of length once single_init() has returned.
+ */
+static int mst_edges[MAX_NODES][2];
+static double mst_lengths[MAX_NODES];
+static int num_mst_edges;
+
+/* Index in mst_edges of the next edge to join by single_step(). */
+static int next_edge;
+
+/*
+ * Union-find forest over the nodes present at initialization, and for
+ * the root of each set the node that currently represents the cluster.
+ */
+static int cluster_parents[MAX_NODES];
+static int cluster_nodes[MAX_NODES];
+
+/* Height of each node above the leaves (half the length of the edge that joined it). */
+static double heights[MAX_NODES];
+
+/*
+ * Candidate nodes of the Prim scan, which occupy the positions [t, m)
+ * of these arrays once t nodes are in the tree, together with the least
+ * distance from each candidate to the tree and the tree node realizing it.
+ * The tree node is kept as a double so that both arrays are updated by
+ * the same vector operations.
+ */
+static int candidates[MAX_NODES];
+static double keys[MAX_NODES];
+static double attachments[MAX_NODES];
+static double row_values[MAX_NODES];
+
+/*
+ * Pairs of doubles processed together in the Prim scans.  GCC lowers
+ * these generic vectors to SSE2 or NEON instructions where available,
+ * and to scalar code elsewhere.
+ */
+typedef double v2df __attribute__((vector_size(16)));
+typedef long long v2di __attribute__((vector_size(16)));
+
+/*
+ * Returns a where mask is set and b elsewhere.
+ */
+static v2df select_v2df(v2di mask, v2df a, v2df b)
+{
+    return (v2df)(((v2di)a & mask) | ((v2di)b & ~mask));
+}
+
+/*
+ * Lowers the keys of the candidates in positions [t, m) to their
+ * distances from the node u just added to the tree, given in row_values,
+ * and returns the least key.
+ */
+static double prim_update(int t, int m, int u)
+{
+    v2df node = { u, u };
+    v2df least = { *(keys + t), *(keys + t) };
+    int v = t;
+    for (; v + 2 <= m; v += 2)
+    {
+        v2df value, key, attachment;
+        memcpy(&value, row_values + v, sizeof(value));
+        memcpy(&key, keys + v, sizeof(key));
+        memcpy(&attachment, attachments + v, sizeof(attachment));
+        v2di closer = value < key;
+        key = select_v2df(closer, value, key);
+        attachment = select_v2df(closer, node, attachment);
+        memcpy(keys + v, &key, sizeof(key));
+        memcpy(attachments + v, &attachment, sizeof(attachment));
+        least = select_v2df(key < least, key, least);
+    }
+    double best = least[0] < least[1] ? least[0] : least[1];
+    for (; v < m; v++)
+    {
+        if (*(row_values + v) < *(keys + v))
+        {
+            *(keys + v) = *(row_values + v);
+            *(attachments + v) = u;
+        }
+        if (*(keys + v) < best)
+        {
+            best = *(keys + v);
+        }
+    }
+    return best;
+}
+
+/*
+ * Orders the spanning tree edges by length, then by their node indices.
+ */
+static int compare_edges(const void *a, const void *b)
+{
+    int i = *(const int *)a;
+    int j = *(const int *)b;
+    if (*(mst_lengths + i) != *(mst_lengths + j))
+        return *(mst_lengths + i) < *(mst_lengths + j) ? -1 : 1;
+    if (*(*(mst_edges + i) + 0) != *(*(mst_edges + j) + 0))
+        return *(*(mst_edges + i) + 0) - *(*(mst_edges + j) + 0);
+    return *(*(mst_edges + i) + 1) - *(*(mst_edges + j) + 1);
+}
+
+/*
+ * Returns the root of the union-find set containing node x, halving the path.
+ */
+static int find_cluster(int x)
+{
+    while (*(cluster_parents + x) != x)
+    {
+        *(cluster_parents + x) = *(cluster_parents + *(cluster_parents + x));
+        x = *(cluster_parents + x);
+    }
+    return x;
+}
+
+/**
+ * @brief  Initialize the single-linkage engine.
+ * @details  The minimum spanning tree of the active nodes is found by
+ * Prim's algorithm in O(N^2): the node last added to the tree lowers the
+ * keys of the remaining candidates, which are kept together at the end
+ * of the candidate arrays so that the update and the search for the least
+ * key are branch-free scans over contiguous memory, done two at a time.
+ * The edges are then sorted by length, which is the order in which
+ * single-linkage clustering joins the clusters they connect.
+ * @return 0.
+ */
+int single_init(void) {
+    int m = num_active_nodes;
+    num_mst_edges = 0;
+    next_edge = 0;
+    for (int v = 0; v < m; v++)
+    {
+        int v_index = *(active_node_map + v);
+        *(candidates + v) = v_index;
+        *(keys + v) = HUGE_VAL;
+        *(attachments + v) = v_index;
+        *(cluster_parents + v_index) = v_index;
+        *(cluster_nodes + v_index) = v_index;
+        *(heights + v_index) = 0.0;
+    }
+    for (int t = 1; t < m; t++)
+    {
+        int u = *(candidates + t - 1);
+        double *row = *(distances + u);
+        for (int v = t; v < m; v++)
+        {
+            *(row_values + v) = *(row + *(candidates + v));
+        }
+        double best = prim_update(t, m, u);
+        int v = t;
+        while (*(keys + v) != best)
+        {
+            v++;
+        }
+        int x = (int)*(attachments + v);
+        int y = *(candidates + v);
+        *(*(mst_edges + num_mst_edges) + 0) = x < y ? x : y;
+        *(*(mst_edges + num_mst_edges) + 1) = x < y ? y : x;
+        *(mst_lengths + num_mst_edges) = best;
+        num_mst_edges++;
+
+        // move the new tree node out of the candidate positions
+        *(candidates + v) = *(candidates + t);
+        *(keys + v) = *(keys + t);
+        *(attachments + v) = *(attachments + t);
+        *(candidates + t) = y;
+    }
+
+    //! Sort the edges into joining order
+    int order[MAX_NODES];
+    int sorted_edges[MAX_NODES][2];
+    double sorted_lengths[MAX_NODES];
+    for (int e = 0; e < num_mst_edges; e++)
+    {
+        *(order + e) = e;
+    }
+    qsort(order, num_mst_edges, sizeof(int), compare_edges);
+    for (int e = 0; e < num_mst_edges; e++)
+    {
+        *(*(sorted_edges + e) + 0) = *(*(mst_edges + *(order + e)) + 0);
+        *(*(sorted_edges + e) + 1) = *(*(mst_edges + *(order + e)) + 1);
+        *(sorted_lengths + e) = *(mst_lengths + *(order + e));
+    }
+    memcpy(mst_edges, sorted_edges, num_mst_edges * sizeof(*mst_edges));
+    memcpy(mst_lengths, sorted_lengths, num_mst_edges * sizeof(double));
+    return 0;
+}
+
+/**
+ * @brief  Perform one single-linkage join.
+ * @details  The two clusters connected by the shortest spanning tree edge
+ * not yet used are joined, at a height of half its length.  The distance
+ * from the new cluster to another cluster is the lesser of the distances
+ * from the two clusters joined, so that the distances matrix holds the
+ * single-linkage distances between the active clusters.
+ * @return 0 if the join was performed, otherwise -1.
+ */
+int single_step(void) {
+    if (next_edge >= num_mst_edges)
+    {
+        return -1;
+    }
+    int x_root = find_cluster(*(*(mst_edges + next_edge) + 0));
+    int y_root = find_cluster(*(*(mst_edges + next_edge) + 1));
+    double height = *(mst_lengths + next_edge) / 2.0;
+    next_edge++;
+    int a = *(cluster_nodes + x_root);
+    int b = *(cluster_nodes + y_root);
+    int f = a < b ? a : b;
+    int g = a < b ? b : a;
+    int u = new_node();
+    if (u == -1)
+    {
+        return -1;
+    }
+    double *f_row = *(distances + f);
+    double *g_row = *(distances + g);
+    double f_branch = height - *(heights + f);
+    double g_branch = height - *(heights + g);
+    for (int k = 0; k < num_active_nodes; k++)
+    {
+        int k_index = *(active_node_map + k);
+        double value;
+        if (k_index == f)
+            value = f_branch;
+        else if (k_index == g)
+            value = g_branch;
+        else
+            value = *(f_row + k_index) < *(g_row + k_index) ? *(f_row + k_index) : *(g_row + k_index);
+        *(*(distances + u) + k_index) = value;
+        *(*(distances + k_index) + u) = value;
+    }
+    *(heights + u) = height;
+    join_nodes(f, g, u, f_branch, g_branch);
+    *(cluster_parents + y_root) = x_root;
+    *(cluster_nodes + x_root) = u;
+    return 0;
+}
+
+/**
+ * @brief  Length of the final edge of a single-linkage tree.
+ * @details  As for UPGMA, the two edges to the root that would lie midway
+ * between the last two clusters are merged into one.
+ *
+ * @param a  Index of one of the last two active nodes.
+ * @param b  Index of the other.
+ * @return the length of the edge between them.
+ */
+double single_last_edge(int a, int b) {
+    return *(*(distances + a) + b) - *(heights + a) - *(heights + b);
+}
+
+/**
+ * @brief  Output the minimum spanning tree, cut into flat clusters.
+ * @details  This function assumes that the tree has been built by the
+ * single-linkage engine.  The spanning tree edges are output in the edge
+ * data format, in increasing order of length, omitting the edges whose
+ * removal cuts the tree into the clusters selected by -k or -l: the
+ * num_clusters - 1 longest edges, or the edges longer than
+ * cluster_threshold.  The connected components of the edges output are
+ * then the single-linkage clusters.
+ *
+ * @param out  The output stream.
+ * @return 0 if the output was successfully emitted, otherwise -1.
+ */
+int emit_cluster_edges(FILE *out) {
+    int kept = num_mst_edges;
+    if (global_options & CLUSTERS_OPTION)
+    {
+        kept = num_clusters > num_mst_edges ? 0 : num_mst_edges - num_clusters + 1;
+    }
+    for (int e = 0; e < kept; e++)
+    {
+        if ((global_options & THRESHOLD_OPTION) && *(mst_lengths + e) > cluster_threshold)
+        {
+            break;
+        }
+        fprintf(out, "%d,%d,%.2lf\n", *(*(mst_edges + e) + 0), *(*(mst_edges + e) + 1), *(mst_lengths + e));
+    }
+    return ferror(out) ? -1 : 0;
+}
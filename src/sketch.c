@@ -0,0 +1,516 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "global.h"
+#include "debug.h"
+
+/* Maximum length of the path of a genome file. */
+#define GENOME_PATH_MAX 4096
+
+/* Paths of the genome files, one per taxon. */
+static char genome_paths[MAX_TAXA][GENOME_PATH_MAX + 1];
+
+/*
+ * The sketch of each genome: the sketch_size smallest distinct hashes of
+ * its canonical k-mers, in increasing order, and how many there are (fewer
+ * than sketch_size only for genomes with fewer distinct k-mers).
+ */
+static uint64_t sketches[MAX_TAXA][MAX_SKETCH];
+static int sketch_lengths[MAX_TAXA];
+
+/* Seed of the k-mer hash, which is part of the sketch cache key. */
+#define HASH_SEED 42
+
+/* Header of a cached sketch file, followed by its hashes. */
+typedef struct sketch_header {
+    char magic[8];
+    int kmer_size;
+    int sketch_size;
+    int seed;
+    int length;
+} SKETCH_HEADER;
+#define SKETCH_MAGIC "PHILOSK1"
+
+/*
+ * Work of one thread sketching genomes or comparing sketches: the genomes
+ * (or the rows of the matrix) are taken in turn from next_item, and the
+ * thread reports the genome it could not sketch, if any.
+ */
+typedef struct sketch_work {
+    int failed;
+} SKETCH_WORK;
+
+/* The next genome to sketch, or row of the matrix to fill. */
+static int next_item;
+
+/* Whether each genome could not be read, or had no k-mers. */
+static int unreadable[MAX_TAXA];
+static int empty[MAX_TAXA];
+
+/*
+ * Returns the finalizer of MurmurHash3 applied to a k-mer, which is
+ * invertible, so that distinct k-mers have distinct hashes, and mixes
+ * every bit of the k-mer into every bit of the hash.
+ */
+static uint64_t hash_kmer(uint64_t kmer)
+{
+    uint64_t h = kmer ^ HASH_SEED;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/*
+ * Comparison function of hashes for qsort().
+ */
+static int compare_hashes(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Sorts the n hashes of a buffer, removes the duplicates and keeps at
+ * most the sketch_size smallest.  Returns how many are kept.
+ */
+static int trim_hashes(uint64_t *hashes, int n)
+{
+    qsort(hashes, n, sizeof(uint64_t), compare_hashes);
+    int kept = 0;
+    for (int k = 0; k < n && kept < sketch_size; k++)
+    {
+        if (kept == 0 || *(hashes + k) != *(hashes + kept - 1))
+        {
+            *(hashes + kept++) = *(hashes + k);
+        }
+    }
+    return kept;
+}
+
+/*
+ * Sketches genome g from its file, using a buffer of 4 sketch_size
+ * hashes.  The k-mers and their reverse complements are kept two bits
+ * per base as they roll along the sequence, and a k-mer is hashed only
+ * once k bases in a row have been read since the start of a sequence or
+ * the last character other than a base.  Hashes are gathered in the
+ * buffer while they are below the largest of a full sketch, and the
+ * buffer is trimmed to the sketch when it fills.  Returns -1 if the file
+ * cannot be read.
+ */
+static int sketch_genome(int g, uint64_t *buffer)
+{
+    gzFile file = gzopen(*(genome_paths + g), "rb");
+    if (file == NULL)
+    {
+        return -1;
+    }
+    unsigned char chunk[65536];
+    uint64_t mask = kmer_size == 32 ? ~0ULL : (1ULL << (2 * kmer_size)) - 1;
+    int shift = 2 * (kmer_size - 1);
+    uint64_t forward = 0, reverse = 0, threshold = ~0ULL;
+    int run = 0, in_header = 0, at_line_start = 1, n = 0;
+    int length;
+    while ((length = gzread(file, chunk, sizeof(chunk))) > 0)
+    {
+        for (int k = 0; k < length; k++)
+        {
+            int c = *(chunk + k);
+            if (in_header)
+            {
+                in_header = c != '\n';
+                at_line_start = !in_header;
+                continue;
+            }
+            if (c == '>' && at_line_start)
+            {
+                // a new sequence: k-mers do not span sequences
+                in_header = 1;
+                run = 0;
+                continue;
+            }
+            at_line_start = c == '\n';
+            if (c == '\n' || c == '\r')
+            {
+                continue;
+            }
+            uint64_t code;
+            switch (c)
+            {
+            case 'A': case 'a': code = 0; break;
+            case 'C': case 'c': code = 1; break;
+            case 'G': case 'g': code = 2; break;
+            case 'T': case 't': code = 3; break;
+            default:
+                run = 0;
+                continue;
+            }
+            forward = ((forward << 2) | code) & mask;
+            reverse = (reverse >> 2) | ((3 - code) << shift);
+            if (++run < kmer_size)
+            {
+                continue;
+            }
+            uint64_t hash = hash_kmer(forward < reverse ? forward : reverse);
+            if (hash >= threshold)
+            {
+                continue;
+            }
+            *(buffer + n++) = hash;
+            if (n == 4 * sketch_size)
+            {
+                n = trim_hashes(buffer, n);
+                if (n == sketch_size)
+                {
+                    threshold = *(buffer + n - 1);
+                }
+            }
+        }
+    }
+    int error = length < 0;
+    gzclose(file);
+    if (error)
+    {
+        return -1;
+    }
+    n = trim_hashes(buffer, n);
+    memcpy(*(sketches + g), buffer, n * sizeof(uint64_t));
+    *(sketch_lengths + g) = n;
+    return 0;
+}
+
+/*
+ * Sets path to the name of the file caching the sketch of genome g in
+ * the directory given with -C.  The name is made of the name of the taxon
+ * and a hash of the path of the genome, so that genomes of the same name
+ * in different directories do not share a cache file.  Returns -1 if the
+ * name is too long.
+ */
+static int cache_path(int g, char *path)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (char *p = *(genome_paths + g); *p != '\0'; p++)
+    {
+        hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+    }
+    int length = snprintf(path, GENOME_PATH_MAX + 1, "%s/%s-%016llx.sketch", sketch_cache, *(node_names + g), (unsigned long long)hash);
+    return length > GENOME_PATH_MAX ? -1 : 0;
+}
+
+/*
+ * Loads the sketch of genome g from the cache, if it is there, was made
+ * with the same k-mer size, sketch size and hash, and is not older than
+ * the genome file.  Returns 0 if the sketch was loaded, otherwise -1.
+ */
+static int load_sketch(int g)
+{
+    char path[GENOME_PATH_MAX + 1];
+    struct stat genome_stat, cache_stat;
+    if (cache_path(g, path) == -1 || stat(*(genome_paths + g), &genome_stat) == -1
+        || stat(path, &cache_stat) == -1 || cache_stat.st_mtime < genome_stat.st_mtime)
+    {
+        return -1;
+    }
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        return -1;
+    }
+    SKETCH_HEADER header;
+    int loaded = fread(&header, sizeof(header), 1, file) == 1
+        && memcmp(header.magic, SKETCH_MAGIC, sizeof(header.magic)) == 0
+        && header.kmer_size == kmer_size && header.sketch_size == sketch_size && header.seed == HASH_SEED
+        && header.length >= 0 && header.length <= sketch_size
+        && fread(*(sketches + g), sizeof(uint64_t), header.length, file) == (size_t)header.length;
+    fclose(file);
+    if (!loaded)
+    {
+        return -1;
+    }
+    *(sketch_lengths + g) = header.length;
+    return 0;
+}
+
+/*
+ * Saves the sketch of genome g in the cache.  The sketch is written to a
+ * temporary file that is then renamed, so that concurrent runs sharing
+ * the cache never read a partial sketch.  A sketch that cannot be saved
+ * is simply computed again next time.
+ */
+static void save_sketch(int g)
+{
+    char path[GENOME_PATH_MAX + 1];
+    char temporary[GENOME_PATH_MAX + 32];
+    if (cache_path(g, path) == -1)
+    {
+        return;
+    }
+    snprintf(temporary, sizeof(temporary), "%s.%ld.tmp", path, (long)getpid());
+    FILE *file = fopen(temporary, "wb");
+    if (file == NULL)
+    {
+        return;
+    }
+    SKETCH_HEADER header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SKETCH_MAGIC, sizeof(header.magic));
+    header.kmer_size = kmer_size;
+    header.sketch_size = sketch_size;
+    header.seed = HASH_SEED;
+    header.length = *(sketch_lengths + g);
+    int saved = fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(*(sketches + g), sizeof(uint64_t), header.length, file) == (size_t)header.length;
+    saved = fclose(file) == 0 && saved;
+    if (!saved || rename(temporary, path) == -1)
+    {
+        remove(temporary);
+    }
+}
+
+/*
+ * Thread start routine sketching genomes: takes genomes until none is
+ * left, loading their sketches from the cache given with -C when they
+ * are there, and saving them to it otherwise.
+ */
+static void *sketch_thread(void *arg)
+{
+    SKETCH_WORK *work = arg;
+    uint64_t *buffer = malloc(4 * sketch_size * sizeof(uint64_t));
+    if (buffer == NULL)
+    {
+        work->failed = 1;
+        return NULL;
+    }
+    int g;
+    while ((g = __atomic_fetch_add(&next_item, 1, __ATOMIC_RELAXED)) < num_taxa)
+    {
+        if (sketch_cache != NULL && load_sketch(g) == 0)
+        {
+            *(empty + g) = *(sketch_lengths + g) == 0;
+            continue;
+        }
+        if (sketch_genome(g, buffer) == -1)
+        {
+            *(unreadable + g) = 1;
+            continue;
+        }
+        *(empty + g) = *(sketch_lengths + g) == 0;
+        if (sketch_cache != NULL)
+        {
+            save_sketch(g);
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+/*
+ * Returns the Mash distance between genomes i and j.  Their sketches are
+ * merged in order up to sketch_size hashes of the union, counting the
+ * hashes in both, with a merge free of branches that depend on the data:
+ * each step advances past the smaller hash, or both if they are equal,
+ * by adding comparison results, which compile to conditional moves.  The
+ * proportion shared estimates the Jaccard index J of the k-mer sets, and
+ * the distance is -ln(2J / (1 + J)) / k, or 1 if no hash is shared.
+ */
+static double mash_distance(int i, int j)
+{
+    uint64_t *a = *(sketches + i), *b = *(sketches + j);
+    int a_length = *(sketch_lengths + i), b_length = *(sketch_lengths + j);
+    int x = 0, y = 0, merged = 0, shared = 0;
+    while (x < a_length && y < b_length && merged < sketch_size)
+    {
+        uint64_t p = *(a + x), q = *(b + y);
+        shared += p == q;
+        x += p <= q;
+        y += q <= p;
+        merged++;
+    }
+    // the rest of the union comes from the sketch that is not exhausted
+    int rest = (a_length - x) + (b_length - y);
+    merged += rest < sketch_size - merged ? rest : sketch_size - merged;
+    if (shared == 0)
+    {
+        return 1.0;
+    }
+    double jaccard = (double)shared / merged;
+    double d = -log(2.0 * jaccard / (1.0 + jaccard)) / kmer_size;
+    // identical sketches give -0.0
+    return d == 0.0 ? 0.0 : d;
+}
+
+/*
+ * Thread start routine comparing sketches: takes rows of the upper
+ * triangle of the matrix until none is left, writing the distances of
+ * each row straight into both triangles.  The rows get shorter, so
+ * threads that take the short ones simply take more of them.
+ */
+static void *compare_thread(void *arg)
+{
+    int i;
+    while ((i = __atomic_fetch_add(&next_item, 1, __ATOMIC_RELAXED)) < num_taxa)
+    {
+        for (int j = i + 1; j < num_taxa; j++)
+        {
+            double d = mash_distance(i, j);
+            *(*(distances + i) + j) = d;
+            *(*(distances + j) + i) = d;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Sets the name of genome g from the last component of its path, up to
+ * the first '.', so that "data/ecoli.fna.gz" is named "ecoli".  Returns
+ * -1 if the name is empty or too long.
+ */
+static int genome_name(int g)
+{
+    char *path = *(genome_paths + g);
+    char *start = strrchr(path, '/');
+    start = start == NULL ? path : start + 1;
+    char *end = strchr(start, '.');
+    int length = end == NULL ? (int)strlen(start) : (int)(end - start);
+    if (length == 0 || length > INPUT_MAX)
+    {
+        return -1;
+    }
+    memcpy(*(node_names + g), start, length);
+    *(*(node_names + g) + length) = '\0';
+    return 0;
+}
+
+/**
+ * @brief  Read a list of genome assemblies, sketch them and initialize
+ * data structures.
+ * @details  This function is used instead of read_distance_data() when
+ * the -i genomes option is given, and sets the same global variables and
+ * data structures.  Each line of the input is the path of a genome
+ * assembly in FASTA format, which may have any number of sequences
+ * (contigs) and may be compressed with gzip; the taxon is named after the
+ * file.  Each genome is reduced to a bottom-k MinHash sketch: the
+ * sketch_size (-S) smallest hashes of its canonical k-mers of size
+ * kmer_size (-K), the canonical k-mer being the smaller of a k-mer and its
+ * reverse complement.  The distance between two genomes is the Mash
+ * distance estimated from their sketches, which approximates the
+ * proportion of differing sites.  The genomes are sketched, and the pairs
+ * compared, by the worker threads given with -j, and the distances are
+ * stored straight into the distances matrix.  With -C, the sketches are
+ * kept in a directory and reused until the genome file changes.
+ *
+ * @param in  The input stream from which to read the paths of the genomes.
+ * @return 0 in case the genomes were successfully sketched, otherwise -1
+ * if there was any error, after printing a one-line error message to
+ * stderr.
+ */
+int read_genome_data(FILE *in) {
+    num_taxa = 0;
+    char line[GENOME_PATH_MAX + 2];
+    while (fgets(line, sizeof(line), in) != NULL)
+    {
+        int length = strlen(line);
+        if (length > 0 && *(line + length - 1) != '\n' && !feof(in))
+        {
+            fprintf(stderr, "Error: Genome path exceeds path max!\n");
+            return -1;
+        }
+        while (length > 0 && (*(line + length - 1) == '\n' || *(line + length - 1) == '\r'))
+        {
+            *(line + --length) = '\0';
+        }
+        if (length == 0)
+        {
+            continue;
+        }
+        if (num_taxa + 1 > MAX_TAXA)
+        {
+            fprintf(stderr, "Error: Number of taxa exceeds taxa max!\n");
+            return -1;
+        }
+        strcpy(*(genome_paths + num_taxa), line);
+        if (genome_name(num_taxa) == -1)
+        {
+            fprintf(stderr, "Error: Genome file name does not give a taxon name!\n");
+            return -1;
+        }
+        num_taxa++;
+    }
+    if (num_taxa == 0)
+    {
+        fprintf(stderr, "Error: No genomes in input!\n");
+        return -1;
+    }
+    if (sketch_cache != NULL && mkdir(sketch_cache, 0777) == -1 && errno != EEXIST)
+    {
+        fprintf(stderr, "Error: Cannot create sketch cache directory '%s'!\n", sketch_cache);
+        return -1;
+    }
+
+    //! Sketch the genomes, spread over the worker threads
+    SKETCH_WORK work[MAX_NODES];
+    int threads = worker_threads();
+    if (threads > num_taxa)
+    {
+        threads = num_taxa;
+    }
+    for (int t = 0; t < threads; t++)
+    {
+        (work + t)->failed = 0;
+    }
+    for (int g = 0; g < num_taxa; g++)
+    {
+        *(unreadable + g) = 0;
+        *(empty + g) = 0;
+    }
+    next_item = 0;
+    run_parallel(sketch_thread, work, sizeof(SKETCH_WORK), threads);
+    for (int t = 0; t < threads; t++)
+    {
+        if ((work + t)->failed)
+        {
+            fprintf(stderr, "Error: Cannot allocate sketch buffer!\n");
+            return -1;
+        }
+    }
+    for (int g = 0; g < num_taxa; g++)
+    {
+        if (*(unreadable + g))
+        {
+            fprintf(stderr, "Error: Cannot read genome file '%s'!\n", *(genome_paths + g));
+            return -1;
+        }
+        if (*(empty + g))
+        {
+            fprintf(stderr, "Error: Genome file '%s' has no k-mers!\n", *(genome_paths + g));
+            return -1;
+        }
+    }
+
+    //! Compare the sketches, a row of the matrix at a time
+    next_item = 0;
+    run_parallel(compare_thread, work, sizeof(SKETCH_WORK), threads);
+    for (int i = 0; i < num_taxa; i++)
+    {
+        (nodes + i)->name = *(node_names + i);
+        *(active_node_map + i) = i;
+        *(*(distances + i) + i) = 0.0;
+    }
+    num_all_nodes = num_taxa;
+    num_active_nodes = num_taxa;
+    if (global_options & COLLAPSE_OPTION)
+    {
+        collapse_duplicates();
+    }
+    return 0;
+}
@@ -0,0 +1,151 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "global.h"
+#include "debug.h"
+
+/* The engine selected for the build in progress, and the one that finishes it. */
+static ENGINE *build_engine;
+static ENGINE *finishing_engine;
+
+/* Time at which the build in progress started. */
+static struct timespec start_time;
+
+/*
+ * Returns the number of milliseconds elapsed since taxonomy_init().
+ */
+static long elapsed_milliseconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start_time.tv_sec) * 1000L + (now.tv_nsec - start_time.tv_nsec) / 1000000L;
+}
+
+/**
+ * @brief  Begin building the tree, one join at a time.
+ * @details  The engine selected with -e is looked up and initialized, and
+ * the tree built by any previous build is forgotten by reset_taxonomy(),
+ * with the duplicates set aside again if -u was given, so that the same
+ * distance data can be built from again.  The joins can then be performed
+ * by taxonomy_step() and the tree completed by taxonomy_finalize().  If a deadline was given with -w, it is counted
+ * from this call.  Between the calls, the tree built so far is a forest:
+ * its edges are the num_edges edges recorded in edge_nodes and
+ * edge_lengths, with the NODE structures linked accordingly, and its
+ * roots are the num_active_nodes nodes in active_node_map.
+ *
+ * @return the number of active nodes, or -1 if an error occurred.
+ */
+int taxonomy_init(void) {
+    build_engine = find_engine(engine_name);
+    if (build_engine == NULL)
+    {
+        fprintf(stderr, "Error: Unknown engine!\n");
+        return -1;
+    }
+    finishing_engine = build_engine;
+    if (num_edges > 0 || num_all_nodes > num_taxa)
+    {
+        reset_taxonomy();
+        if (global_options & COLLAPSE_OPTION)
+        {
+            collapse_duplicates();
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    num_edges = 0;
+    row_sum_drift = 0.0;
+    for (int i = 0; i < num_taxa; i++)
+    {
+        *((nodes + i)->neighbors + 0) = NULL;
+        *((nodes + i)->neighbors + 1) = NULL;
+        *((nodes + i)->neighbors + 2) = NULL;
+    }
+    if (build_engine->init != NULL && build_engine->init() == -1)
+    {
+        return -1;
+    }
+    return num_active_nodes;
+}
+
+/**
+ * @brief  Perform some of the joins of the tree being built.
+ * @details  Steps of the engine are performed until at least the given
+ * number of joins have been made, only two active nodes remain, or the
+ * deadline given with -w has passed.  An engine step can make several
+ * joins, so more joins than requested may be made.
+ *
+ * @param joins  The number of joins to make.
+ * @return the number of active nodes remaining, or -1 if an error occurred.
+ */
+int taxonomy_step(int joins) {
+    int target = num_edges + 2 * joins;
+    while (num_active_nodes > 2 && num_edges < target && !taxonomy_expired())
+    {
+        if (build_engine->step() == -1)
+        {
+            return -1;
+        }
+    }
+    return num_active_nodes;
+}
+
+/**
+ * @brief  Whether the deadline given with -w has passed.
+ * @return nonzero if a deadline was given and has passed, otherwise 0.
+ */
+int taxonomy_expired(void) {
+    return (global_options & DEADLINE_OPTION) && elapsed_milliseconds() >= time_budget;
+}
+
+/**
+ * @brief  Complete the tree being built.
+ * @details  If more than two active nodes remain, because the deadline
+ * passed or the caller stopped stepping, they are joined by the batched
+ * neighbor joining engine, which joins every mutually best pair found by
+ * each scan, so that the scans shrink geometrically and the remaining
+ * joins cost little more than a single O(N^2) pass.  The engines with a
+ * last edge of their own (the clustering engines, whose rows hold average
+ * distances between clusters of given heights, and nj-lazy, which does not
+ * store the distances between taxa) keep no distances between nodes that
+ * the batched engine could read, so they finish with their own steps
+ * instead.  A message on the standard error reports how many nodes were
+ * left, and to which engine.  The last two
+ * nodes are then joined, and the duplicates set aside by -u are put back,
+ * the row sum drift is reported and the tree is refined, as requested.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+int taxonomy_finalize(void) {
+    if (num_active_nodes > 2)
+    {
+        if (build_engine->last_edge == NULL)
+        {
+            finishing_engine = find_engine("nj-batch");
+        }
+        fprintf(stderr, "Finishing %d active nodes with %s\n", num_active_nodes, finishing_engine->name);
+        while (num_active_nodes > 2)
+        {
+            if (finishing_engine->step() == -1)
+            {
+                return -1;
+            }
+        }
+    }
+    finish_tree(finishing_engine);
+    if ((global_options & COLLAPSE_OPTION) && reattach_duplicates() == -1)
+    {
+        return -1;
+    }
+    if (global_options & DRIFT_OPTION)
+    {
+        fprintf(stderr, "Largest row sum drift: %.3g\n", row_sum_drift);
+    }
+    if (refinement != REFINE_NONE && refine_tree(refinement) == -1)
+    {
+        return -1;
+    }
+    compact_tree();
+    return 0;
+}
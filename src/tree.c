@@ -0,0 +1,469 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "global.h"
+#include "debug.h"
+
+/*
+ * Sets the branch lengths of the compact tree from the edge data: each
+ * edge gives the length of the slot of each of its ends that holds the
+ * other.
+ */
+static void set_branches(void)
+{
+    for (int e = 0; e < num_edges; e++)
+    {
+        int a = *(tree_positions + *(*(edge_nodes + e) + 0));
+        int b = *(tree_positions + *(*(edge_nodes + e) + 1));
+        if (a == -1 || b == -1)
+        {
+            continue;
+        }
+        for (int k = 0; k < 3; k++)
+        {
+            if (*(*(tree_neighbors + a) + k) == b)
+                *(*(tree_branches + a) + k) = *(edge_lengths + e);
+            if (*(*(tree_neighbors + b) + k) == a)
+                *(*(tree_branches + b) + k) = *(edge_lengths + e);
+        }
+    }
+}
+
+/*
+ * Index answering patristic distance queries on the compact tree, rooted
+ * at position 0.  The Euler tour lists the positions met by a depth-first
+ * walk, each node every time the walk is at it, and first_visits[p] is
+ * where position p first appears in it.  The lowest common ancestor of two
+ * nodes is the shallowest node of the tour between their first visits; as
+ * the positions are in breadth-first order, it is also the smallest
+ * position there, so sparse_minima[k][t] holds the smallest position of
+ * the 2^k entries of the tour from t.  root_distances[p] is the length of
+ * the path from position 0 to p.
+ */
+#define TOUR_MAX (2 * MAX_NODES)
+#define TOUR_LEVELS 9
+static int euler_tour[TOUR_MAX];
+static int tour_length;
+static int first_visits[MAX_NODES];
+static int sparse_minima[TOUR_LEVELS][TOUR_MAX];
+static double root_distances[MAX_NODES];
+
+/* Open-addressing table of the positions of the node names, or -1. */
+#define NAME_SLOTS 512
+static int name_slots[NAME_SLOTS];
+
+/*
+ * Returns the FNV-1a hash of the first length characters of a name.
+ */
+static unsigned int name_hash(char *name, size_t length)
+{
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash = (hash ^ (unsigned char)*(name + i)) * 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Adds position p and the subtree below it, regarding position parent as
+ * its parent, to the Euler tour, with their distances from the root.
+ */
+static void tour_subtree(int p, int parent)
+{
+    *(first_visits + p) = tour_length;
+    *(euler_tour + tour_length++) = p;
+    for (int k = 0; k < 3; k++)
+    {
+        int child = *(*(tree_neighbors + p) + k);
+        if (child == -1 || child == parent)
+        {
+            continue;
+        }
+        *(root_distances + child) = *(root_distances + p) + *(*(tree_branches + p) + k);
+        tour_subtree(child, p);
+        *(euler_tour + tour_length++) = p;
+    }
+}
+
+/*
+ * Builds the query index of the compact tree: the Euler tour, the sparse
+ * table over it and the table of names.
+ */
+static void index_tree(void)
+{
+    tour_length = 0;
+    if (tree_size == 0)
+    {
+        return;
+    }
+    *(root_distances + 0) = 0.0;
+    tour_subtree(0, -1);
+    for (int t = 0; t < tour_length; t++)
+    {
+        *(*(sparse_minima + 0) + t) = *(euler_tour + t);
+    }
+    for (int k = 1; (1 << k) <= tour_length; k++)
+    {
+        int *below = *(sparse_minima + k - 1);
+        int *level = *(sparse_minima + k);
+        for (int t = 0; t + (1 << k) <= tour_length; t++)
+        {
+            int a = *(below + t), b = *(below + t + (1 << (k - 1)));
+            *(level + t) = a < b ? a : b;
+        }
+    }
+    for (int s = 0; s < NAME_SLOTS; s++)
+    {
+        *(name_slots + s) = -1;
+    }
+    for (int p = 0; p < tree_size; p++)
+    {
+        char *name = tree_names + *(tree_name_offsets + p);
+        unsigned int s = name_hash(name, strlen(name)) % NAME_SLOTS;
+        while (*(name_slots + s) != -1)
+        {
+            s = (s + 1) % NAME_SLOTS;
+        }
+        *(name_slots + s) = p;
+    }
+}
+
+/**
+ * @brief  Make the compact copy of the synthesized tree.
+ * @details  This function assumes that build_taxonomy() has completed the
+ * tree, including any refinement.  The nodes are numbered in
+ * breadth-first order from the node adjacent to the first taxon (or from
+ * the first taxon if it has no neighbor), visiting the neighbors of each
+ * node in order, so that the nodes near each other in the tree are near
+ * each other in the arrays.  A node that is not connected to that one
+ * (there is none in a complete tree) is not included.  The names are
+ * copied into the arena, and each edge length is stored at both of its
+ * ends.  This costs O(N) in all.
+ */
+void compact_tree(void) {
+    tree_size = 0;
+    if (num_all_nodes == 0)
+    {
+        return;
+    }
+    for (int i = 0; i < num_all_nodes; i++)
+    {
+        *(tree_positions + i) = -1;
+    }
+    NODE *start = *(nodes->neighbors + 0) != NULL ? *(nodes->neighbors + 0) : nodes;
+    *(tree_nodes + tree_size) = start - nodes;
+    *(tree_positions + (start - nodes)) = tree_size++;
+    for (int p = 0; p < tree_size; p++)
+    {
+        NODE *node = nodes + *(tree_nodes + p);
+        for (int k = 0; k < 3; k++)
+        {
+            NODE *neighbor = *(node->neighbors + k);
+            *(*(tree_branches + p) + k) = 0.0;
+            if (neighbor == NULL)
+            {
+                *(*(tree_neighbors + p) + k) = -1;
+                continue;
+            }
+            int n = neighbor - nodes;
+            if (*(tree_positions + n) == -1)
+            {
+                *(tree_nodes + tree_size) = n;
+                *(tree_positions + n) = tree_size++;
+            }
+            *(*(tree_neighbors + p) + k) = *(tree_positions + n);
+        }
+    }
+    int offset = 0;
+    for (int p = 0; p < tree_size; p++)
+    {
+        char *name = (nodes + *(tree_nodes + p))->name;
+        size_t length = strlen(name);
+        *(tree_name_offsets + p) = offset;
+        memcpy(tree_names + offset, name, length + 1);
+        offset += length + 1;
+    }
+    set_branches();
+    index_tree();
+}
+
+/**
+ * @brief  The patristic distance between two nodes of the synthesized tree.
+ * @details  This is the length of the path between the nodes in the tree
+ * made by build_taxonomy(), which is the sum of their distances from the
+ * root less twice that of their lowest common ancestor, found in constant
+ * time from the index made by compact_tree().
+ *
+ * @param a  Index of the first node, which must be in the compact tree.
+ * @param b  Index of the second node, which must be in the compact tree.
+ * @return the length of the path between them, which can be negative
+ * when some branch lengths are.
+ */
+double patristic_distance(int a, int b) {
+    int p = *(tree_positions + a), q = *(tree_positions + b);
+    int from = *(first_visits + p), to = *(first_visits + q);
+    if (from > to)
+    {
+        int t = from;
+        from = to;
+        to = t;
+    }
+    int k = 31 - __builtin_clz(to - from + 1);
+    int x = *(*(sparse_minima + k) + from), y = *(*(sparse_minima + k) + to - (1 << k) + 1);
+    int ancestor = x < y ? x : y;
+    return *(root_distances + p) + *(root_distances + q) - 2 * *(root_distances + ancestor);
+}
+
+/*
+ * Returns the index of the node named by the first length characters of
+ * name, looked up in the table of names, or else given by its index as in
+ * the edge data, or -1 if there is no such node.
+ */
+static int find_node(char *name, size_t length)
+{
+    unsigned int s = name_hash(name, length) % NAME_SLOTS;
+    while (*(name_slots + s) != -1)
+    {
+        int p = *(name_slots + s);
+        char *other = tree_names + *(tree_name_offsets + p);
+        if (strncmp(other, name, length) == 0 && *(other + length) == '\0')
+        {
+            return *(tree_nodes + p);
+        }
+        s = (s + 1) % NAME_SLOTS;
+    }
+    if (length == 0 || strspn(name, "0123456789") < length || length > 3)
+    {
+        return -1;
+    }
+    int index = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        index = 10 * index + *(name + i) - '0';
+    }
+    return index < num_all_nodes ? index : -1;
+}
+
+/**
+ * @brief  Answer a batch of patristic distance queries.
+ * @details  This function assumes that a tree has been built by a prior
+ * successful invocation of build_taxonomy().  Each line of the input is
+ * a pair of nodes "a,b", each given by its name or by its index as in
+ * the edge data, and the line "a,b,d" is output for it, where d is the
+ * patristic distance between them, in the format of the edge data.  Empty
+ * lines are skipped.
+ *
+ * @param in  Stream from which to read the pairs of nodes.
+ * @param out  Stream to which to output the distances.
+ * @return 0 in case all of the queries are answered, otherwise -1 if
+ * any error occurred, after printing a one-line error message to stderr.
+ */
+int emit_patristic_queries(FILE *in, FILE *out) {
+    char line[2 * (INPUT_MAX + 1) + 2];
+    while (fgets(line, sizeof(line), in) != NULL)
+    {
+        size_t length = strcspn(line, "\r\n");
+        if (*(line + length) == '\0' && !feof(in))
+        {
+            fprintf(stderr, "Error: Query line exceeds input max!\n");
+            return -1;
+        }
+        *(line + length) = '\0';
+        if (length == 0)
+        {
+            continue;
+        }
+        size_t first = strcspn(line, ",");
+        if (*(line + first) == '\0' || strchr(line + first + 1, ',') != NULL)
+        {
+            fprintf(stderr, "Error: Query line is not a pair of nodes!\n");
+            return -1;
+        }
+        int a = find_node(line, first);
+        int b = find_node(line + first + 1, length - first - 1);
+        if (a == -1 || b == -1)
+        {
+            fprintf(stderr, "Error: Unknown node name in query!\n");
+            return -1;
+        }
+        if (*(tree_positions + a) == -1 || *(tree_positions + b) == -1)
+        {
+            fprintf(stderr, "Error: Query nodes are not connected in the tree!\n");
+            return -1;
+        }
+        fprintf(out, "%s,%.2lf\n", line, patristic_distance(a, b));
+    }
+    if (ferror(in))
+    {
+        fprintf(stderr, "Error: Failed to read queries!\n");
+        return -1;
+    }
+    return ferror(out) ? -1 : 0;
+}
+
+/*
+ * Rows of the patristic matrix computed together by the worker threads,
+ * before they are written: those of the taxa from block_start up to
+ * block_end, the next of which to compute is next_source.  Only these rows
+ * are held at any time.
+ */
+#define PATRISTIC_BLOCK 32
+static double patristic_rows[PATRISTIC_BLOCK][MAX_TAXA];
+static int block_start;
+static int block_end;
+static int next_source;
+
+/*
+ * Work of one thread computing rows of the patristic matrix: the sum of
+ * the squares of the differences from the input distances, and the
+ * largest of those differences, over the pairs above the diagonal in its
+ * rows.
+ */
+typedef struct patristic_work {
+    double squares;
+    double deviation;
+} PATRISTIC_WORK;
+
+/*
+ * Sets lengths[q] to the length of the path from position p to each
+ * position q of the compact tree, by one depth-first walk from p.
+ */
+static void path_lengths(int p, double *lengths)
+{
+    int stack[MAX_NODES];
+    int parents[MAX_NODES];
+    int depth = 0;
+    *(lengths + p) = 0.0;
+    *(parents + p) = -1;
+    *(stack + depth++) = p;
+    while (depth > 0)
+    {
+        int u = *(stack + --depth);
+        for (int k = 0; k < 3; k++)
+        {
+            int v = *(*(tree_neighbors + u) + k);
+            if (v == -1 || v == *(parents + u))
+            {
+                continue;
+            }
+            *(parents + v) = u;
+            *(lengths + v) = *(lengths + u) + *(*(tree_branches + u) + k);
+            *(stack + depth++) = v;
+        }
+    }
+}
+
+/*
+ * Thread start routine computing the patristic matrix: takes rows of the
+ * current block until none is left, each from one walk of the tree from
+ * its taxon, and compares them with the input distances.
+ */
+static void *patristic_thread(void *arg)
+{
+    PATRISTIC_WORK *work = arg;
+    double lengths[MAX_NODES];
+    int i;
+    while ((i = __atomic_fetch_add(&next_source, 1, __ATOMIC_RELAXED)) < block_end)
+    {
+        double *row = *(patristic_rows + i - block_start);
+        path_lengths(*(tree_positions + i), lengths);
+        for (int j = 0; j < num_taxa; j++)
+        {
+            double d = *(lengths + *(tree_positions + j));
+            *(row + j) = d;
+            if (j <= i)
+            {
+                continue;
+            }
+            double residual = d - *(*(distances + i) + j);
+            residual = residual < 0.0 ? -residual : residual;
+            work->squares += residual * residual;
+            if (residual > work->deviation)
+            {
+                work->deviation = residual;
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief  Emit the patristic distance matrix of the synthesized tree as CSV.
+ * @details  This function assumes that a tree has been built by a prior
+ * successful invocation of build_taxonomy().  The patristic distance
+ * between two taxa is the length of the path between them in the tree,
+ * and the matrix of them is output in the same CSV form as the program
+ * input, compressed if a level has been selected with -z.  Each row is
+ * computed by one walk of the tree from its taxon, and blocks of rows are
+ * computed by the worker threads given with -j and then written in order,
+ * so that only a block of the matrix is held at a time.  As the rows are
+ * computed, they are compared with the input distances, and the residual
+ * sum of squares and the largest deviation over the pairs of taxa are
+ * reported on the standard error once the matrix is written.
+ *
+ * @param out  Stream to which to output the patristic distance matrix.
+ * @return 0 in case the output is successfully emitted, otherwise -1
+ * if any error occurred.
+ */
+int emit_patristic_matrix(FILE *out) {
+    for (int i = 0; i < num_taxa; i++)
+    {
+        if (*(tree_positions + i) == -1)
+        {
+            fprintf(stderr, "Error: Tree does not connect all of the taxa!\n");
+            return -1;
+        }
+    }
+    WRITER *writer = writer_open(out, compression_level);
+    if (writer == NULL)
+    {
+        return -1;
+    }
+    for (int j = 0; j < num_taxa; j++)
+    {
+        writer_write(writer, ",", 1);
+        writer_write(writer, *(node_names + j), strlen(*(node_names + j)));
+    }
+    writer_write(writer, "\n", 1);
+    PATRISTIC_WORK work[PATRISTIC_BLOCK];
+    int threads = worker_threads();
+    if (threads > PATRISTIC_BLOCK)
+    {
+        threads = PATRISTIC_BLOCK;
+    }
+    for (int t = 0; t < threads; t++)
+    {
+        (work + t)->squares = 0.0;
+        (work + t)->deviation = 0.0;
+    }
+    for (block_start = 0; block_start < num_taxa; block_start = block_end)
+    {
+        block_end = block_start + PATRISTIC_BLOCK < num_taxa ? block_start + PATRISTIC_BLOCK : num_taxa;
+        next_source = block_start;
+        run_parallel(patristic_thread, work, sizeof(PATRISTIC_WORK), threads < block_end - block_start ? threads : block_end - block_start);
+        for (int i = block_start; i < block_end; i++)
+        {
+            double *row = *(patristic_rows + i - block_start);
+            writer_write(writer, *(node_names + i), strlen(*(node_names + i)));
+            for (int j = 0; j < num_taxa; j++)
+            {
+                writer_printf(writer, ",%.2lf", *(row + j));
+            }
+            writer_write(writer, "\n", 1);
+        }
+    }
+    double squares = 0.0, deviation = 0.0;
+    for (int t = 0; t < threads; t++)
+    {
+        squares += (work + t)->squares;
+        if ((work + t)->deviation > deviation)
+        {
+            deviation = (work + t)->deviation;
+        }
+    }
+    int result = writer_close(writer);
+    fprintf(stderr, "Patristic residual sum of squares: %.6g\n", squares);
+    fprintf(stderr, "Largest patristic deviation: %.6g\n", deviation);
+    return result;
+}
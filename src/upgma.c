@@ -0,0 +1,165 @@
+#include <stdlib.h>
+
+#include "global.h"
+#include "debug.h"
+
+/* Number of leaves in the cluster represented by each node. */
+static int cluster_sizes[MAX_NODES];
+
+/* Height of each node above the leaves (half the distance between the two clusters it joined). */
+static double heights[MAX_NODES];
+
+/*
+ * Nearest-neighbor cache: for each active node, the active node at the
+ * least distance from it (the one of smallest index in case of ties),
+ * and that distance.
+ */
+static int nearest[MAX_NODES];
+static double nearest_distances[MAX_NODES];
+
+/*
+ * Recomputes the nearest-neighbor cache entry of an active node by a scan of its row.
+ */
+static void find_nearest(int i)
+{
+    double *row = *(distances + i);
+    int best = -1;
+    for (int k = 0; k < num_active_nodes; k++)
+    {
+        int k_index = *(active_node_map + k);
+        if (k_index != i && (best == -1 || *(row + k_index) < *(row + best)))
+        {
+            best = k_index;
+        }
+    }
+    *(nearest + i) = best;
+    *(nearest_distances + i) = best == -1 ? 0.0 : *(row + best);
+}
+
+/**
+ * @brief  Initialize the UPGMA and WPGMA engines.
+ * @details  Each active node starts as a cluster of one leaf at height 0,
+ * and the nearest-neighbor cache is filled by a scan of every row.
+ * @return 0.
+ */
+int cluster_init(void) {
+    for (int i = 0; i < num_active_nodes; i++)
+    {
+        int i_index = *(active_node_map + i);
+        *(cluster_sizes + i_index) = 1;
+        *(heights + i_index) = 0.0;
+    }
+    for (int i = 0; i < num_active_nodes; i++)
+    {
+        find_nearest(*(active_node_map + i));
+    }
+    return 0;
+}
+
+/*
+ * Performs one UPGMA or WPGMA join.  The closest pair is found from the
+ * nearest-neighbor cache in O(N), rather than by a scan of all pairs.
+ * The distance from the new cluster u to another cluster k is the average
+ * of the distances from f and g, weighted by cluster size for UPGMA and
+ * unweighted for WPGMA.  Afterwards only the cache entries that pointed
+ * at f or g need a rescan of their rows; the others can only change to u.
+ */
+static int cluster_step(int weighted)
+{
+    int f = -1;
+    int g = -1;
+    double best = 0.0;
+    for (int i = 0; i < num_active_nodes; i++)
+    {
+        int i_index = *(active_node_map + i);
+        int j_index = *(nearest + i_index);
+        int low = i_index < j_index ? i_index : j_index;
+        int high = i_index < j_index ? j_index : i_index;
+        double d = *(nearest_distances + i_index);
+        if (f == -1 || BETTER_PAIR(d, low, high, best, f, g))
+        {
+            best = d;
+            f = low;
+            g = high;
+        }
+    }
+    int u = new_node();
+    if (u == -1)
+    {
+        return -1;
+    }
+    double *f_row = *(distances + f);
+    double *g_row = *(distances + g);
+    double height = *(f_row + g) / 2.0;
+    double f_branch = height - *(heights + f);
+    double g_branch = height - *(heights + g);
+    double f_weight = weighted ? 0.5 : (double)*(cluster_sizes + f) / (*(cluster_sizes + f) + *(cluster_sizes + g));
+    for (int k = 0; k < num_active_nodes; k++)
+    {
+        int k_index = *(active_node_map + k);
+        double value;
+        if (k_index == f)
+            value = f_branch;
+        else if (k_index == g)
+            value = g_branch;
+        else
+            value = f_weight * *(f_row + k_index) + (1 - f_weight) * *(g_row + k_index);
+        *(*(distances + u) + k_index) = value;
+        *(*(distances + k_index) + u) = value;
+    }
+    *(cluster_sizes + u) = *(cluster_sizes + f) + *(cluster_sizes + g);
+    *(heights + u) = height;
+    join_nodes(f, g, u, f_branch, g_branch);
+
+    //! Nearest-neighbor cache update
+    double *u_row = *(distances + u);
+    for (int k = 0; k < num_active_nodes; k++)
+    {
+        int k_index = *(active_node_map + k);
+        if (k_index == u)
+        {
+            continue;
+        }
+        if (*(nearest + k_index) == f || *(nearest + k_index) == g)
+        {
+            find_nearest(k_index);
+        }
+        else if (*(u_row + k_index) < *(nearest_distances + k_index))
+        {
+            *(nearest + k_index) = u;
+            *(nearest_distances + k_index) = *(u_row + k_index);
+        }
+    }
+    find_nearest(u);
+    return 0;
+}
+
+/**
+ * @brief  Perform one UPGMA join (average linkage weighted by cluster size).
+ * @return 0 if the join was performed, otherwise -1.
+ */
+int upgma_step(void) {
+    return cluster_step(0);
+}
+
+/**
+ * @brief  Perform one WPGMA join (simple average of the two clusters' distances).
+ * @return 0 if the join was performed, otherwise -1.
+ */
+int wpgma_step(void) {
+    return cluster_step(1);
+}
+
+/**
+ * @brief  Length of the final edge of a UPGMA or WPGMA tree.
+ * @details  The root of the clustering would lie midway between the last
+ * two clusters; since the tree is output unrooted, the two edges to the
+ * root are merged into one.
+ *
+ * @param a  Index of one of the last two active nodes.
+ * @param b  Index of the other.
+ * @return the length of the edge between them.
+ */
+double cluster_last_edge(int a, int b) {
+    return *(*(distances + a) + b) - *(heights + a) - *(heights + b);
+}
@@ -1,8 +1,17 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "global.h"
 #include "debug.h"
 
+/*
+ * Checks whether the argument string is exactly the flag "-<c>".
+ */
+static int is_flag(char *arg, char c)
+{
+    return arg != NULL && *arg == '-' && *(arg + 1) == c && *(arg + 2) == '\0';
+}
+
 /**
  * @brief Validates command line arguments passed to the program.
  * @details This function will validate all the arguments passed to the
@@ -12,6 +21,11 @@
  * accessible elsewhere in the program.  For details of the required
  * encoding, see the assignment handout.
  *
+ * The -E, -N and -M options each take a file name and may be combined
+ * with each other and with one of -m or -n, so that several outputs can
+ * be produced from a single run of the tree building algorithm.  An output
+ * may not be requested both on the standard output and in a file.
+ *
  * @param argc The number of arguments passed to the program from the CLI.
  * @param argv The argument strings passed to the program from the CLI.
  * @return 0 if validation succeeds and -1 if validation fails.
@@ -20,6 +34,25 @@
  */
 int validargs(int argc, char **argv)
 {
+    global_options = 0;
+    outlier_name = NULL;
+    compression_level = 0;
+    matrix_rows = NULL;
+    matrix_columns = NULL;
+    engine_name = NULL;
+    num_threads = 0;
+    random_seed = 0;
+    refinement = REFINE_NONE;
+    num_clusters = 0;
+    memory_budget = 0;
+    time_budget = 0;
+    input_format = INPUT_CSV;
+    distance_model = MODEL_P;
+    kmer_size = 21;
+    sketch_size = 1000;
+    sketch_cache = NULL;
+    row_cache_size = 0;
+    query_filename = NULL;
     // No arguments / no flags check (progname, NULL)
     if (argc <= 1) {
         return 0;
@@ -29,38 +62,422 @@ int validargs(int argc, char **argv)
     char **arg_1 = (argv + 1);
 
     // Checks if the first argument is "-h", otherwise it does nothing
-    if (arg_1 != NULL && **arg_1 == '-' && *(*(arg_1) + 1) == 'h' && *(*(arg_1) + 2) == '\0') 
+    if (is_flag(*arg_1, 'h'))
     {
         global_options = HELP_OPTION;
         return 0;
-    } 
-    else if (arg_1 != NULL && **arg_1 == '-' && *(*(arg_1) + 1) == 'm' && *(*(arg_1) + 2) == '\0') 
+    }
+    for (char **arg = arg_1; *arg != NULL; arg++)
     {
-        // Checks for argument -m
-        global_options = MATRIX_OPTION;
-        if (*(arg_1 + 1) != NULL) {
-            return -1;
+        if (is_flag(*arg, 'm'))
+        {
+            // -m and -n both write to the standard output, so only one is allowed
+            if (global_options & (MATRIX_OPTION | NEWICK_OPTION | QUERY_OPTION | PATRISTIC_OPTION))
+            {
+                return -1;
+            }
+            global_options |= MATRIX_OPTION;
+            if (global_options & MATRIX_FILE_OPTION)
+            {
+                return -1;
+            }
         }
-        return 0;
-    } 
-    else if (arg_1 != NULL && **arg_1 == '-' && *(*(arg_1) + 1) == 'n' && *(*(arg_1) + 2) == '\0') 
-    {
-        // Checks for argument -n
-        global_options = NEWICK_OPTION;
-        if (*(arg_1 + 1) == NULL) {
-            // no optional -o flag
-            return 0;
-        } 
-        else if (*(*(arg_1 + 1)) == '-' && *(*(arg_1 + 1) + 1) == 'o' && *(*(arg_1 + 1) + 2) == '\0') 
+        else if (is_flag(*arg, 'n'))
+        {
+            if (global_options & (MATRIX_OPTION | NEWICK_OPTION | QUERY_OPTION | PATRISTIC_OPTION))
+            {
+                return -1;
+            }
+            global_options |= NEWICK_OPTION;
+            if (global_options & NEWICK_FILE_OPTION)
+            {
+                return -1;
+            }
+        }
+        else if (is_flag(*arg, 'o'))
+        {
+            // -o is only permitted after a Newick output has been requested
+            if (!(global_options & (NEWICK_OPTION | NEWICK_FILE_OPTION)) || outlier_name != NULL || *(arg + 1) == NULL)
+            {
+                return -1;
+            }
+            arg++;
+            outlier_name = *arg;
+        }
+        else if (is_flag(*arg, 'E') || is_flag(*arg, 'N') || is_flag(*arg, 'M'))
+        {
+            // file outputs, each taking a file name and given at most once
+            long option = is_flag(*arg, 'E') ? EDGES_FILE_OPTION : is_flag(*arg, 'N') ? NEWICK_FILE_OPTION : MATRIX_FILE_OPTION;
+            if ((global_options & option) || *(arg + 1) == NULL)
+            {
+                return -1;
+            }
+            // the same output cannot also be written to the standard output
+            if ((option == NEWICK_FILE_OPTION && (global_options & NEWICK_OPTION)) || (option == MATRIX_FILE_OPTION && (global_options & MATRIX_OPTION)))
+            {
+                return -1;
+            }
+            arg++;
+            if (option == EDGES_FILE_OPTION)
+                edges_filename = *arg;
+            else if (option == NEWICK_FILE_OPTION)
+                newick_filename = *arg;
+            else
+                matrix_filename = *arg;
+            global_options |= option;
+        }
+        else if (is_flag(*arg, 'z'))
+        {
+            // compression level is a single digit from 1 to 9
+            char *level = *(arg + 1);
+            if ((global_options & COMPRESS_OPTION) || level == NULL || *level < '1' || *level > '9' || *(level + 1) != '\0')
+            {
+                return -1;
+            }
+            arg++;
+            compression_level = *level - '0';
+            global_options |= COMPRESS_OPTION;
+        }
+        else if (is_flag(*arg, 't'))
+        {
+            if (global_options & TRIANGLE_OPTION)
+            {
+                return -1;
+            }
+            global_options |= TRIANGLE_OPTION;
+        }
+        else if (is_flag(*arg, 'r') || is_flag(*arg, 'c'))
+        {
+            // row or column subset, given as a nonempty list of names
+            long option = is_flag(*arg, 'r') ? ROWS_OPTION : COLUMNS_OPTION;
+            if ((global_options & option) || *(arg + 1) == NULL || **(arg + 1) == '\0')
+            {
+                return -1;
+            }
+            arg++;
+            if (option == ROWS_OPTION)
+                matrix_rows = *arg;
+            else
+                matrix_columns = *arg;
+            global_options |= option;
+        }
+        else if (is_flag(*arg, 's'))
+        {
+            char *end_pointer;
+            if ((global_options & SPARSE_OPTION) || *(arg + 1) == NULL)
+            {
+                return -1;
+            }
+            arg++;
+            matrix_cutoff = strtod(*arg, &end_pointer);
+            if (end_pointer == *arg || *end_pointer != '\0')
+            {
+                return -1;
+            }
+            global_options |= SPARSE_OPTION;
+        }
+        else if (is_flag(*arg, 'e'))
+        {
+            if ((global_options & ENGINE_OPTION) || *(arg + 1) == NULL || find_engine(*(arg + 1)) == NULL)
+            {
+                return -1;
+            }
+            arg++;
+            engine_name = *arg;
+            global_options |= ENGINE_OPTION;
+        }
+        else if (is_flag(*arg, 'j'))
+        {
+            char *end_pointer;
+            if ((global_options & THREADS_OPTION) || *(arg + 1) == NULL)
+            {
+                return -1;
+            }
+            arg++;
+            long threads = strtol(*arg, &end_pointer, 10);
+            if (end_pointer == *arg || *end_pointer != '\0' || threads < 1 || threads > MAX_NODES)
+            {
+                return -1;
+            }
+            num_threads = threads;
+            global_options |= THREADS_OPTION;
+        }
+        else if (is_flag(*arg, 'R'))
+        {
+            char *end_pointer;
+            if ((global_options & SEED_OPTION) || *(arg + 1) == NULL || **(arg + 1) < '0' || **(arg + 1) > '9')
+            {
+                return -1;
+            }
+            arg++;
+            random_seed = strtoul(*arg, &end_pointer, 10);
+            if (*end_pointer != '\0' || random_seed == 0)
+            {
+                return -1;
+            }
+            global_options |= SEED_OPTION;
+        }
+        else if (is_flag(*arg, 'b'))
+        {
+            if ((global_options & REFINE_OPTION) || *(arg + 1) == NULL)
+            {
+                return -1;
+            }
+            arg++;
+            if (strcmp(*arg, "nni") == 0)
+                refinement = REFINE_NNI;
+            else if (strcmp(*arg, "spr") == 0)
+                refinement = REFINE_SPR;
+            else
+                return -1;
+            global_options |= REFINE_OPTION;
+        }
+        else if (is_flag(*arg, 'k') || is_flag(*arg, 'l'))
+        {
+            // a flat clustering is given either by a number of clusters or by a cut distance
+            char *end_pointer;
+            if ((global_options & (CLUSTERS_OPTION | THRESHOLD_OPTION)) || *(arg + 1) == NULL)
+            {
+                return -1;
+            }
+            arg++;
+            if (is_flag(*(arg - 1), 'k'))
+            {
+                long clusters = strtol(*arg, &end_pointer, 10);
+                if (end_pointer == *arg || *end_pointer != '\0' || clusters < 1 || clusters > MAX_TAXA)
+                {
+                    return -1;
+                }
+                num_clusters = clusters;
+                global_options |= CLUSTERS_OPTION;
+            }
+            else
+            {
+                cluster_threshold = strtod(*arg, &end_pointer);
+                if (end_pointer == *arg || *end_pointer != '\0')
+                {
+                    return -1;
+                }
+                global_options |= THRESHOLD_OPTION;
+            }
+        }
+        else if (is_flag(*arg, 'L'))
         {
-            // optional -o flag is present
-            if (*(arg_1 + 2) != NULL && *(arg_1 + 3) == NULL) 
+            char *end_pointer;
+            if ((global_options & BUDGET_OPTION) || *(arg + 1) == NULL)
             {
-                outlier_name = *(arg_1 + 2);
-                return 0;
+                return -1;
             }
+            arg++;
+            long budget = strtol(*arg, &end_pointer, 10);
+            if (end_pointer == *arg || *end_pointer != '\0' || budget < 1)
+            {
+                return -1;
+            }
+            memory_budget = budget;
+            global_options |= BUDGET_OPTION;
+        }
+        else if (is_flag(*arg, 'w'))
+        {
+            char *end_pointer;
+            if ((global_options & DEADLINE_OPTION) || *(arg + 1) == NULL)
+            {
+                return -1;
+            }
+            arg++;
+            long budget = strtol(*arg, &end_pointer, 10);
+            if (end_pointer == *arg || *end_pointer != '\0' || budget < 1)
+            {
+                return -1;
+            }
+            time_budget = budget;
+            global_options |= DEADLINE_OPTION;
+        }
+        else if (is_flag(*arg, 'i'))
+        {
+            if ((global_options & INPUT_OPTION) || *(arg + 1) == NULL)
+            {
+                return -1;
+            }
+            arg++;
+            if (strcmp(*arg, "csv") == 0)
+                input_format = INPUT_CSV;
+            else if (strcmp(*arg, "fasta") == 0)
+                input_format = INPUT_FASTA;
+            else if (strcmp(*arg, "genomes") == 0)
+                input_format = INPUT_GENOMES;
+            else if (strcmp(*arg, "protein") == 0)
+                input_format = INPUT_PROTEIN;
+            else if (strcmp(*arg, "vcf") == 0)
+                input_format = INPUT_VCF;
+            else
+                return -1;
+            global_options |= INPUT_OPTION;
+        }
+        else if (is_flag(*arg, 'd'))
+        {
+            if ((global_options & MODEL_OPTION) || *(arg + 1) == NULL)
+            {
+                return -1;
+            }
+            arg++;
+            if (strcmp(*arg, "jc69") == 0)
+                distance_model = MODEL_JC69;
+            else if (strcmp(*arg, "k2p") == 0)
+                distance_model = MODEL_K2P;
+            else if (strcmp(*arg, "tn93") == 0)
+                distance_model = MODEL_TN93;
+            else if (strcmp(*arg, "poisson") == 0)
+                distance_model = MODEL_POISSON;
+            else if (strcmp(*arg, "kimura") == 0)
+                distance_model = MODEL_KIMURA;
+            else
+                return -1;
+            global_options |= MODEL_OPTION;
+        }
+        else if (is_flag(*arg, 'K') || is_flag(*arg, 'S'))
+        {
+            char *end_pointer;
+            int option = is_flag(*arg, 'K') ? KMER_OPTION : SKETCH_OPTION;
+            if ((global_options & option) || *(arg + 1) == NULL)
+            {
+                return -1;
+            }
+            arg++;
+            long size = strtol(*arg, &end_pointer, 10);
+            if (end_pointer == *arg || *end_pointer != '\0' || size < 1 || size > (option == KMER_OPTION ? 32 : MAX_SKETCH))
+            {
+                return -1;
+            }
+            if (option == KMER_OPTION)
+                kmer_size = size;
+            else
+                sketch_size = size;
+            global_options |= option;
+        }
+        else if (is_flag(*arg, 'C'))
+        {
+            if ((global_options & CACHE_OPTION) || *(arg + 1) == NULL)
+            {
+                return -1;
+            }
+            sketch_cache = *++arg;
+            global_options |= CACHE_OPTION;
+        }
+        else if (is_flag(*arg, 'F'))
+        {
+            char *end_pointer;
+            if ((global_options & ROW_CACHE_OPTION) || *(arg + 1) == NULL)
+            {
+                return -1;
+            }
+            arg++;
+            long rows = strtol(*arg, &end_pointer, 10);
+            if (end_pointer == *arg || *end_pointer != '\0' || rows < 1 || rows > MAX_TAXA)
+            {
+                return -1;
+            }
+            row_cache_size = rows;
+            global_options |= ROW_CACHE_OPTION;
+        }
+        else if (is_flag(*arg, 'q'))
+        {
+            // the answers take the standard output, like -m and -n
+            if ((global_options & (QUERY_OPTION | MATRIX_OPTION | NEWICK_OPTION | PATRISTIC_OPTION)) || *(arg + 1) == NULL)
+            {
+                return -1;
+            }
+            query_filename = *++arg;
+            global_options |= QUERY_OPTION;
+        }
+        else if (is_flag(*arg, 'p'))
+        {
+            if (global_options & (PATRISTIC_OPTION | MATRIX_OPTION | NEWICK_OPTION | QUERY_OPTION))
+            {
+                return -1;
+            }
+            global_options |= PATRISTIC_OPTION;
+        }
+        else if (is_flag(*arg, 'u'))
+        {
+            global_options |= COLLAPSE_OPTION;
+        }
+        else if (is_flag(*arg, 'D'))
+        {
+            global_options |= DRIFT_OPTION;
+        }
+        else if (is_flag(*arg, 'V'))
+        {
+            global_options |= VERIFY_OPTION;
+        }
+        else
+        {
+            return -1;
+        }
+    }
+    // the seed only applies to the relaxed engine
+    if ((global_options & SEED_OPTION) && (engine_name == NULL || strcmp(engine_name, "rnj") != 0))
+    {
+        return -1;
+    }
+    // the flat clusters come from the spanning tree of the single-linkage engine
+    if ((global_options & (CLUSTERS_OPTION | THRESHOLD_OPTION)) && (engine_name == NULL || strcmp(engine_name, "single") != 0))
+    {
+        return -1;
+    }
+    // the models correct distances computed from an alignment of their kind of sequences
+    if ((global_options & MODEL_OPTION)
+        && (distance_model >= MODEL_POISSON ? input_format != INPUT_PROTEIN : input_format != INPUT_FASTA))
+    {
+        return -1;
+    }
+    // the sketches are made from genomes
+    if ((global_options & (KMER_OPTION | SKETCH_OPTION | CACHE_OPTION)) && input_format != INPUT_GENOMES)
+    {
+        return -1;
+    }
+    // the memory budget sizes the subproblems of the divide-and-conquer engine
+    if ((global_options & BUDGET_OPTION) && (engine_name == NULL || strcmp(engine_name, "dc") != 0))
+    {
+        return -1;
+    }
+    // the matrix-free engine computes the distances from the sequences, and never has them all
+    if (engine_name != NULL && strcmp(engine_name, "nj-lazy") == 0)
+    {
+        if ((input_format != INPUT_FASTA && input_format != INPUT_PROTEIN)
+            || (global_options & (MATRIX_OPTION | MATRIX_FILE_OPTION | PATRISTIC_OPTION | COLLAPSE_OPTION | REFINE_OPTION | DEADLINE_OPTION | DRIFT_OPTION)))
+        {
+            return -1;
         }
+        if (!(global_options & ROW_CACHE_OPTION))
+        {
+            row_cache_size = ROW_CACHE_DEFAULT;
+        }
+    }
+    else if (global_options & ROW_CACHE_OPTION)
+    {
+        return -1;
+    }
+    // the spanning tree is built on the representatives only
+    if ((global_options & COLLAPSE_OPTION) && (global_options & (CLUSTERS_OPTION | THRESHOLD_OPTION)))
+    {
+        return -1;
+    }
+    // verification replaces all of the outputs, and checks every exact engine
+    if ((global_options & VERIFY_OPTION) && (global_options & ~(VERIFY_OPTION | THREADS_OPTION)))
+    {
+        return -1;
+    }
+    // compression also applies to the patristic matrix
+    if ((global_options & COMPRESS_OPTION) && !(global_options & (MATRIX_OPTION | MATRIX_FILE_OPTION | PATRISTIC_OPTION)))
+    {
+        return -1;
+    }
+    // the partial output modes only apply to the matrix output
+    if ((global_options & (TRIANGLE_OPTION | ROWS_OPTION | COLUMNS_OPTION | SPARSE_OPTION)) && !(global_options & (MATRIX_OPTION | MATRIX_FILE_OPTION)))
+    {
+        return -1;
     }
-    return -1;
+    return 0;
     abort();
 }
@@ -0,0 +1,417 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "global.h"
+#include "debug.h"
+
+/* Maximum number of variants in a genotype table, and of 64-bit words to hold one bit per variant. */
+#define MAX_VARIANTS (1 << 20)
+#define VARIANT_WORDS (MAX_VARIANTS / 64)
+
+/*
+ * The genotypes of each sample, packed one bit per variant into two bit
+ * planes: bit v of the carrier plane is set if the sample carries the
+ * alternate allele at variant v, and bit v of the homozygous plane if it
+ * carries two copies.  So the number of alternate alleles is the sum of
+ * the bits, and the difference between the numbers of two samples is the
+ * number of planes in which their bits differ.  Bit v of the called plane
+ * is set if the genotype of the sample at variant v is known.
+ */
+static uint64_t carrier_bits[MAX_TAXA][VARIANT_WORDS];
+static uint64_t homozygous_bits[MAX_TAXA][VARIANT_WORDS];
+static uint64_t called_bits[MAX_TAXA][VARIANT_WORDS];
+
+/* Number of variants read. */
+static long num_variants;
+
+/* Numbers of alternate alleles of the samples at the variant being read, or -1 if not called. */
+static int dosages[MAX_TAXA];
+
+/*
+ * Work of one thread computing distances: the rows of the matrix are
+ * taken in turn from next_row, and the thread reports whether it found a
+ * pair of samples with no variant called in both.
+ */
+typedef struct sharing_work {
+    int uncalled;
+} SHARING_WORK;
+
+/* The next row of the matrix to fill. */
+static int next_row;
+
+/* Columns of the table before the first sample. */
+#define FIXED_COLUMNS 9
+
+/*
+ * Skips the rest of the current line.  Returns the character that ended
+ * it, '\n' or EOF.
+ */
+static int skip_line(FILE *in)
+{
+    int c;
+    while ((c = fgetc(in)) != EOF && c != '\n')
+        ;
+    return c;
+}
+
+/*
+ * Reads the header line of the table, after its '#', whose columns
+ * beyond the fixed ones name the samples.  Returns -1 if a name is too
+ * long or there are too many samples.
+ */
+static int read_samples(FILE *in)
+{
+    int column = 0, length = 0, c;
+    num_taxa = 0;
+    while ((c = fgetc(in)) != EOF && c != '\n')
+    {
+        if (c == '\r')
+        {
+            continue;
+        }
+        if (c == '\t')
+        {
+            column++;
+            length = 0;
+            continue;
+        }
+        if (column < FIXED_COLUMNS)
+        {
+            continue;
+        }
+        if (length == 0)
+        {
+            if (column - FIXED_COLUMNS + 1 > MAX_TAXA)
+            {
+                fprintf(stderr, "Error: Number of taxa exceeds taxa max!\n");
+                return -1;
+            }
+            num_taxa = column - FIXED_COLUMNS + 1;
+        }
+        if (length == INPUT_MAX)
+        {
+            fprintf(stderr, "Error: Input field character length exceeds input max!\n");
+            return -1;
+        }
+        *(*(node_names + num_taxa - 1) + length++) = c;
+        *(*(node_names + num_taxa - 1) + length) = '\0';
+    }
+    return 0;
+}
+
+/*
+ * Reads the genotype of a sample, the first subfield of its column, into
+ * *dosage: the number of alternate alleles, with a haploid call counted
+ * as two, or -1 if an allele is not called.  Sets *biallelic to 0 if an
+ * allele other than the first alternate one is called.  Returns the
+ * character after the column, or 0 if the genotype is malformed.
+ */
+static int read_genotype(FILE *in, int *dosage, int *biallelic)
+{
+    int alleles = 0, alternate = 0, missing = 0, allele = -1, c;
+    while ((c = fgetc(in)) != EOF && c != '\t' && c != '\n' && c != ':' && c != '\r')
+    {
+        if (c >= '0' && c <= '9')
+        {
+            allele = (allele == -1 ? 0 : 10 * allele) + c - '0';
+            continue;
+        }
+        if (c == '.' && allele == -1)
+        {
+            missing = 1;
+            alleles++;
+            continue;
+        }
+        if ((c != '/' && c != '|') || (allele == -1 && !missing))
+        {
+            return 0;
+        }
+        if (allele != -1)
+        {
+            alleles++;
+            alternate += allele > 0;
+            *biallelic = *biallelic && allele < 2;
+            allele = -1;
+        }
+    }
+    if (allele != -1)
+    {
+        alleles++;
+        alternate += allele > 0;
+        *biallelic = *biallelic && allele < 2;
+    }
+    if (alleles == 0 || alleles > 2)
+    {
+        return 0;
+    }
+    *dosage = missing ? -1 : alleles == 1 ? 2 * alternate : alternate;
+    while (c == ':' || c == '\r')
+    {
+        // the other subfields of the column
+        while ((c = fgetc(in)) != EOF && c != '\t' && c != '\n')
+            ;
+    }
+    return c == EOF ? '\n' : c;
+}
+
+/*
+ * Appends the genotypes of all of the samples at the variant just read
+ * to their bit planes.
+ */
+static void append_variant(void)
+{
+    long v = num_variants++;
+    uint64_t bit = (uint64_t)1 << (v % 64);
+    for (int i = 0; i < num_taxa; i++)
+    {
+        int dosage = *(dosages + i);
+        if (dosage == -1)
+        {
+            continue;
+        }
+        *(*(called_bits + i) + v / 64) |= bit;
+        if (dosage >= 1)
+            *(*(carrier_bits + i) + v / 64) |= bit;
+        if (dosage == 2)
+            *(*(homozygous_bits + i) + v / 64) |= bit;
+    }
+}
+
+/*
+ * Returns the allele-sharing distance between samples i and j: the
+ * number of alleles by which their genotypes differ, over twice the
+ * number of variants called in both, which is 1 minus their mean identity
+ * by state.  Returns -1 if no variant is called in both.
+ */
+static double sharing_distance(int i, int j)
+{
+    uint64_t *i_called = *(called_bits + i), *j_called = *(called_bits + j);
+    uint64_t *i_carrier = *(carrier_bits + i), *j_carrier = *(carrier_bits + j);
+    uint64_t *i_homozygous = *(homozygous_bits + i), *j_homozygous = *(homozygous_bits + j);
+    long compared = 0, differences = 0;
+    for (long w = 0; w < (num_variants + 63) / 64; w++)
+    {
+        uint64_t both = *(i_called + w) & *(j_called + w);
+        compared += __builtin_popcountll(both);
+        differences += __builtin_popcountll((*(i_carrier + w) ^ *(j_carrier + w)) & both)
+            + __builtin_popcountll((*(i_homozygous + w) ^ *(j_homozygous + w)) & both);
+    }
+    if (compared == 0)
+    {
+        return -1.0;
+    }
+    return differences / (2.0 * compared);
+}
+
+/*
+ * Thread start routine computing distances: takes rows of the upper
+ * triangle of the matrix until none is left, writing the distances of
+ * each row straight into both triangles.
+ */
+static void *sharing_thread(void *arg)
+{
+    SHARING_WORK *work = arg;
+    int i;
+    while ((i = __atomic_fetch_add(&next_row, 1, __ATOMIC_RELAXED)) < num_taxa)
+    {
+        for (int j = i + 1; j < num_taxa; j++)
+        {
+            double d = sharing_distance(i, j);
+            if (d < 0.0)
+            {
+                work->uncalled = 1;
+                d = 0.0;
+            }
+            *(*(distances + i) + j) = d;
+            *(*(distances + j) + i) = d;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief  Read a table of biallelic genotypes in VCF format and initialize
+ * data structures.
+ * @details  This function is used instead of read_distance_data() when
+ * the -i vcf option is given, and sets the same global variables and data
+ * structures.  Lines beginning with "##" are skipped, and the line
+ * beginning with "#CHROM" names the samples, which are the taxa, in its
+ * columns after FORMAT.  On each following line, the genotype of a sample
+ * is the first subfield of its column (GT), such as 0/1, 1|1 or ./.;
+ * variants with an allele other than the reference and the first
+ * alternate one are skipped, and a count of them is reported on the
+ * standard error.  The genotypes are packed into bit planes, and the
+ * distance between two samples is the allele-sharing distance, 1 minus
+ * their identity by state, counted with popcount over the variants called
+ * in both.  The rows of the matrix are spread over the worker threads
+ * given with -j, and the distances are stored straight into the distances
+ * matrix.
+ *
+ * @param in  The input stream from which to read the genotypes.
+ * @return 0 in case the genotypes were successfully read, otherwise -1
+ * if there was any error, after printing a one-line error message to
+ * stderr.
+ */
+int read_genotype_data(FILE *in) {
+    int c;
+    int have_samples = 0;
+    int skipped = 0;
+    num_taxa = 0;
+    num_variants = 0;
+    while ((c = fgetc(in)) != EOF)
+    {
+        if (c == '\n')
+        {
+            continue;
+        }
+        if (c == '#')
+        {
+            if ((c = fgetc(in)) == '#' || have_samples)
+            {
+                if (c != '\n')
+                    skip_line(in);
+                continue;
+            }
+            ungetc(c, in);
+            if (read_samples(in) == -1)
+            {
+                return -1;
+            }
+            if (num_taxa == 0)
+            {
+                fprintf(stderr, "Error: No samples in genotype table!\n");
+                return -1;
+            }
+            for (int i = 0; i < num_taxa; i++)
+            {
+                memset(*(carrier_bits + i), 0, sizeof(*carrier_bits));
+                memset(*(homozygous_bits + i), 0, sizeof(*homozygous_bits));
+                memset(*(called_bits + i), 0, sizeof(*called_bits));
+            }
+            have_samples = 1;
+            continue;
+        }
+        if (!have_samples)
+        {
+            fprintf(stderr, "Error: Genotypes before the header line!\n");
+            return -1;
+        }
+
+        //! A variant: skip the fixed columns, checking ALT and FORMAT
+        int biallelic = 1;
+        int column = 0;
+        int format_position = 0, format_gt = 1;
+        while (column < FIXED_COLUMNS && c != EOF && c != '\n')
+        {
+            if (c == '\t')
+            {
+                column++;
+            }
+            else if (column == 4 && c == ',')
+            {
+                biallelic = 0;
+            }
+            else if (column == 8 && format_position >= 0)
+            {
+                // the genotype must be the first subfield
+                if (c == ':')
+                {
+                    format_gt = format_gt && format_position == 2;
+                    format_position = -1;
+                }
+                else
+                {
+                    format_gt = format_gt && format_position < 2 && c == "GT"[format_position];
+                    format_position++;
+                }
+            }
+            if (column < FIXED_COLUMNS)
+            {
+                c = fgetc(in);
+            }
+        }
+        if (column < FIXED_COLUMNS || !format_gt || format_position == 0 || format_position == 1)
+        {
+            fprintf(stderr, "Error: Genotype line without GT genotypes!\n");
+            return -1;
+        }
+        int sample = 0;
+        c = '\t';
+        while (c == '\t')
+        {
+            if (sample == num_taxa)
+            {
+                fprintf(stderr, "Error: Genotype line has the wrong number of samples!\n");
+                return -1;
+            }
+            c = read_genotype(in, dosages + sample, &biallelic);
+            if (c == 0)
+            {
+                fprintf(stderr, "Error: Invalid genotype!\n");
+                return -1;
+            }
+            sample++;
+        }
+        if (sample != num_taxa)
+        {
+            fprintf(stderr, "Error: Genotype line has the wrong number of samples!\n");
+            return -1;
+        }
+        if (!biallelic)
+        {
+            skipped++;
+            continue;
+        }
+        if (num_variants == MAX_VARIANTS)
+        {
+            fprintf(stderr, "Error: Number of variants exceeds variants max!\n");
+            return -1;
+        }
+        append_variant();
+    }
+    if (!have_samples)
+    {
+        fprintf(stderr, "Error: No samples in genotype table!\n");
+        return -1;
+    }
+    if (skipped > 0)
+    {
+        fprintf(stderr, "Variants skipped, not biallelic: %d\n", skipped);
+    }
+
+    //! Fill in the distances matrix, a row at a time, spread over the worker threads
+    SHARING_WORK work[MAX_NODES];
+    int threads = worker_threads();
+    if (threads > num_taxa)
+    {
+        threads = num_taxa;
+    }
+    for (int t = 0; t < threads; t++)
+    {
+        (work + t)->uncalled = 0;
+    }
+    next_row = 0;
+    run_parallel(sharing_thread, work, sizeof(SHARING_WORK), threads);
+    for (int t = 0; t < threads; t++)
+    {
+        if ((work + t)->uncalled)
+        {
+            fprintf(stderr, "Error: Samples have no variants called in both!\n");
+            return -1;
+        }
+    }
+    for (int i = 0; i < num_taxa; i++)
+    {
+        (nodes + i)->name = *(node_names + i);
+        *(active_node_map + i) = i;
+        *(*(distances + i) + i) = 0.0;
+    }
+    num_all_nodes = num_taxa;
+    num_active_nodes = num_taxa;
+    if (global_options & COLLAPSE_OPTION)
+    {
+        collapse_duplicates();
+    }
+    return 0;
+}
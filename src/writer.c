@@ -0,0 +1,272 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "global.h"
+#include "debug.h"
+
+/* Number of buffers circulating between the formatter and the compressor. */
+#define WRITER_BUFFERS 4
+
+/* Size of each buffer handed from the formatter to the compressor. */
+#define WRITER_BUFFER_SIZE (1 << 16)
+
+/*
+ * State of a buffered output stream.  The formatter fills the buffer
+ * "current" and then queues it; with compression enabled a background
+ * thread takes queued buffers in order, deflates them and writes the
+ * compressed data, while the formatter goes on filling the next free
+ * buffer.  Without compression, full buffers are written directly.
+ */
+struct writer {
+    FILE *out;
+    int level;
+    int error;
+    char buffers[WRITER_BUFFERS][WRITER_BUFFER_SIZE];
+    size_t lengths[WRITER_BUFFERS];
+    int current;
+    // ring of queued buffers: [head, head + queued) waiting to be compressed
+    int head;
+    int queued;
+    int closing;
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    pthread_cond_t drained;
+    pthread_t thread;
+    z_stream stream;
+    unsigned char deflated[WRITER_BUFFER_SIZE];
+};
+
+/*
+ * Deflates the given data into the gzip stream, writing out the compressed
+ * output.  With flush equal to Z_FINISH, the gzip trailer is also written.
+ */
+static int writer_deflate(WRITER *writer, char *data, size_t length, int flush)
+{
+    z_stream *stream = &writer->stream;
+    stream->next_in = (unsigned char *)data;
+    stream->avail_in = length;
+    do
+    {
+        stream->next_out = writer->deflated;
+        stream->avail_out = WRITER_BUFFER_SIZE;
+        if (deflate(stream, flush) == Z_STREAM_ERROR)
+        {
+            return -1;
+        }
+        size_t produced = WRITER_BUFFER_SIZE - stream->avail_out;
+        if (produced > 0 && fwrite(writer->deflated, 1, produced, writer->out) != produced)
+        {
+            return -1;
+        }
+    } while (stream->avail_out == 0);
+    return 0;
+}
+
+/*
+ * Thread start routine for the compressor, which deflates queued buffers
+ * in order until the writer is closed and the queue is empty.
+ */
+static void *writer_thread(void *arg)
+{
+    WRITER *writer = arg;
+    pthread_mutex_lock(&writer->lock);
+    while (1)
+    {
+        while (writer->queued == 0 && !writer->closing)
+        {
+            pthread_cond_wait(&writer->filled, &writer->lock);
+        }
+        if (writer->queued == 0)
+        {
+            break;
+        }
+        int index = writer->head;
+        pthread_mutex_unlock(&writer->lock);
+        int result = writer_deflate(writer, *(writer->buffers + index), *(writer->lengths + index), Z_NO_FLUSH);
+        pthread_mutex_lock(&writer->lock);
+        if (result == -1)
+        {
+            writer->error = 1;
+        }
+        writer->head = (writer->head + 1) % WRITER_BUFFERS;
+        writer->queued--;
+        pthread_cond_signal(&writer->drained);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    if (writer_deflate(writer, NULL, 0, Z_FINISH) == -1)
+    {
+        writer->error = 1;
+    }
+    return NULL;
+}
+
+/*
+ * Hands the current buffer over to be written and makes the next free
+ * buffer current, waiting for the compressor if all buffers are queued.
+ */
+static void writer_flush_buffer(WRITER *writer)
+{
+    int index = writer->current;
+    if (*(writer->lengths + index) == 0)
+    {
+        return;
+    }
+    if (writer->level == 0)
+    {
+        size_t length = *(writer->lengths + index);
+        if (fwrite(*(writer->buffers + index), 1, length, writer->out) != length)
+        {
+            writer->error = 1;
+        }
+        *(writer->lengths + index) = 0;
+        return;
+    }
+    pthread_mutex_lock(&writer->lock);
+    writer->queued++;
+    pthread_cond_signal(&writer->filled);
+    while (writer->queued == WRITER_BUFFERS)
+    {
+        pthread_cond_wait(&writer->drained, &writer->lock);
+    }
+    writer->current = (writer->head + writer->queued) % WRITER_BUFFERS;
+    pthread_mutex_unlock(&writer->lock);
+    *(writer->lengths + writer->current) = 0;
+}
+
+/**
+ * @brief  Open a buffered writer on an output stream.
+ * @details  If level is between 1 and 9, the data written is compressed
+ * in gzip format at that compression level by a background thread, which
+ * overlaps compression with the formatting of further output.  If level
+ * is 0, the data is written uncompressed.
+ *
+ * @param out  Stream to which the (possibly compressed) data is written.
+ * @param level  The gzip compression level, or 0 for no compression.
+ * @return the writer, or NULL if it could not be created.
+ */
+WRITER *writer_open(FILE *out, int level) {
+    WRITER *writer = malloc(sizeof(WRITER));
+    if (writer == NULL)
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        return NULL;
+    }
+    writer->out = out;
+    writer->level = level;
+    writer->error = 0;
+    writer->current = 0;
+    writer->head = 0;
+    writer->queued = 0;
+    writer->closing = 0;
+    *(writer->lengths + 0) = 0;
+    if (level == 0)
+    {
+        return writer;
+    }
+    memset(&writer->stream, 0, sizeof(z_stream));
+    // 16 added to the window size selects a gzip header and trailer
+    if (deflateInit2(&writer->stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        fprintf(stderr, "Error: Cannot initialize compression!\n");
+        free(writer);
+        return NULL;
+    }
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->filled, NULL);
+    pthread_cond_init(&writer->drained, NULL);
+    if (pthread_create(&writer->thread, NULL, writer_thread, writer) != 0)
+    {
+        fprintf(stderr, "Error: Cannot start compression thread!\n");
+        deflateEnd(&writer->stream);
+        free(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+/**
+ * @brief  Append data to a writer.
+ * @param writer  The writer.
+ * @param data  The data to append.
+ * @param length  The number of bytes of data.
+ */
+void writer_write(WRITER *writer, char *data, size_t length) {
+    while (length > 0)
+    {
+        size_t *used = writer->lengths + writer->current;
+        size_t count = WRITER_BUFFER_SIZE - *used;
+        if (count > length)
+        {
+            count = length;
+        }
+        memcpy(*(writer->buffers + writer->current) + *used, data, count);
+        *used += count;
+        data += count;
+        length -= count;
+        if (*used == WRITER_BUFFER_SIZE)
+        {
+            writer_flush_buffer(writer);
+        }
+    }
+}
+
+/**
+ * @brief  Append formatted data to a writer, as for printf().
+ * @details  The data is formatted on the stack if it fits in INPUT_MAX
+ * characters, and otherwise formatted again into a buffer of its length;
+ * if that cannot be allocated, the error is reported by writer_close().
+ * @param writer  The writer.
+ * @param format  The printf() format string.
+ */
+void writer_printf(WRITER *writer, char *format, ...) {
+    char field[INPUT_MAX + 1];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(field, INPUT_MAX + 1, format, args);
+    va_end(args);
+    if (length > INPUT_MAX)
+    {
+        char *long_field = malloc(length + 1);
+        if (long_field == NULL)
+        {
+            writer->error = 1;
+            return;
+        }
+        va_start(args, format);
+        vsnprintf(long_field, length + 1, format, args);
+        va_end(args);
+        writer_write(writer, long_field, length);
+        free(long_field);
+    }
+    else if (length > 0)
+    {
+        writer_write(writer, field, length);
+    }
+}
+
+/**
+ * @brief  Flush and close a writer, without closing the underlying stream.
+ * @param writer  The writer.
+ * @return 0 if all the data was successfully written, otherwise -1.
+ */
+int writer_close(WRITER *writer) {
+    writer_flush_buffer(writer);
+    if (writer->level != 0)
+    {
+        pthread_mutex_lock(&writer->lock);
+        writer->closing = 1;
+        pthread_cond_signal(&writer->filled);
+        pthread_mutex_unlock(&writer->lock);
+        pthread_join(writer->thread, NULL);
+        deflateEnd(&writer->stream);
+        pthread_mutex_destroy(&writer->lock);
+        pthread_cond_destroy(&writer->filled);
+        pthread_cond_destroy(&writer->drained);
+    }
+    int result = (writer->error || ferror(writer->out)) ? -1 : 0;
+    free(writer);
+    return result;
+}
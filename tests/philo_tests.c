@@ -0,0 +1,771 @@
+#include <sys/wait.h>
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+
+#include "global.h"
+
+#define progname "bin/philo"
+
+Test(output_suite, validargs_output_files_test, .timeout = 5) {
+    char *argv[] = {progname, "-n", "-E", "edges.out", "-M", "matrix.out", "-o", "a", NULL};
+    int argc = (sizeof(argv) / sizeof(char *)) - 1;
+    int ret = validargs(argc, argv);
+    int exp_ret = 0;
+    int opt = global_options;
+    int exp_opt = NEWICK_OPTION | EDGES_FILE_OPTION | MATRIX_FILE_OPTION;
+    cr_assert_eq(ret, exp_ret, "Invalid return for validargs.  Got: %d | Expected: %d",
+		 ret, exp_ret);
+    cr_assert_eq(opt, exp_opt, "Invalid options settings.  Got: 0x%x | Expected: 0x%x",
+		 opt, exp_opt);
+    cr_assert_eq(strcmp(edges_filename, "edges.out"), 0, "Edges file name not properly set.");
+    cr_assert_eq(strcmp(matrix_filename, "matrix.out"), 0, "Matrix file name not properly set.");
+}
+
+Test(output_suite, validargs_output_conflict_test, .timeout = 5) {
+    char *argv[] = {progname, "-m", "-M", "matrix.out", NULL};
+    int argc = (sizeof(argv) / sizeof(char *)) - 1;
+    int exp_ret = -1;
+    int ret = validargs(argc, argv);
+    cr_assert_eq(ret, exp_ret, "Invalid return for validargs.  Got: %d | Expected: %d",
+		 ret, exp_ret);
+}
+
+Test(output_suite, single_run_outputs_test, .timeout = 5) {
+    char *cmd = "mkdir -p test_output && bin/philo -E test_output/single_run.edges "
+	"-N test_output/single_run.newick -M test_output/single_run.matrix "
+	"< rsrc/saitou_nei.csv > /dev/null";
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program exited with 0x%x instead of EXIT_SUCCESS",
+		 return_code);
+    char *cmp = "bin/philo < rsrc/saitou_nei.csv | cmp - test_output/single_run.edges && "
+	"bin/philo -n < rsrc/saitou_nei.csv | cmp - test_output/single_run.newick && "
+	"bin/philo -m < rsrc/saitou_nei.csv | cmp - test_output/single_run.matrix";
+    return_code = WEXITSTATUS(system(cmp));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Outputs of a single run did not match the outputs of separate runs.");
+}
+
+Test(output_suite, validargs_compress_without_matrix_test, .timeout = 5) {
+    char *argv[] = {progname, "-n", "-z", "6", NULL};
+    int argc = (sizeof(argv) / sizeof(char *)) - 1;
+    int exp_ret = -1;
+    int ret = validargs(argc, argv);
+    cr_assert_eq(ret, exp_ret, "Invalid return for validargs.  Got: %d | Expected: %d",
+		 ret, exp_ret);
+}
+
+Test(output_suite, compressed_matrix_test, .timeout = 5) {
+    char *cmd = "mkdir -p test_output && bin/philo -m -z 6 < rsrc/saitou_nei.csv > test_output/compressed_matrix.gz";
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program exited with 0x%x instead of EXIT_SUCCESS",
+		 return_code);
+    char *cmp = "bin/philo -m < rsrc/saitou_nei.csv > test_output/plain_matrix.csv && "
+	"gunzip -c test_output/compressed_matrix.gz | cmp - test_output/plain_matrix.csv";
+    return_code = WEXITSTATUS(system(cmp));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Decompressed matrix did not match the uncompressed output.");
+}
+
+Test(output_suite, validargs_partial_matrix_test, .timeout = 5) {
+    char *argv[] = {progname, "-m", "-t", "-r", "@leaves", "-s", "2.5", NULL};
+    int argc = (sizeof(argv) / sizeof(char *)) - 1;
+    int ret = validargs(argc, argv);
+    int exp_ret = 0;
+    int opt = global_options;
+    int exp_opt = MATRIX_OPTION | TRIANGLE_OPTION | ROWS_OPTION | SPARSE_OPTION;
+    cr_assert_eq(ret, exp_ret, "Invalid return for validargs.  Got: %d | Expected: %d",
+		 ret, exp_ret);
+    cr_assert_eq(opt, exp_opt, "Invalid options settings.  Got: 0x%x | Expected: 0x%x",
+		 opt, exp_opt);
+    cr_assert_float_eq(matrix_cutoff, 2.5, 1e-9, "Cutoff not properly set.  Got: %f", matrix_cutoff);
+}
+
+Test(output_suite, sparse_matrix_test, .timeout = 5) {
+    char *cmd = "mkdir -p test_output && bin/philo -m -t -s 2 -r a,d,e < rsrc/wikipedia.csv > test_output/sparse_matrix.out";
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program exited with 0x%x instead of EXIT_SUCCESS",
+		 return_code);
+    char *cmp = "printf '0,5,2.00\\n0,6,0.00\\n0,7,0.00\\n3,7,2.00\\n4,7,1.00\\n' | cmp - test_output/sparse_matrix.out";
+    return_code = WEXITSTATUS(system(cmp));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program output did not match reference output.");
+}
+
+Test(output_suite, dense_triangle_matrix_test, .timeout = 5) {
+    // the cells below the diagonal are empty, so each row has a cell for every column
+    char *cmd = "mkdir -p test_output && bin/philo -m -t -r a,e -c a,b,e < rsrc/wikipedia.csv > test_output/dense_triangle.out && "
+	"printf ',a,b,e\\na,,5.00,8.00\\ne,,,\\n' | cmp - test_output/dense_triangle.out && "
+	"bin/philo -m -t < rsrc/wikipedia.csv | awk -F, 'NR == 1 { n = NF } NF != n { exit 1 }'";
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "The rows of the upper triangle were not aligned with the columns.");
+}
+
+Test(output_suite, writer_long_field_test, .timeout = 5) {
+    // a field longer than INPUT_MAX is written whole, with the delimiter after it
+    system("mkdir -p test_output");
+    FILE *out = fopen("test_output/long_field.out", "w");
+    cr_assert_neq(out, NULL, "Cannot create test_output/long_field.out");
+    WRITER *writer = writer_open(out, 0);
+    cr_assert_neq(writer, NULL, "Cannot open a writer.");
+    writer_printf(writer, ",%.2lf", 1e300);
+    writer_printf(writer, ",%.2lf\n", 1.0);
+    cr_assert_eq(writer_close(writer), 0, "The writer reported an error.");
+    fclose(out);
+    char expected[400];
+    snprintf(expected, sizeof(expected), ",%.2lf,1.00\n", 1e300);
+    char line[400] = "";
+    FILE *in = fopen("test_output/long_field.out", "r");
+    cr_assert_neq(in, NULL, "Cannot read test_output/long_field.out");
+    fgets(line, sizeof(line), in);
+    fclose(in);
+    cr_assert_eq(strcmp(line, expected), 0, "The long field was not written whole.");
+}
+
+Test(output_suite, patristic_query_test, .timeout = 5) {
+    // pairs by name or by index, answered from the tree, and no query file with -m
+    char *cmd = "mkdir -p test_output && printf 'a,b\\nd,e\\n\\n0,4\\nc,#7\\n' > test_output/queries.txt && "
+	"bin/philo -q test_output/queries.txt < rsrc/wikipedia.csv > test_output/queries.out && "
+	"printf 'a,b,5.00\\nd,e,3.00\\n0,4,8.00\\nc,#7,6.00\\n' | cmp - test_output/queries.out && "
+	"! bin/philo -m -q test_output/queries.txt < rsrc/wikipedia.csv > /dev/null 2>&1";
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "The patristic distances were not as expected.");
+}
+
+Test(output_suite, patristic_matrix_test, .timeout = 5) {
+    // the tree fits the additive input exactly, so the paths reproduce it
+    char *cmd = "mkdir -p test_output && bin/philo -p < rsrc/wikipedia.csv > test_output/patristic.out 2> test_output/patristic.err && "
+	"printf ',a,b,c,d,e\\na,0.00,5.00,9.00,9.00,8.00\\nb,5.00,0.00,10.00,10.00,9.00\\nc,9.00,10.00,0.00,8.00,7.00\\n"
+	"d,9.00,10.00,8.00,0.00,3.00\\ne,8.00,9.00,7.00,3.00,0.00\\n' | cmp - test_output/patristic.out && "
+	"grep -qx 'Largest patristic deviation: 0' test_output/patristic.err && "
+	"! bin/philo -p -n < rsrc/wikipedia.csv > /dev/null 2>&1";
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "The patristic distance matrix was not as expected.");
+}
+
+/*
+ * Writes a random symmetric distance matrix for n taxa to the given file.
+ * Distances are small integers, so that many pairs have tied Q values.
+ */
+static void write_random_matrix(char *path, int n, unsigned int seed)
+{
+    static int d[MAX_TAXA][MAX_TAXA];
+    FILE *f = fopen(path, "w");
+    cr_assert_neq(f, NULL, "Cannot create %s", path);
+    for (int i = 0; i < n; i++)
+    {
+        d[i][i] = 0;
+        for (int j = i + 1; j < n; j++)
+        {
+            seed = seed * 1103515245 + 12345;
+            d[i][j] = d[j][i] = 1 + (seed >> 16) % 9;
+        }
+    }
+    for (int i = 0; i < n; i++)
+        fprintf(f, ",t%d", i);
+    fprintf(f, "\n");
+    for (int i = 0; i < n; i++)
+    {
+        fprintf(f, "t%d", i);
+        for (int j = 0; j < n; j++)
+            fprintf(f, ",%d", d[i][j]);
+        fprintf(f, "\n");
+    }
+    fclose(f);
+}
+
+/*
+ * Stores in splits the splits of the internal edges of a tree on the taxa
+ * 0..n), given by its edges, sorted.  Each split is a string with one
+ * character for each taxon, '1' for the taxa on the side of the edge that
+ * does not hold taxon 0.  Two trees have the same topology if and only if
+ * they have the same splits.  Returns the number of splits.
+ */
+static int tree_splits(int n, int count, int (*ends)[2], char (*splits)[MAX_TAXA + 1])
+{
+    int num_splits = 0;
+    for (int e = 0; e < count; e++)
+    {
+        if (ends[e][0] < n || ends[e][1] < n)
+            continue;
+        static char side[MAX_NODES];
+        memset(side, 0, sizeof(side));
+        side[ends[e][1]] = 1;
+        for (int changed = 1; changed; )
+        {
+            changed = 0;
+            for (int f = 0; f < count; f++)
+            {
+                int x = ends[f][0], y = ends[f][1];
+                if (f != e && side[x] != side[y])
+                {
+                    side[x] = side[y] = 1;
+                    changed = 1;
+                }
+            }
+        }
+        for (int i = 0; i < n; i++)
+            splits[num_splits][i] = side[i] == side[0] ? '0' : '1';
+        splits[num_splits++][n] = '\0';
+    }
+    qsort(splits, num_splits, sizeof(*splits), (int (*)(const void *, const void *))strcmp);
+    return num_splits;
+}
+
+/*
+ * Returns the Robinson-Foulds distance between two trees given by their
+ * sorted splits: the number of splits of either that the other lacks.
+ */
+static int splits_distance(char (*a)[MAX_TAXA + 1], int na, char (*b)[MAX_TAXA + 1], int nb)
+{
+    int i = 0, j = 0, shared = 0;
+    while (i < na && j < nb)
+    {
+        int order = strcmp(a[i], b[j]);
+        if (order == 0)
+            shared++;
+        if (order <= 0)
+            i++;
+        if (order >= 0)
+            j++;
+    }
+    return na + nb - 2 * shared;
+}
+
+/*
+ * Loads the distances of a random tree on n taxa, as read_distance_data()
+ * would, and stores the splits of the tree in splits (see tree_splits()).
+ * The tree is made by joining random pairs of nodes, and its branch lengths
+ * are random multiples of 1/256, so that the distances are exact sums and
+ * the Q values of different pairs are rarely tied.  The distances are
+ * loaded directly, since they are not in a form that the CSV reader takes.
+ * Returns the number of splits.
+ */
+static int load_additive_tree(int n, unsigned int seed, char (*splits)[MAX_TAXA + 1])
+{
+    static int ends[MAX_EDGES][2];
+    static double lengths[MAX_EDGES];
+    int roots[MAX_TAXA];
+    int num_roots = n;
+    int num_tree_edges = 0;
+    int next = n;
+    for (int i = 0; i < n; i++)
+        roots[i] = i;
+    while (num_roots > 1)
+    {
+        int joined = num_roots == 2 ? 1 : 2;
+        for (int k = 0; k < joined; k++)
+        {
+            seed = seed * 1103515245 + 12345;
+            int r = (seed >> 16) % num_roots;
+            seed = seed * 1103515245 + 12345;
+            ends[num_tree_edges][0] = roots[r];
+            ends[num_tree_edges][1] = joined == 1 ? roots[1 - r] : next;
+            lengths[num_tree_edges++] = (1 + (seed >> 16) % 255) / 256.0;
+            roots[r] = roots[--num_roots];
+            if (joined == 1)
+                break;
+        }
+        if (joined == 2)
+            roots[num_roots++] = next++;
+    }
+    // the distance from each taxon to every node, along the edges
+    for (int i = 0; i < n; i++)
+    {
+        static double reached[MAX_NODES];
+        static char seen[MAX_NODES];
+        memset(seen, 0, sizeof(seen));
+        seen[i] = 1;
+        reached[i] = 0.0;
+        for (int changed = 1; changed; )
+        {
+            changed = 0;
+            for (int e = 0; e < num_tree_edges; e++)
+            {
+                int x = ends[e][0], y = ends[e][1];
+                if (seen[x] != seen[y])
+                {
+                    int from = seen[x] ? x : y, to = seen[x] ? y : x;
+                    reached[to] = reached[from] + lengths[e];
+                    seen[to] = 1;
+                    changed = 1;
+                }
+            }
+        }
+        for (int j = 0; j < n; j++)
+            distances[i][j] = reached[j];
+        sprintf(node_names[i], "t%d", i);
+        nodes[i].name = node_names[i];
+        active_node_map[i] = i;
+    }
+    num_taxa = n;
+    num_all_nodes = n;
+    num_active_nodes = n;
+    num_edges = 0;
+    return tree_splits(n, num_tree_edges, ends, splits);
+}
+
+/*
+ * Builds the tree of a random additive tree on n taxa (see
+ * load_additive_tree()) with the options given in argv, and returns the
+ * Robinson-Foulds distance of its topology from that of the true tree, or
+ * -1 if there was an error.
+ */
+static int additive_distance(char **argv, int n, unsigned int seed)
+{
+    static char truth[MAX_TAXA][MAX_TAXA + 1];
+    static char built[MAX_TAXA][MAX_TAXA + 1];
+    int argc = 0;
+    while (argv[argc] != NULL)
+        argc++;
+    if (validargs(argc, argv) == -1)
+        return -1;
+    int num_truth = load_additive_tree(n, seed, truth);
+    if (build_taxonomy(NULL) == -1)
+        return -1;
+    if (num_edges != 2 * n - 3)
+        return -1;
+    int num_built = tree_splits(n, num_edges, edge_nodes, built);
+    return splits_distance(truth, num_truth, built, num_built);
+}
+
+Test(engine_suite, validargs_engine_test, .timeout = 5) {
+    char *argv[] = {progname, "-e", "nj-mt", "-j", "4", NULL};
+    int argc = (sizeof(argv) / sizeof(char *)) - 1;
+    int ret = validargs(argc, argv);
+    int exp_ret = 0;
+    cr_assert_eq(ret, exp_ret, "Invalid return for validargs.  Got: %d | Expected: %d",
+		 ret, exp_ret);
+    cr_assert_eq(strcmp(engine_name, "nj-mt"), 0, "Engine name not properly set.");
+    cr_assert_eq(num_threads, 4, "Number of threads not properly set.  Got: %d", num_threads);
+}
+
+Test(engine_suite, validargs_unknown_engine_test, .timeout = 5) {
+    char *argv[] = {progname, "-e", "no-such-engine", NULL};
+    int argc = (sizeof(argv) / sizeof(char *)) - 1;
+    int exp_ret = -1;
+    int ret = validargs(argc, argv);
+    cr_assert_eq(ret, exp_ret, "Invalid return for validargs.  Got: %d | Expected: %d",
+		 ret, exp_ret);
+}
+
+Test(engine_suite, validargs_verify_with_engine_test, .timeout = 5) {
+    char *argv[] = {progname, "-V", "-e", "bionj", NULL};
+    int argc = (sizeof(argv) / sizeof(char *)) - 1;
+    int exp_ret = -1;
+    int ret = validargs(argc, argv);
+    cr_assert_eq(ret, exp_ret, "Invalid return for validargs.  Got: %d | Expected: %d",
+		 ret, exp_ret);
+}
+
+Test(engine_suite, verify_rsrc_test, .timeout = 10) {
+    char *cmd = "for f in rsrc/*.csv; do bin/philo -V -j 3 < $f > /dev/null || exit 1; done";
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "An exact engine did not reproduce the reference tree.");
+}
+
+Test(engine_suite, verify_generated_test, .timeout = 30) {
+    int sizes[] = {3, 4, 7, 20, 57, MAX_TAXA};
+    char cmd[200];
+    system("mkdir -p test_output");
+    for (int i = 0; i < (int)(sizeof(sizes) / sizeof(int)); i++)
+    {
+        write_random_matrix("test_output/generated.csv", sizes[i], 17 + i);
+        sprintf(cmd, "bin/philo -V -j %d < test_output/generated.csv > /dev/null", 2 + i);
+        int return_code = WEXITSTATUS(system(cmd));
+        cr_assert_eq(return_code, EXIT_SUCCESS,
+                     "An exact engine did not reproduce the reference tree for %d taxa.", sizes[i]);
+    }
+}
+
+Test(engine_suite, canonical_tie_break_test, .timeout = 5) {
+    // all pairs of four equidistant taxa tie; the first two are joined first
+    char *cmd = "mkdir -p test_output && printf ',A,B,C,D\\nA,0,1,1,1\\nB,1,0,1,1\\nC,1,1,0,1\\nD,1,1,1,0\\n' "
+	"| bin/philo > test_output/tie_break.out";
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program exited with 0x%x instead of EXIT_SUCCESS",
+		 return_code);
+    char *cmp = "printf '0,4,0.50\\n1,4,0.50\\n2,5,0.50\\n3,5,0.50\\n4,5,0.00\\n' | cmp - test_output/tie_break.out";
+    return_code = WEXITSTATUS(system(cmp));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program output did not match reference output.");
+}
+
+Test(engine_suite, compact_tie_break_test, .timeout = 5) {
+    // the compact engines re-check the tied pairs and join the same pairs as nj
+    char *cmd = "mkdir -p test_output && printf ',A,B,C,D\\nA,0,1,1,1\\nB,1,0,1,1\\nC,1,1,0,1\\nD,1,1,1,0\\n' "
+	"> test_output/tie.csv && bin/philo -e nj-f32 < test_output/tie.csv > test_output/tie_f32.out && "
+	"bin/philo -e nj-q16 < test_output/tie.csv > test_output/tie_q16.out";
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program exited with 0x%x instead of EXIT_SUCCESS",
+		 return_code);
+    char *cmp = "printf '0,4,0.50\\n1,4,0.50\\n2,5,0.50\\n3,5,0.50\\n4,5,0.00\\n' > test_output/tie.out && "
+	"cmp test_output/tie.out test_output/tie_f32.out && cmp test_output/tie.out test_output/tie_q16.out";
+    return_code = WEXITSTATUS(system(cmp));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program output did not match reference output.");
+}
+
+Test(engine_suite, row_sum_drift_test, .timeout = 5) {
+    // the diagnostic goes to the standard error and leaves the output unchanged
+    char *cmd = "mkdir -p test_output && bin/philo < rsrc/harrison2.csv > test_output/drift_ref.out && "
+	"bin/philo -D -e rnj < rsrc/harrison2.csv > test_output/drift.out 2> test_output/drift.err && "
+	"cmp test_output/drift_ref.out test_output/drift.out && "
+	"grep -q '^Largest row sum drift: ' test_output/drift.err";
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Row sum drift was not reported as expected.");
+}
+
+Test(engine_suite, collapse_duplicates_test, .timeout = 5) {
+    // e and f have the same row, so the tree is built on five taxa and f is attached to e
+    char *cmd = "mkdir -p test_output && printf ',a,b,c,d,e,f\\na,0,2,2,5,9,9\\nb,2,0,2,5,9,9\\nc,2,2,0,5,9,9\\n"
+	"d,5,5,5,0,8,8\\ne,9,9,9,8,0,0\\nf,9,9,9,8,0,0\\n' | bin/philo -u -n > test_output/collapse.out";
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program exited with 0x%x instead of EXIT_SUCCESS",
+		 return_code);
+    char *cmp = "printf '((((a:1.00,b:1.00)#7:0.00,c:1.00)#8:2.00,d:2.00)#6:6.00,f:0.00)#9;\\n' | cmp - test_output/collapse.out";
+    return_code = WEXITSTATUS(system(cmp));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program output did not match reference output.");
+}
+
+Test(engine_suite, bionj_test, .timeout = 5) {
+    char *cmd = "mkdir -p test_output && bin/philo -e bionj < rsrc/harrison2.csv > test_output/bionj.out";
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program exited with 0x%x instead of EXIT_SUCCESS",
+		 return_code);
+    // lambda = 0.625 for the first join, which shifts the C and D branches
+    char *cmp = "printf '0,4,0.75\\n1,4,1.25\\n2,5,1.19\\n3,5,0.81\\n4,5,0.25\\n' | cmp - test_output/bionj.out";
+    return_code = WEXITSTATUS(system(cmp));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program output did not match reference output.");
+}
+
+Test(engine_suite, upgma_test, .timeout = 5) {
+    char *cmd = "mkdir -p test_output && bin/philo -e upgma < rsrc/wikipedia.csv > test_output/upgma.out && "
+	"bin/philo -e wpgma < rsrc/wikipedia.csv > test_output/wpgma.out";
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program exited with 0x%x instead of EXIT_SUCCESS",
+		 return_code);
+    // the engines differ only in the weighting of the last join
+    char *cmp = "printf '3,5,1.50\\n4,5,1.50\\n0,6,2.50\\n1,6,2.50\\n2,7,3.75\\n5,7,2.25\\n6,7,2.92\\n' | cmp - test_output/upgma.out && "
+	"printf '3,5,1.50\\n4,5,1.50\\n0,6,2.50\\n1,6,2.50\\n2,7,3.75\\n5,7,2.25\\n6,7,3.00\\n' | cmp - test_output/wpgma.out";
+    return_code = WEXITSTATUS(system(cmp));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program output did not match reference output.");
+}
+
+Test(engine_suite, single_linkage_test, .timeout = 5) {
+    char *cmd = "mkdir -p test_output && bin/philo -e single < rsrc/wikipedia.csv > test_output/single.out && "
+	"bin/philo -e single -k 2 < rsrc/wikipedia.csv > test_output/single_k.out && "
+	"bin/philo -e single -l 5 < rsrc/wikipedia.csv > test_output/single_l.out";
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program exited with 0x%x instead of EXIT_SUCCESS",
+		 return_code);
+    // the cuts drop the longest spanning tree edges
+    char *cmp = "printf '3,5,1.50\\n4,5,1.50\\n0,6,2.50\\n1,6,2.50\\n2,7,3.50\\n5,7,2.00\\n6,7,2.00\\n' | cmp - test_output/single.out && "
+	"printf '3,4,3.00\\n0,1,5.00\\n2,4,7.00\\n' | cmp - test_output/single_k.out && "
+	"printf '3,4,3.00\\n0,1,5.00\\n' | cmp - test_output/single_l.out && "
+	"! bin/philo -k 2 < rsrc/wikipedia.csv 2> /dev/null";
+    return_code = WEXITSTATUS(system(cmp));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Program output did not match reference output.");
+}
+
+Test(engine_suite, validargs_seed_without_rnj_test, .timeout = 5) {
+    char *argv[] = {progname, "-R", "42", NULL};
+    int argc = (sizeof(argv) / sizeof(char *)) - 1;
+    int exp_ret = -1;
+    int ret = validargs(argc, argv);
+    cr_assert_eq(ret, exp_ret, "Invalid return for validargs.  Got: %d | Expected: %d",
+		 ret, exp_ret);
+}
+
+Test(engine_suite, rnj_topology_test, .timeout = 10) {
+    // nj recovers additive trees exactly; the relaxed engine is a heuristic that only stays close
+    static char *nj[] = { progname, NULL };
+    static char *rnj[] = { progname, "-e", "rnj", NULL };
+    static char *rnj_seeded[] = { progname, "-e", "rnj", "-R", "42", NULL };
+    for (unsigned int seed = 1; seed <= 10; seed++)
+    {
+        cr_assert_eq(additive_distance(nj, 40, seed), 0, "nj did not recover additive tree %u.", seed);
+        int distance = additive_distance(rnj, 40, seed);
+        cr_assert_eq(distance >= 0 && distance <= 10, 1,
+                     "Relaxed neighbor joining was %d splits from additive tree %u.", distance, seed);
+        distance = additive_distance(rnj_seeded, 40, seed);
+        cr_assert_eq(distance >= 0 && distance <= 10, 1,
+                     "Relaxed neighbor joining with -R was %d splits from additive tree %u.", distance, seed);
+    }
+}
+
+Test(engine_suite, nj_batch_test, .timeout = 10) {
+    // batched joins are a heuristic that stays close to additive trees, and do not depend on the threads
+    static char *batch[] = { progname, "-e", "nj-batch", "-j", "4", NULL };
+    for (unsigned int seed = 1; seed <= 10; seed++)
+    {
+        int distance = additive_distance(batch, 40, seed);
+        cr_assert_eq(distance >= 0 && distance <= 10, 1,
+                     "Batched neighbor joining was %d splits from additive tree %u.", distance, seed);
+    }
+    char *cmd = "bin/philo -e nj-batch -j 1 < test_output/batch_random.csv > test_output/batch_1.out && "
+	"bin/philo -e nj-batch -j 4 < test_output/batch_random.csv | cmp - test_output/batch_1.out";
+    system("mkdir -p test_output");
+    write_random_matrix("test_output/batch_random.csv", 60, 7);
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Batched neighbor joining depended on the number of threads.");
+}
+
+Test(engine_suite, bme_refinement_test, .timeout = 10) {
+    // refinement recovers additive trees even from far-off clusterings, and never lengthens the balanced tree
+    static char *refinements[][6] = {
+        { progname, "-b", "nni", NULL },
+        { progname, "-b", "spr", NULL },
+        { progname, "-e", "upgma", "-b", "nni", NULL },
+        { progname, "-e", "single", "-b", "spr", NULL }
+    };
+    for (int r = 0; r < 4; r++)
+    {
+        for (unsigned int seed = 1; seed <= 10; seed++)
+        {
+            cr_assert_eq(additive_distance(refinements[r], 40, seed), 0,
+                         "Refinement %d did not recover additive tree %u.", r, seed);
+        }
+    }
+    char *cmd = "for b in '' '-b nni' '-b spr'; do "
+	"bin/philo $b < test_output/bme_random.csv | awk -F, '{ s += $3 } END { print s }'; done "
+	"| awk 'NR > 1 && $1 > last + 0.5 { exit 1 } { last = $1 }'";
+    system("mkdir -p test_output");
+    write_random_matrix("test_output/bme_random.csv", 40, 11);
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Balanced minimum evolution refinement lengthened the tree.");
+}
+
+Test(engine_suite, divide_and_conquer_test, .timeout = 10) {
+    // merging the subtrees is a heuristic that stays close to additive trees, and does not depend on the threads
+    static char *dc[] = { progname, "-e", "dc", NULL };
+    static char *dc_small[] = { progname, "-e", "dc", "-L", "1", NULL };
+    for (unsigned int seed = 1; seed <= 10; seed++)
+    {
+        int distance = additive_distance(dc, 60, seed);
+        cr_assert_eq(distance >= 0 && distance <= 10, 1,
+                     "Divide and conquer was %d splits from additive tree %u.", distance, seed);
+        distance = additive_distance(dc_small, 60, seed);
+        cr_assert_eq(distance >= 0 && distance <= 10, 1,
+                     "Divide and conquer with -L 1 was %d splits from additive tree %u.", distance, seed);
+    }
+    char *cmd = "bin/philo -e dc -L 1 -j 1 < test_output/dc_random.csv > test_output/dc_1.out && "
+	"bin/philo -e dc -L 1 -j 4 < test_output/dc_random.csv | cmp - test_output/dc_1.out && "
+	"! bin/philo -L 1 < test_output/dc_random.csv > /dev/null 2>&1";
+    system("mkdir -p test_output");
+    write_random_matrix("test_output/dc_random.csv", 60, 13);
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "Divide-and-conquer neighbor joining depended on the number of threads.");
+}
+
+/*
+ * Builds the tree of the matrix in the given file with the engine given
+ * in argv, stopping the steps after the given number of joins so that
+ * taxonomy_finalize() has to finish it, and returns the number of active
+ * nodes that were left to it, or -1 if there was an error.
+ */
+static int build_in_steps(char *path, char **argv, int joins)
+{
+    int argc = 0;
+    while (argv[argc] != NULL)
+        argc++;
+    if (validargs(argc, argv) == -1)
+        return -1;
+    FILE *f = fopen(path, "r");
+    if (f == NULL || read_distance_data(f) == -1)
+        return -1;
+    fclose(f);
+    if (taxonomy_init() == -1 || taxonomy_step(joins) == -1)
+        return -1;
+    int left = num_active_nodes;
+    if (taxonomy_finalize() == -1)
+        return -1;
+    return left;
+}
+
+Test(engine_suite, deadline_test, .timeout = 10) {
+    // a build stopped early is finished as a whole tree, and one that is not stopped is unchanged
+    static char *engines[][4] = {
+        { progname, "-e", "nj", NULL },
+        { progname, "-e", "upgma", NULL },
+        { progname, "-e", "wpgma", NULL },
+        { progname, "-e", "single", NULL }
+    };
+    static int full_edges[MAX_EDGES][2];
+    static double full_lengths[MAX_EDGES];
+    system("mkdir -p test_output");
+    write_random_matrix("test_output/deadline_random.csv", 60, 17);
+    for (int e = 0; e < 4; e++)
+    {
+        int left = build_in_steps("test_output/deadline_random.csv", engines[e], 1000);
+        cr_assert_eq(left, 2, "The full build with %s did not finish by its own steps.", engines[e][2]);
+        int full = num_edges;
+        for (int i = 0; i < full; i++)
+        {
+            full_edges[i][0] = edge_nodes[i][0];
+            full_edges[i][1] = edge_nodes[i][1];
+            full_lengths[i] = edge_lengths[i];
+        }
+        left = build_in_steps("test_output/deadline_random.csv", engines[e], 20);
+        cr_assert_eq(left > 2, 1, "The build with %s was not stopped early.", engines[e][2]);
+        cr_assert_eq(num_edges, 2 * 60 - 3, "The stopped build with %s did not give a whole tree.", engines[e][2]);
+        if (e == 0)
+        {
+            continue;
+        }
+        // the clustering engines finish with their own steps, so the tree is that of a full build
+        for (int i = 0; i < full; i++)
+        {
+            cr_assert_eq(edge_nodes[i][0] == full_edges[i][0] && edge_nodes[i][1] == full_edges[i][1]
+                         && edge_lengths[i] == full_lengths[i], 1,
+                         "The stopped build with %s differs from the full build at edge %d.", engines[e][2], i);
+        }
+    }
+    char *cmd = "bin/philo < rsrc/saitou_nei.csv > test_output/deadline_nj.out && "
+	"bin/philo -w 100000 < rsrc/saitou_nei.csv | cmp - test_output/deadline_nj.out";
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "A deadline that was not reached changed the tree.");
+}
+
+Test(engine_suite, stepwise_rebuild_test, .timeout = 5) {
+    // the stepwise API builds the same tree again from the data read once, duplicates set aside
+    static int first_edges[MAX_EDGES][2];
+    static double first_lengths[MAX_EDGES];
+    char *argv[] = {progname, "-u", NULL};
+    system("mkdir -p test_output && printf ',a,b,c,d,e,f\\na,0,2,2,5,9,9\\nb,2,0,2,5,9,9\\nc,2,2,0,5,9,9\\n"
+           "d,5,5,5,0,8,8\\ne,9,9,9,8,0,0\\nf,9,9,9,8,0,0\\n' > test_output/rebuild.csv");
+    int left = build_in_steps("test_output/rebuild.csv", argv, 1000);
+    cr_assert_eq(left, 2, "The first build did not finish by its own steps.");
+    int first = num_edges;
+    memcpy(first_edges, edge_nodes, first * sizeof(*edge_nodes));
+    memcpy(first_lengths, edge_lengths, first * sizeof(*edge_lengths));
+    cr_assert_eq(taxonomy_init(), 5, "The second build did not start from the five representatives.");
+    cr_assert_eq(taxonomy_step(1000) != -1 && taxonomy_finalize() != -1, 1, "The second build failed.");
+    cr_assert_eq(num_edges, first, "The second build made %d edges instead of %d.", num_edges, first);
+    cr_assert_eq(memcmp(first_edges, edge_nodes, first * sizeof(*edge_nodes)) == 0
+                 && memcmp(first_lengths, edge_lengths, first * sizeof(*edge_lengths)) == 0, 1,
+                 "The second build did not give the same tree.");
+}
+
+Test(engine_suite, lazy_engine_test, .timeout = 10) {
+    // thirty sequences, whose rows of distances do not fit in a cache of three
+    char *cmd = "mkdir -p test_output && awk 'BEGIN { srand(3); for (k = 0; k < 2000; k++) s = s substr(\"ACGT\", int(rand() * 4) + 1, 1); "
+	"for (i = 0; i < 30; i++) { t = s; for (k = 1; k <= 2000; k++) if (rand() < 0.01 * (i % 9 + 1)) t = substr(t, 1, k - 1) \"T\" substr(t, k + 1); "
+	"printf \">s%d\\n%s\\n\", i, t } }' > test_output/lazy.fa && "
+	"bin/philo -i fasta -d jc69 -n < test_output/lazy.fa > test_output/lazy_nj.newick && "
+	"bin/philo -i fasta -d jc69 -e nj-lazy -F 3 -n < test_output/lazy.fa | cmp -s - test_output/lazy_nj.newick && "
+	"! bin/philo -i fasta -e nj-lazy -m < test_output/lazy.fa > /dev/null 2>&1";
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "The matrix-free engine did not build the tree of the reference engine.");
+}
+
+Test(engine_suite, compact_tree_newick_test, .timeout = 5) {
+    // the Newick output walks the compact copy of the tree, rooted at either end of an edge
+    char *cmd = "bin/philo -n < rsrc/wikipedia.csv | grep -qxF '(((d:2.00,e:1.00)#7:2.00,c:4.00)#6:3.00,a:2.00)#5;' && "
+	"bin/philo -n -o a < rsrc/wikipedia.csv | grep -qxF '(((d:2.00,e:1.00)#7:2.00,c:4.00)#6:3.00,b:3.00)#5;'";
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "The Newick output of the compact tree was not as expected.");
+}
+
+Test(input_suite, fasta_p_distance_test, .timeout = 5) {
+    // gaps and ambiguity codes are left out of the comparison, and sequences must align
+    char *cmd = "printf '>a first\\nACGTA\\nCGTAC\\n>b\\nACGTACGTTC\\n>c\\nAC-TNCGGAA\\n' "
+	"| bin/philo -i fasta -m | cut -d, -f1-4 | head -4 > test_output/fasta.out && "
+	"printf ',a,b,c\\na,0.00,0.10,0.25\\nb,0.10,0.00,0.38\\nc,0.25,0.38,0.00\\n' | cmp - test_output/fasta.out && "
+	"! printf '>a\\nACGT\\n>b\\nACG\\n' | bin/philo -i fasta > /dev/null 2>&1";
+    system("mkdir -p test_output");
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "The p-distances computed from the alignment were not as expected.");
+}
+
+Test(input_suite, fasta_model_test, .timeout = 5) {
+    // three transitions in twenty sites, under each model
+    char *cmd = "for m in jc69,0.17 k2p,0.18 tn93,0.24; do "
+	"printf '>a\\nAAAAACCCCCGGGGGTTTTT\\n>b\\nGGGAACCCCCGGGGGTTTTT\\n' "
+	"| bin/philo -i fasta -d ${m%,*} -m | sed -n 2p | grep -qx \"a,0.00,${m#*,}\" || exit 1; done && "
+	"! bin/philo -d k2p < rsrc/wikipedia.csv > /dev/null 2>&1";
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "The distances corrected by the models were not as expected.");
+}
+
+Test(input_suite, fasta_threads_test, .timeout = 10) {
+    // forty sequences of 3000 sites, differing from the first at every (i+2)th site
+    char *cmd = "mkdir -p test_output && awk 'BEGIN { for (i = 0; i < 40; i++) { printf \">s%d\\n\", i; "
+	"for (k = 0; k < 3000; k++) printf \"%s\", (i > 0 && k % (i + 2) == 0) ? \"T\" : substr(\"ACG\", k % 3 + 1, 1); "
+	"printf \"\\n\" } }' > test_output/fasta_threads.fa && "
+	"bin/philo -i fasta -d k2p -j 1 -m < test_output/fasta_threads.fa > test_output/fasta_threads_1.out && "
+	"bin/philo -i fasta -d k2p -j 5 -m < test_output/fasta_threads.fa > test_output/fasta_threads_5.out && "
+	"cmp -s test_output/fasta_threads_1.out test_output/fasta_threads_5.out && "
+	"sed -n 3p test_output/fasta_threads_1.out | grep -q '^s1,0.48,0.00,'";
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "The distances computed by several threads were not those computed by one.");
+}
+
+Test(input_suite, protein_distance_test, .timeout = 5) {
+    // two differences and a gap in ten residues, without and with each model
+    char *cmd = "mkdir -p test_output && printf '>a\\nMKTAYIAKQR\\n>b\\nmksaylak-r\\n' > test_output/protein.fa && "
+	"bin/philo -i protein -m < test_output/protein.fa | sed -n 2p | grep -qx 'a,0.00,0.22' && "
+	"for m in poisson,0.25 kimura,0.26; do "
+	"bin/philo -i protein -d ${m%,*} -m < test_output/protein.fa | sed -n 2p | grep -qx \"a,0.00,${m#*,}\" || exit 1; done && "
+	"! bin/philo -i protein -d k2p < test_output/protein.fa > /dev/null 2>&1";
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "The distances computed from the protein alignment were not as expected.");
+}
+
+Test(input_suite, genotype_distance_test, .timeout = 5) {
+    // a multiallelic variant is skipped, and a missing call leaves two variants for c
+    char *cmd = "printf '##fileformat=VCFv4.2\\n#CHROM\\tPOS\\tID\\tREF\\tALT\\tQUAL\\tFILTER\\tINFO\\tFORMAT\\ta\\tb\\tc\\n"
+	"1\\t10\\t.\\tA\\tG\\t.\\t.\\t.\\tGT:DP\\t0/0:4\\t0/1:2\\t./.:0\\n"
+	"1\\t20\\t.\\tC\\tT,G\\t.\\t.\\t.\\tGT\\t0/0\\t1/2\\t0/0\\n"
+	"1\\t30\\t.\\tC\\tT\\t.\\t.\\t.\\tGT\\t0|0\\t1|1\\t0|1\\n"
+	"1\\t40\\t.\\tG\\tA\\t.\\t.\\t.\\tGT\\t1/1\\t1/1\\t0/0\\n' "
+	"| bin/philo -i vcf -m -j 2 2> /dev/null | sed -n 2,4p | cut -d, -f1-4 | tr '\\n' ' ' "
+	"| grep -qx 'a,0.00,0.50,0.75 b,0.50,0.00,0.75 c,0.75,0.75,0.00 '";
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "The allele-sharing distances computed from the genotypes were not as expected.");
+}
+
+Test(input_suite, genome_sketch_test, .timeout = 10) {
+    // two copies of a genome, one compressed, and a genome with every hundredth base changed
+    char *cmd = "mkdir -p test_output && rm -rf test_output/sketches && "
+	"awk 'BEGIN { srand(7); printf \">c1\\n\"; for (k = 0; k < 20000; k++) printf \"%s\", substr(\"ACGT\", int(rand() * 4) + 1, 1) }' "
+	"> test_output/ga.fa && cp test_output/ga.fa test_output/gb.fa && gzip -f test_output/gb.fa && "
+	"awk 'NR == 2 { for (k = 1; k <= length($0); k += 100) $0 = substr($0, 1, k - 1) (substr($0, k, 1) == \"A\" ? \"C\" : \"A\") substr($0, k + 1) } { print }' "
+	"test_output/ga.fa > test_output/gc.fa && "
+	"printf 'test_output/ga.fa\\ntest_output/gb.fa.gz\\ntest_output/gc.fa\\n' > test_output/genomes.txt && "
+	"bin/philo -i genomes -K 15 -C test_output/sketches -m < test_output/genomes.txt > test_output/genomes_1.out && "
+	"ls test_output/sketches | grep -q '^gc-' && "
+	"bin/philo -i genomes -K 15 -C test_output/sketches -m < test_output/genomes.txt | cmp -s - test_output/genomes_1.out && "
+	"grep -q '^ga,0.00,0.00,0.01,' test_output/genomes_1.out";
+    int return_code = WEXITSTATUS(system(cmd));
+    cr_assert_eq(return_code, EXIT_SUCCESS,
+                 "The distances estimated from the genome sketches were not as expected.");
+}